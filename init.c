@@ -39,6 +39,7 @@
 #include "nsdbidrv.h"
 
 extern Ns_TclInterpInitProc DbiInitInterp;
+extern void DbiRenderPoolInit(int numThreads);
 
 
 /*
@@ -72,16 +73,31 @@ typedef struct Pool {
     int                   idlehandles;     /* Number of unused handles in pool. */
 
     size_t                cachesize;       /* Size of prepared statement cache. */
+    Ns_Cache             *fragments;       /* Rendered templates, or NULL. */
 
     int                   maxRows;         /* Default max rows a query may return. */
     Ns_Time               maxidle;         /* Time interval before unused handle is closed.  */
     Ns_Time               maxopen;         /* Time interval before active handle is closed. */
     int                   maxqueries;      /* Close active handle after maxqueries. */
     Ns_Time               timeout;         /* Default Time interval to wait for handle. */
+    Ns_Time               validationinterval; /* Ping handles idle for longer than this. */
+    int                   retries;         /* Max reconnect-and-retry per read query. */
+    Ns_Time               retrytimeout;    /* Time budget for retrying a read query. */
 
     int                   epoch;           /* Epoch for bouncing handles. */
     int                   stopping;        /* Server is shutting down. */
 
+    struct Handle        *closePtr;        /* Retired handles waiting to be closed. */
+    int                   closers;         /* Running closer threads. */
+    int                   closing;         /* Retired handles not yet closed. */
+
+    int                   breakerthreshold;  /* Consecutive failures which open the breaker. */
+    Ns_Time               breakerbackoff;    /* Initial delay before probing the db. */
+    Ns_Time               breakermaxbackoff; /* Upper bound for the probe delay. */
+    int                   failures;          /* Consecutive open or exec failures. */
+    int                   breakerOpen;       /* Fail handle requests fast while set. */
+    Ns_Time               probeDelay;        /* Current delay between probes. */
+
     struct {
         unsigned int      handlegets;      /* Total No. requests for a handle. */
         unsigned int      handlemisses;    /* Handle requests which timed out. */
@@ -91,6 +107,13 @@ typedef struct Pool {
         unsigned int      otimecloses;     /* Handle closes due to maxopen. */
         unsigned int      atimecloses;     /* Handle closed due to maxidle. */
         unsigned int      querycloses;     /* Handle closes due to maxqueries. */
+        unsigned int      breakertrips;    /* Times the circuit breaker opened. */
+        unsigned int      fastfails;       /* Handle requests refused by the breaker. */
+        unsigned int      validations;     /* Idle handles checked with the ping proc. */
+        unsigned int      validationfailures; /* Handles found dead by the ping proc. */
+        unsigned int      reconnects;      /* Handles reconnected after a lost connection. */
+        unsigned int      fragmenthits;    /* Fragment cache lookups which found output. */
+        unsigned int      fragmentmisses;  /* Fragment cache lookups which did not. */
     } stats;
 
 
@@ -102,6 +125,7 @@ typedef struct Pool {
 
     const char           *drivername;   /* Driver identifier. */
     const char           *database;     /* Database identifier. */
+    int                   abiVersion;   /* Driver compiled against DBI_ABI_VERSION. */
 
     Dbi_OpenProc         *openProc;
     Dbi_CloseProc        *closeProc;
@@ -117,6 +141,9 @@ typedef struct Pool {
     Dbi_TransactionProc  *transProc;
     Dbi_FlushProc        *flushProc;
     Dbi_ResetProc        *resetProc;
+    Dbi_PingProc         *pingProc;     /* Optional. */
+    Dbi_BindListProc     *bindListProc; /* Optional. */
+    Dbi_ColumnTypedValueProc *columnTypedValueProc; /* Optional. */
 
 } Pool;
 
@@ -151,6 +178,7 @@ typedef struct Handle {
     time_t             atime;        /* Time when handle was last used. */
     int                n;            /* Handle n of maxhandles when acquired. */
     int                epoch;
+    const char        *closeReason;  /* Why a retired handle is being closed. */
 
     /* Result status. */
 
@@ -170,6 +198,28 @@ typedef struct Handle {
 } Handle;
 
 
+/*
+ * The following structure is the layout of a Dbi_Value for drivers
+ * of ABI version 1, which have no native type.
+ */
+
+typedef struct LegacyValue {
+    const char       *data;
+    size_t            length;
+    int               binary;
+} LegacyValue;
+
+/*
+ * The following structure defines a bind variable of a statement.
+ */
+
+typedef struct BindVar {
+    const char       *name;         /* (Hash table key) */
+    int               isList;       /* Bound as a native array: :name[] */
+    TCL_SIZE_T        keyLength;    /* Length of name without [] suffix. */
+    TCL_SIZE_T        element;      /* Occurrence of an expanded :name[], or DBI_ELEMENT_* */
+} BindVar;
+
 /*
  * The following structure defines a prepared statement kept
  * in a per-handle cache.
@@ -191,26 +241,45 @@ typedef struct Statement {
      * Private to a Statement.
      */
 
+    unsigned long     serial;       /* Unique (per process) statement ID. */
     Handle           *handlePtr;    /* Handle this Statement belongs to. */
     unsigned int      numCols;      /* Number of columns in a result. */
     unsigned int      numVars;      /* Number of bind variables. */
+    unsigned int      varsAvailable;/* Size of the vars array. */
 
     Tcl_HashEntry    *hPtr;         /* Entry in the per-handle statement table. */
 
-    Tcl_HashTable     bindTable;    /* Bind variables by name. */
-    struct {
-        const char   *name;         /* (Hash table key) */
-    } vars[DBI_MAX_BIND];           /* Bind variables by index. */
+    Tcl_HashTable     bindTable;    /* Occurrences of bind variables by name. */
+    BindVar          *vars;         /* Bind variables by index. */
+    BindVar           staticVars[DBI_STATIC_BIND];
 
     char              driverSql[1]; /* Driver specific SQL. */
 
 } Statement;
 
+/*
+ * The following structure is the value of an entry in the fragment
+ * cache of a pool: the rendered output followed by the tags of the
+ * entry, each NUL terminated, and an empty tag marking the end.
+ */
+
+typedef struct Fragment {
+    TCL_SIZE_T        length;       /* Length of the output. */
+    char             *tags;         /* First tag, after the output. */
+    char              data[1];      /* Output, NUL terminated. */
+} Fragment;
+
 
 /*
  * Local functions defined in this file
  */
 
+/*
+ * The maximum number of threads per pool closing retired handles.
+ */
+
+#define MAX_CLOSERS 8
+
 #define Log(handle,level,msg,...)                               \
     Ns_Log(level, "dbi[%s]: " msg,                              \
            ((Handle *) handle)->poolPtr->module, __VA_ARGS__)
@@ -219,19 +288,32 @@ typedef struct Statement {
 static void MapPool(ServerData *sdataPtr, const Pool *poolPtr, int isdefault);
 static ServerData *GetServer(const char *server);
 static void ReturnHandle(Handle *handle) NS_GNUC_NONNULL(1);
-static int CloseIfStale(Handle *handlePtr, time_t now) NS_GNUC_NONNULL(1);
+static void RetireHandle(Handle *handlePtr, const char *reason) NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(2);
+static void RetireIdleHandles(Pool *poolPtr, const char *reason) NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(2);
+static void RetireStaleHandle(Handle *handlePtr, const char *reason) NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(2);
+static void FreeHandle(Handle *handlePtr) NS_GNUC_NONNULL(1);
+static const char *StaleReason(Handle *handlePtr, time_t now) NS_GNUC_NONNULL(1);
+static Handle *NewHandle(Pool *poolPtr) NS_GNUC_NONNULL(1);
 static int Connect(Handle *) NS_GNUC_NONNULL(1);
 static int Connected(Handle *handlePtr) NS_GNUC_NONNULL(1);
-static void CheckPool(Pool *poolPtr, int stale) NS_GNUC_NONNULL(1);
+static int Validate(Handle *handlePtr) NS_GNUC_NONNULL(1);
+static int ValidationDue(const Handle *handlePtr, time_t now) NS_GNUC_NONNULL(1);
+static void Disconnect(Handle *handlePtr, const char *reason) NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(2);
+static void CheckPool(Pool *poolPtr) NS_GNUC_NONNULL(1);
+static void BreakerUpdate(Pool *poolPtr, int success) NS_GNUC_NONNULL(1);
 static Statement *ParseBindVars(Handle *handlePtr, const char *sql, TCL_SIZE_T sqlLength);
-static int DefineBindVar(Statement *stmtPtr, const char *name, Tcl_DString *dsPtr);
+static TCL_SIZE_T SplitBindVar(const char *name, TCL_SIZE_T *keyLengthPtr);
+static void AppendBindVar(const Pool *poolPtr, const char *name, int index, Tcl_DString *dsPtr);
+static void DefineBindVar(Statement *stmtPtr, const char *name);
 
 static Ns_Callback FreeStatement;
 static Ns_Callback FreeThreadHandles;
 
 static Ns_SchedProc    ScheduledPoolCheck;
+static Ns_SchedProc    BreakerProbe;
 static Ns_ArgProc      PoolCheckArgProc;
 static Ns_ShutdownProc AtShutdown;
+static Ns_ThreadProc   Closer;
 
 /*
  * Static variables defined in this file
@@ -239,6 +321,8 @@ static Ns_ShutdownProc AtShutdown;
 
 static Tcl_HashTable  serversTable;
 static Ns_Tls         tls;          /* Per-thread handle cache. */
+static Ns_Mutex       serialLock;   /* Lock for nextSerial. */
+static unsigned long  nextSerial = 1; /* Next statement serial number. */
 
 
 
@@ -253,7 +337,8 @@ static Ns_Tls         tls;          /* Per-thread handle cache. */
  *      None.
  *
  * Side effects:
- *      Registers dbi commands for all servers.
+ *      Registers dbi commands for all servers and starts the threads
+ *      which render parallel templates.
  *
  *----------------------------------------------------------------------
  */
@@ -272,10 +357,20 @@ Dbi_LibInit(void)
         Nsd_LibInit();
         Tcl_InitHashTable(&serversTable, TCL_STRING_KEYS);
         Ns_TlsAlloc(&tls, FreeThreadHandles);
+        Ns_MutexInit(&serialLock);
+        Ns_MutexSetName(&serialLock, "dbi:serial");
 
         Ns_RegisterProcInfo((ns_funcptr_t)ScheduledPoolCheck, "dbi:idlecheck", PoolCheckArgProc);
+        Ns_RegisterProcInfo((ns_funcptr_t)BreakerProbe, "dbi:probe", PoolCheckArgProc);
         Ns_RegisterProcInfo((ns_funcptr_t)DbiInitInterp, "dbi:initinterp", NULL);
 
+        /*
+         * Threads which render chunks of dbi_rows -parallel, shared by
+         * all servers and pools.
+         */
+
+        DbiRenderPoolInit(Ns_ConfigIntRange("ns/module/nsdbi", "renderthreads", 4, 0, 64));
+
         set = Ns_ConfigGetSection("ns/servers");
         for (i = 0; i < Ns_SetSize(set); i++) {
             Tcl_HashEntry *hPtr;
@@ -301,6 +396,34 @@ Dbi_LibInit(void)
  *
  * Dbi_RegisterDriver --
  *
+ *      Register a driver compiled before ABI versioning, i.e. ABI
+ *      version 1. Drivers compiled against the current headers call
+ *      Dbi_RegisterDriverAbi() through the Dbi_RegisterDriver macro.
+ *
+ * Results:
+ *      See: Dbi_RegisterDriverAbi().
+ *
+ * Side effects:
+ *      See: Dbi_RegisterDriverAbi().
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+(Dbi_RegisterDriver)(const char *server, const char *module,
+                     const char *driver, const char *database,
+                     const Dbi_DriverProc *procs, ClientData configData)
+{
+    return Dbi_RegisterDriverAbi(server, module, driver, database,
+                                 procs, configData, 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_RegisterDriverAbi --
+ *
  *      Register dbi procs for a driver and create the configured pools.
  *
  * Results:
@@ -313,9 +436,10 @@ Dbi_LibInit(void)
  */
 
 int
-Dbi_RegisterDriver(const char *server, const char *module,
-                   const char *driver, const char *database,
-                   const Dbi_DriverProc *procs, ClientData configData)
+Dbi_RegisterDriverAbi(const char *server, const char *module,
+                      const char *driver, const char *database,
+                      const Dbi_DriverProc *procs, ClientData configData,
+                      int abiVersion)
 {
     ServerData            *sdataPtr;
     const Dbi_DriverProc  *procPtr;
@@ -325,16 +449,24 @@ Dbi_RegisterDriver(const char *server, const char *module,
     const char            *path;
     int                    nprocs, isdefault;
     Ns_Time                interval;
+    size_t                 fragmentcachesize;
 
     NS_NONNULL_ASSERT(module != NULL);
     NS_NONNULL_ASSERT(driver != NULL);
     NS_NONNULL_ASSERT(database != NULL);
     NS_NONNULL_ASSERT(procs != NULL);
 
+    if (abiVersion < 1 || abiVersion > DBI_ABI_VERSION) {
+        Ns_Log(Error, "dbi[%s]: Dbi_RegisterDriver: unsupported driver ABI version: %d",
+               module, abiVersion);
+        return NS_ERROR;
+    }
+
     poolPtr = ns_calloc(1, sizeof(Pool));
     poolPtr->drivername = driver;
     poolPtr->database = database;
     poolPtr->configData = configData;
+    poolPtr->abiVersion = abiVersion;
 
     for (procPtr = procs, nprocs = 0; procPtr->u.proc != NULL; procPtr++) {
         switch (procPtr->id) {
@@ -380,6 +512,15 @@ Dbi_RegisterDriver(const char *server, const char *module,
         case Dbi_ResetProcId:
             poolPtr->resetProc = procPtr->u.resetProc;
             break;
+        case Dbi_PingProcId:
+            poolPtr->pingProc = procPtr->u.pingProc;
+            continue; /* Optional. */
+        case Dbi_BindListProcId:
+            poolPtr->bindListProc = procPtr->u.bindListProc;
+            continue; /* Optional. */
+        case Dbi_ColumnTypedValueProcId:
+            poolPtr->columnTypedValueProc = procPtr->u.columnTypedValueProc;
+            continue; /* Optional. */
             /*default:
             Ns_Log(Error, "dbi: Dbi_RegisterDriver: invalid Dbi_ProcId: %d",
                    procPtr->id);
@@ -390,7 +531,7 @@ Dbi_RegisterDriver(const char *server, const char *module,
     }
 
     /*
-     * All callbacks are (currently) required.
+     * All callbacks up to Dbi_ResetProcId are required.
      */
 
     if (nprocs < Dbi_ResetProcId) {
@@ -417,13 +558,45 @@ Dbi_RegisterDriver(const char *server, const char *module,
     poolPtr->maxhandles = Ns_ConfigIntRange(path, "maxhandles", 0,          0, INT_MAX);
     poolPtr->maxRows    = Ns_ConfigIntRange(path, "maxrows",    1000,    1000, INT_MAX);
     poolPtr->maxqueries = Ns_ConfigIntRange(path, "maxqueries", 0,          0, INT_MAX);
+    poolPtr->retries    = Ns_ConfigIntRange(path, "retries",    1,          0, INT_MAX);
 
     Ns_ConfigTimeUnitRange(path, "timeout", "10s", 0, 0, INT_MAX, 0, &poolPtr->timeout);
     Ns_ConfigTimeUnitRange(path, "maxidle", "0s", 0, 0, INT_MAX, 0, &poolPtr->maxidle);
     Ns_ConfigTimeUnitRange(path, "maxopen", "0s", 0, 0, INT_MAX, 0, &poolPtr->maxopen);
+    Ns_ConfigTimeUnitRange(path, "validationinterval", "0s", 0, 0, INT_MAX, 0,
+                           &poolPtr->validationinterval);
+    Ns_ConfigTimeUnitRange(path, "retrytimeout", "5s", 0, 0, INT_MAX, 0,
+                           &poolPtr->retrytimeout);
+
+    poolPtr->breakerthreshold = Ns_ConfigIntRange(path, "breakerthreshold", 0, 0, INT_MAX);
+    Ns_ConfigTimeUnitRange(path, "breakerbackoff", "1s", 0, 10000, INT_MAX, 0,
+                           &poolPtr->breakerbackoff);
+    Ns_ConfigTimeUnitRange(path, "breakermaxbackoff", "1m", 0, 10000, INT_MAX, 0,
+                           &poolPtr->breakermaxbackoff);
+
+    /*
+     * The fragment cache of rendered templates is shared by all
+     * handles of the pool. A size of 0 disables it.
+     */
+
+    fragmentcachesize = (size_t)Ns_ConfigMemUnitRange(path, "fragmentcachesize", "1MB", 1024*1024,
+                                                      0, INT_MAX);
+    if (fragmentcachesize > 0u) {
+        char buf[100];
 
-    if (   (poolPtr->maxidle.sec != 0 && poolPtr->maxidle.usec != 0)
-        || (poolPtr->maxopen.sec != 0 && poolPtr->maxopen.usec != 0)
+        snprintf(buf, sizeof(buf), "dbi:fragments:%s", module);
+        poolPtr->fragments = Ns_CacheCreateSz(buf, TCL_STRING_KEYS,
+                                              fragmentcachesize, ns_free);
+    }
+
+    /*
+     * With a ping proc the check always runs, as validation may be
+     * enabled later with dbi_ctl validationinterval.
+     */
+
+    if (   (poolPtr->maxidle.sec != 0 || poolPtr->maxidle.usec != 0)
+        || (poolPtr->maxopen.sec != 0 || poolPtr->maxopen.usec != 0)
+        || poolPtr->pingProc != NULL
         ) {
         Ns_ConfigTimeUnitRange(path, "checkinterval", "5m", 30, 0, INT_MAX, 0, &interval);
         Ns_ScheduleProcEx(ScheduledPoolCheck, poolPtr, NS_SCHED_THREAD, &interval, NULL);
@@ -627,11 +800,18 @@ Dbi_ListPools(Tcl_DString *ds, const char *server)
  *      Get a single handle from a pool within the given timeout.
  *
  * Results:
- *      NS_OK, NS_TIMEOUT or NS_ERROR.
+ *      NS_OK, NS_TIMEOUT, DBI_UNAVAILABLE or NS_ERROR.
  *
  * Side effects:
  *      New database handle may be opened if needed.
  *
+ *      Fails immediately with DBI_UNAVAILABLE while the pool's
+ *      circuit breaker is open.
+ *
+ *      A handle idle for longer than the validationinterval is
+ *      checked with the driver's ping proc and reconnected if dead.
+ *      A handle from an older pool epoch is reconnected.
+ *
  *----------------------------------------------------------------------
  */
 
@@ -671,6 +851,19 @@ Dbi_GetHandle(Dbi_Pool *pool, Ns_Time *timeoutPtr, Dbi_Handle **handlePtrPtr)
 
         Ns_MutexLock(&poolPtr->lock);
 
+        /*
+         * Fail fast while the circuit breaker is open. The db is known
+         * to be unreachable and a background probe will close the
+         * breaker again once a connection succeeds. A thread which
+         * already holds a connected handle of the pool keeps using it.
+         */
+
+        if (poolPtr->breakerOpen) {
+            poolPtr->stats.fastfails++;
+            Ns_MutexUnlock(&poolPtr->lock);
+            return DBI_UNAVAILABLE;
+        }
+
         poolPtr->stats.handlegets++;
 
         while (status == NS_OK
@@ -689,22 +882,7 @@ Dbi_GetHandle(Dbi_Pool *pool, Ns_Time *timeoutPtr, Dbi_Handle **handlePtrPtr)
 
             if (poolPtr->maxhandles == 0
                 || poolPtr->nhandles < poolPtr->maxhandles) {
-                char buf[100];
-
-                poolPtr->nhandles++;
-
-                snprintf(buf, sizeof(buf), "dbi:stmts:%s:%d",
-                         poolPtr->module, poolPtr->nhandles);
-
-                handlePtr = ns_calloc(1, sizeof *handlePtr);
-                handlePtr->poolPtr = poolPtr;
-                Tcl_DStringInit(&handlePtr->dsExceptionMsg);
-                handlePtr->cache = Ns_CacheCreateSz(buf, TCL_STRING_KEYS,
-                                                    poolPtr->cachesize, FreeStatement);
-                handlePtr->transDepth = -1;
-                handlePtr->n = poolPtr->nhandles;
-                handlePtr->epoch = poolPtr->epoch;
-
+                handlePtr = NewHandle(poolPtr);
             } else {
                 handlePtr = NULL;
                 poolPtr->stats.handlemisses++;
@@ -718,6 +896,17 @@ Dbi_GetHandle(Dbi_Pool *pool, Ns_Time *timeoutPtr, Dbi_Handle **handlePtrPtr)
                 poolPtr->lastPtr = NULL;
             }
             poolPtr->idlehandles--;
+
+            /*
+             * A handle connected before the pool was bounced, e.g.
+             * because another handle lost its connection, is
+             * replaced rather than handed out to fail.
+             */
+
+            if (handlePtr->epoch < poolPtr->epoch && Connected(handlePtr)) {
+                RetireHandle(handlePtr, "bounced");
+                handlePtr = NewHandle(poolPtr);
+            }
             handlePtr->n = poolPtr->maxhandles - poolPtr->idlehandles;
         }
 
@@ -733,8 +922,14 @@ Dbi_GetHandle(Dbi_Pool *pool, Ns_Time *timeoutPtr, Dbi_Handle **handlePtrPtr)
 
     if (handlePtr != NULL) {
 
-        if (!Connected(handlePtr)
-                && Connect(handlePtr) != NS_OK) {
+        if (Connected(handlePtr) && Validate(handlePtr)) {
+            status = NS_OK;
+        } else {
+            status = Connect(handlePtr);
+            BreakerUpdate(poolPtr, status == NS_OK);
+        }
+
+        if (status != NS_OK) {
 
             Ns_MutexLock(&poolPtr->lock);
             ReturnHandle(handlePtr);
@@ -785,33 +980,128 @@ Dbi_PutHandle(Dbi_Handle *handle)
      * Cleanup the handle.
      */
 
-    if (Dbi_Reset(handle) != NS_OK) {
+    if (handle->driverData != NULL /* See: Dbi_Reconnect() */
+        && Dbi_Reset(handle) != NS_OK) {
         /* Force the handle closed...? */
         Ns_Log(Warning, "Dbi_PutHandle: Reset failed...");
     }
 
+    time(&now);
+    handlePtr->atime = now;
+
     if (handlePtr->n != -1) {
-        int  closed;
+        const char *reason;
 
         /*
          * For non-thread handles which are going back to the pool
-         * check for staleness and possibly close.
+         * check for staleness. A stale handle is retired and closed
+         * outside the lock, freeing its slot for a new handle.
          */
 
-        time(&now);
-        handlePtr->atime = now;
-
         Ns_MutexLock(&poolPtr->lock);
-        closed = CloseIfStale(handlePtr, now);
-        ReturnHandle(handlePtr);
-        if (!closed) {
-            Ns_CondSignal(&poolPtr->cond);
+        if ((reason = StaleReason(handlePtr, now)) != NULL) {
+            RetireStaleHandle(handlePtr, reason);
+        } else {
+            ReturnHandle(handlePtr);
         }
+        Ns_CondSignal(&poolPtr->cond);
         Ns_MutexUnlock(&poolPtr->lock);
     }
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_ExpandListVariables --
+ *
+ *      Rewrite each list bind variable, :name[], as one bind variable
+ *      per element: :name[], :name[], ... The n-th occurrence of
+ *      :name[] in the rewritten sql binds element n of the list. See:
+ *      Dbi_VariableKey().
+ *
+ *      The number of elements is rounded up to a power of two so that
+ *      lists of varying length share a few cached statements. The
+ *      caller binds the extra variables to the last element, or to
+ *      null for an empty list.
+ *
+ *      Nothing is done if the driver binds lists natively.
+ *
+ * Results:
+ *      NS_OK with the rewritten sql in dsPtr, or dsPtr left untouched
+ *      if there was nothing to expand. NS_ERROR if lengthProc failed.
+ *
+ * Side effects:
+ *      lengthProc is called once per list variable.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Dbi_ExpandListVariables(Dbi_Handle *handle, const char *sql, TCL_SIZE_T length,
+                        Dbi_ListLengthProc *lengthProc, ClientData arg,
+                        Tcl_DString *dsPtr)
+{
+    const Pool *poolPtr = ((Handle *) handle)->poolPtr;
+    const char *p, *q, *end, *chunk;
+    TCL_SIZE_T  numElements, bucket, i;
+    int         isQuoted = 0, expanded = 0;
+
+    if (poolPtr->bindListProc != NULL || strstr(sql, "[]") == NULL) {
+        return NS_OK;
+    }
+    if (length < 0) {
+        length = (TCL_SIZE_T) strlen(sql);
+    }
+    end = sql + length;
+    chunk = sql;
+
+    /*
+     * Recognise bind variables as ParseBindVars() does.
+     */
+
+    for (p = sql; p < end; p++) {
+        if (*p == '\'' && (p == sql || *(p-1) != '\\')) {
+            isQuoted = !isQuoted;
+            continue;
+        }
+        if (*p != ':' || isQuoted
+            || (p + 1 < end && *(p+1) == ':')
+            || (p != sql && (*(p-1) == ':' || *(p-1) == '\\'))) {
+            continue;
+        }
+        for (q = p + 1; q < end && (isalnum(UCHAR(*q)) || *q == '_'); q++) {
+            ;
+        }
+        if (q == p + 1 || q + 1 >= end || *q != '[' || *(q+1) != ']') {
+            continue;
+        }
+
+        if ((*lengthProc)(arg, p + 1, (TCL_SIZE_T)(q - p - 1), &numElements) != NS_OK) {
+            Tcl_DStringSetLength(dsPtr, 0);
+            return NS_ERROR;
+        }
+        for (bucket = 1; bucket < numElements; bucket <<= 1) {
+            ;
+        }
+
+        Tcl_DStringAppend(dsPtr, chunk, (TCL_SIZE_T)(p - chunk));
+        for (i = 0; i < bucket; i++) {
+            Ns_DStringPrintf(dsPtr, "%s:%.*s[]",
+                             i > 0 ? ", " : "", (int)(q - p - 1), p + 1);
+        }
+        chunk = q + 2;
+        p = q + 1;
+        expanded = 1;
+    }
+    if (expanded) {
+        Tcl_DStringAppend(dsPtr, chunk, (TCL_SIZE_T)(end - chunk));
+    }
+
+    return NS_OK;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -820,8 +1110,7 @@ Dbi_PutHandle(Dbi_Handle *handle)
  *      Parse the sql for bind variables.
  *
  * Results:
- *      NS_OK, or NS_ERROR if statement contains more than DBI_MAX_BIND
- *      bind variables.
+ *      NS_OK or NS_ERROR.
  *
  * Side effects:
  *      Statement is parsed by driver callback and any bind variables
@@ -848,11 +1137,10 @@ Dbi_Prepare(Dbi_Handle *handle, const char *sql, TCL_SIZE_T length)
 
     entry = Ns_CacheCreateEntry(handlePtr->cache, sql, &new);
     if (new) {
-        if ((stmtPtr = ParseBindVars(handlePtr, sql, length)) == NULL) {
-            Ns_CacheFlushEntry(entry);
-            return NS_ERROR;
-        }
-        Ns_CacheSetValueSz(entry, stmtPtr, sizeof(Statement) + (size_t)(stmtPtr->length));
+        stmtPtr = ParseBindVars(handlePtr, sql, length);
+        Ns_CacheSetValueSz(entry, stmtPtr, sizeof(Statement) + (size_t)(stmtPtr->length)
+                           + (stmtPtr->vars != stmtPtr->staticVars
+                              ? stmtPtr->varsAvailable * sizeof(BindVar) : 0u));
     } else {
         stmtPtr = Ns_CacheGetValue(entry);
     }
@@ -948,6 +1236,112 @@ Dbi_VariableName(Dbi_Handle *handle, unsigned int index, const char **namePtr)
     return NS_OK;
 }
 
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_VariableKey --
+ *
+ *      The key under which to look up the value of a bind variable,
+ *      and for a list variable which element of the list to bind.
+ *
+ *      A list variable, :name[], is bound as a whole if the driver
+ *      binds lists natively. Otherwise the sql has been rewritten
+ *      with one :name[] per element by Dbi_ExpandListVariables(),
+ *      padded to a power of two, and *elementPtr counts the
+ *      occurrences of :name[] in the statement. Occurrence n binds
+ *      element n modulo the padded list length.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR. The key is the first *keyLengthPtr bytes of
+ *      the variable name, i.e. the name without any [] suffix, and
+ *      *elementPtr is the occurrence, DBI_ELEMENT_ALL for a native
+ *      list, or DBI_ELEMENT_NONE for a plain :name.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Dbi_VariableKey(Dbi_Handle *handle, unsigned int index,
+                TCL_SIZE_T *keyLengthPtr, TCL_SIZE_T *elementPtr)
+{
+    const Statement *stmtPtr = ((Handle *) handle)->stmtPtr;
+
+    assert(stmtPtr);
+
+    if (index >= stmtPtr->numVars) {
+        Dbi_SetException(handle, "HY000",
+            "bug: variable index out of bounds: index: %u, variables: %u",
+            index, stmtPtr->numVars);
+        return NS_ERROR;
+    }
+    *keyLengthPtr = stmtPtr->vars[index].keyLength;
+    *elementPtr = stmtPtr->vars[index].element;
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_StatementSerial --
+ *
+ *      A number identifying the current statement of the handle
+ *      among all statements prepared by any handle, e.g. to cache
+ *      per-statement data outside the handle.
+ *
+ * Results:
+ *      Statement serial number.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+unsigned long
+Dbi_StatementSerial(Dbi_Handle *handle)
+{
+    const Statement *stmtPtr = ((Handle *) handle)->stmtPtr;
+
+    assert(stmtPtr);
+
+    return stmtPtr->serial;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_VariableIsList --
+ *
+ *      Is the bind variable at the given index a list, :name[], to be
+ *      bound as a native array? Only for drivers which registered a
+ *      Dbi_BindListProc.
+ *
+ * Results:
+ *      NS_TRUE or NS_FALSE.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Dbi_VariableIsList(Dbi_Handle *handle, unsigned int index)
+{
+    const Statement *stmtPtr = ((Handle *) handle)->stmtPtr;
+
+    assert(stmtPtr);
+
+    return (index < stmtPtr->numVars && stmtPtr->vars[index].isList);
+}
+
 
 /*
  *----------------------------------------------------------------------
@@ -1032,9 +1426,12 @@ Dbi_ColumnName(Dbi_Handle *handle, unsigned int index, const char **namePtr)
 int
 Dbi_Exec(Dbi_Handle *handle, Dbi_Value *values, int maxRows)
 {
-    Handle     *handlePtr = (Handle *) handle;
-    Statement  *stmtPtr   = handlePtr->stmtPtr;
-    const Pool *poolPtr   = handlePtr->poolPtr;
+    Handle      *handlePtr = (Handle *) handle;
+    Statement   *stmtPtr   = handlePtr->stmtPtr;
+    Pool        *poolPtr   = handlePtr->poolPtr;
+    LegacyValue  staticLegacy[DBI_STATIC_BIND], *legacy = NULL;
+    unsigned int i;
+    int          status;
 
     assert(stmtPtr);
     assert(stmtPtr->numVars == 0
@@ -1046,10 +1443,40 @@ Dbi_Exec(Dbi_Handle *handle, Dbi_Value *values, int maxRows)
     handlePtr->maxRows = maxRows > -1 ? maxRows : poolPtr->maxRows;
     handlePtr->numRowsHint = DBI_NUM_ROWS_UNKNOWN;
 
-    if ((*poolPtr->execProc)(handle, (Dbi_Statement *) stmtPtr,
-                             values, stmtPtr->numVars) != NS_OK) {
+    /*
+     * Pass ABI version 1 drivers the values in the layout they were
+     * compiled with.
+     */
+
+    if (poolPtr->abiVersion < 2 && stmtPtr->numVars > 0) {
+        legacy = stmtPtr->numVars > DBI_STATIC_BIND
+            ? ns_malloc(stmtPtr->numVars * sizeof(LegacyValue)) : staticLegacy;
+        for (i = 0; i < stmtPtr->numVars; i++) {
+            legacy[i].data = values[i].data;
+            legacy[i].length = values[i].length;
+            legacy[i].binary = values[i].binary;
+        }
+    }
+
+    status = (*poolPtr->execProc)(handle, (Dbi_Statement *) stmtPtr,
+                                  legacy != NULL ? (Dbi_Value *) legacy : values,
+                                  stmtPtr->numVars);
+    if (legacy != NULL && legacy != staticLegacy) {
+        ns_free(legacy);
+    }
+    if (status != NS_OK) {
+        /*
+         * Only a lost connection or a connection exception (SQLSTATE
+         * class 08) counts against the circuit breaker, not errors
+         * in the SQL itself.
+         */
+        if (!Connected(handlePtr)
+            || strncmp(handlePtr->cExceptionCode, "08", 2) == 0) {
+            BreakerUpdate(poolPtr, NS_FALSE);
+        }
         return NS_ERROR;
     }
+    BreakerUpdate(poolPtr, NS_TRUE);
     handlePtr->fetchingRows = NS_TRUE;
     handlePtr->stats.queries++;
     stmtPtr->nqueries++;
@@ -1181,7 +1608,7 @@ Dbi_ColumnLength(Dbi_Handle *handle, unsigned int index,
         return NS_ERROR;
     }
 
-    if (index > handlePtr->stmtPtr->numCols) {
+    if (index >= handlePtr->stmtPtr->numCols) {
         Dbi_SetException(handle, "HY000",
             "bug: Dbi_ColumnLength: column index out of range: %u", index);
         return NS_ERROR;
@@ -1195,6 +1622,54 @@ Dbi_ColumnLength(Dbi_Handle *handle, unsigned int index,
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_ColumnTypedValue --
+ *
+ *      Fetch the value of a column as a native number, boolean,
+ *      timestamp or byte string, if the driver supports it.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR. valuePtr->type is DBI_VALUE_STRING if the
+ *      value must be fetched with Dbi_ColumnLength/Dbi_ColumnValue.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Dbi_ColumnTypedValue(Dbi_Handle *handle, unsigned int index, Dbi_Value *valuePtr)
+{
+    Handle        *handlePtr = (Handle *) handle;
+    const Pool    *poolPtr   = handlePtr->poolPtr;
+    Dbi_Statement *stmt      = (Dbi_Statement *) handlePtr->stmtPtr;
+
+    valuePtr->type = DBI_VALUE_STRING;
+
+    if (poolPtr->columnTypedValueProc == NULL) {
+        return NS_OK;
+    }
+    if (!handlePtr->fetchingRows) {
+        Dbi_SetException(handle, "HY000",
+            "bug: Dbi_ColumnTypedValue: no pending rows");
+        return NS_ERROR;
+    }
+    if (index >= handlePtr->stmtPtr->numCols) {
+        Dbi_SetException(handle, "HY000",
+            "bug: Dbi_ColumnTypedValue: column index out of range: %u", index);
+        return NS_ERROR;
+    }
+
+    Log(handle, Debug, "Dbi_ColumnTypedValueProc: id: %u, column: %u, row: %u",
+        stmt->id, index, handlePtr->rowIdx);
+
+    return (*poolPtr->columnTypedValueProc)(handle, stmt, index, valuePtr);
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1227,7 +1702,7 @@ Dbi_ColumnValue(Dbi_Handle *handle, unsigned int index,
         return NS_ERROR;
     }
 
-    if (index > handlePtr->stmtPtr->numCols) {
+    if (index >= handlePtr->stmtPtr->numCols) {
         Dbi_SetException(handle, "HY000",
             "bug: Dbi_ColumnValue: column index out of range: %u", index);
         return NS_ERROR;
@@ -1453,28 +1928,89 @@ Dbi_Reset(Dbi_Handle *handle)
 /*
  *----------------------------------------------------------------------
  *
- * Dbi_BouncePool --
+ * Dbi_Reconnect --
  *
- *      Close all handles in the pool.
+ *      Replace the connection of a handle which has been lost, e.g.
+ *      after an SQLSTATE class 08 exception.
+ *
+ *      The first handle of the current epoch to reconnect also bounces
+ *      the pool: the other handles were most likely connected to the
+ *      same failed server and are reconnected at next checkout rather
+ *      than each failing a query of its own.
  *
  * Results:
- *      None.
+ *      NS_OK if the handle was reconnected, NS_ERROR otherwise in
+ *      which case the connect exception is left in the handle.
  *
  * Side effects:
- *      All handles in the pool are marked stale, but only the unused
- *      handles are disconnected immediately.  Active handles will be
- *      disconnected as they are returned to the pool.
+ *      Pending statement and result are discarded. Fails within a
+ *      transaction.
  *
  *----------------------------------------------------------------------
  */
 
-void
-Dbi_BouncePool(Dbi_Pool *pool)
+int
+Dbi_Reconnect(Dbi_Handle *handle)
 {
-    Pool *poolPtr = (Pool *) pool;
+    Handle *handlePtr = (Handle *) handle;
+    Pool   *poolPtr   = handlePtr->poolPtr;
+    int     status;
+
+    if (handlePtr->transDepth != -1) {
+        Dbi_SetException(handle, "HY000",
+                         "Cannot reconnect within a transaction.");
+        return NS_ERROR;
+    }
+
+    (void) Dbi_Reset(handle);
+
+    if (Connected(handlePtr)) {
+        Disconnect(handlePtr, "lost");
+    }
+
+    Ns_MutexLock(&poolPtr->lock);
+    if (handlePtr->epoch == poolPtr->epoch) {
+        poolPtr->epoch++;
+    }
+    poolPtr->stats.reconnects++;
+    poolPtr->stats.queries += handlePtr->stats.queries;
+    handlePtr->stats.queries = 0;
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    status = Connect(handlePtr);
+    BreakerUpdate(poolPtr, status == NS_OK);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_BouncePool --
+ *
+ *      Close all handles in the pool.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      All handles in the pool are marked stale. Unused handles are
+ *      retired immediately and closed in the background, new
+ *      handles are created in their place as required.  Active
+ *      handles will be disconnected as they are returned to the pool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Dbi_BouncePool(Dbi_Pool *pool)
+{
+    Pool *poolPtr = (Pool *) pool;
 
     Ns_MutexLock(&poolPtr->lock);
-    CheckPool(poolPtr, 1);
+    poolPtr->epoch++;
+    RetireIdleHandles(poolPtr, "bounced");
     Ns_CondBroadcast(&poolPtr->cond);
     Ns_MutexUnlock(&poolPtr->lock);
 }
@@ -1505,17 +2041,203 @@ Dbi_Stats(Tcl_DString *ds, Dbi_Pool *poolPtr)
     Ns_DStringPrintf(ds, "handlegets %d handlemisses %d "
                      "handleopens %d handlefailures %d queries %d "
                      "agedcloses %d idlecloses %d "
-                     "oppscloses %d bounces %d",
+                     "oppscloses %d bounces %d closing %d "
+                     "breakertrips %d fastfails %d "
+                     "validations %d validationfailures %d reconnects %d "
+                     "fragmenthits %d fragmentmisses %d fragmenthitratio %.2f",
                      pPtr->stats.handlegets,  pPtr->stats.handlemisses,
                      pPtr->stats.handleopens, pPtr->stats.handlefailures,
                      pPtr->stats.queries,
                      pPtr->stats.otimecloses, pPtr->stats.atimecloses,
-                     pPtr->stats.querycloses, pPtr->epoch);
+                     pPtr->stats.querycloses, pPtr->epoch, pPtr->closing,
+                     pPtr->stats.breakertrips, pPtr->stats.fastfails,
+                     pPtr->stats.validations, pPtr->stats.validationfailures,
+                     pPtr->stats.reconnects,
+                     pPtr->stats.fragmenthits, pPtr->stats.fragmentmisses,
+                     pPtr->stats.fragmenthits + pPtr->stats.fragmentmisses > 0u
+                     ? (double) pPtr->stats.fragmenthits
+                       / (double) (pPtr->stats.fragmenthits + pPtr->stats.fragmentmisses)
+                     : 0.0);
     Ns_MutexUnlock(&pPtr->lock);
 
     return ds->string;
 }
 
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_FragmentGet --
+ *
+ *      Look up the rendered output stored under the given key in the
+ *      fragment cache of the pool, and append it to the dstring.
+ *
+ * Results:
+ *      NS_OK on a hit, NS_ERROR if there is no unexpired output for
+ *      the key or the pool has no fragment cache.
+ *
+ * Side effects:
+ *      Hit and miss stats are updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Dbi_FragmentGet(Dbi_Pool *pool, const char *key, Tcl_DString *dsPtr)
+{
+    Pool           *poolPtr = (Pool *) pool;
+    const Ns_Entry *entry;
+    const Fragment *fragPtr = NULL;
+
+    if (poolPtr->fragments == NULL) {
+        return NS_ERROR;
+    }
+
+    Ns_CacheLock(poolPtr->fragments);
+    entry = Ns_CacheFindEntry(poolPtr->fragments, key);
+    if (entry != NULL) {
+        fragPtr = Ns_CacheGetValue(entry);
+        if (fragPtr != NULL) {
+            Tcl_DStringAppend(dsPtr, fragPtr->data, fragPtr->length);
+        }
+    }
+    Ns_CacheUnlock(poolPtr->fragments);
+
+    Ns_MutexLock(&poolPtr->lock);
+    if (fragPtr != NULL) {
+        poolPtr->stats.fragmenthits++;
+    } else {
+        poolPtr->stats.fragmentmisses++;
+    }
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    return fragPtr != NULL ? NS_OK : NS_ERROR;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_FragmentSet --
+ *
+ *      Store rendered output under the given key in the fragment cache
+ *      of the pool, replacing any previous output for the key.
+ *
+ *      The entry expires after ttlPtr, if given, and is flushed by
+ *      Dbi_FragmentFlush() for any of the tags.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Least recently used entries may be pruned to make room. Nothing
+ *      is stored if the pool has no fragment cache.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Dbi_FragmentSet(Dbi_Pool *pool, const char *key, const char *data, TCL_SIZE_T length,
+                const Ns_Time *ttlPtr, TCL_SIZE_T numTags, const char *const tags[])
+{
+    Pool       *poolPtr = (Pool *) pool;
+    Ns_Entry   *entry;
+    Fragment   *fragPtr;
+    Ns_Time     expires, *expiresPtr = NULL;
+    char       *p;
+    size_t      size;
+    TCL_SIZE_T  i;
+    int         new;
+
+    if (poolPtr->fragments == NULL) {
+        return;
+    }
+
+    size = sizeof(Fragment) + (size_t)length + 1u;
+    for (i = 0; i < numTags; i++) {
+        size += strlen(tags[i]) + 1u;
+    }
+    fragPtr = ns_malloc(size);
+    fragPtr->length = length;
+    memcpy(fragPtr->data, data, (size_t)length);
+    fragPtr->data[length] = '\0';
+    fragPtr->tags = p = fragPtr->data + length + 1;
+    for (i = 0; i < numTags; i++) {
+        size_t tagLength = strlen(tags[i]) + 1u;
+
+        memcpy(p, tags[i], tagLength);
+        p += tagLength;
+    }
+    *p = '\0';
+
+    if (ttlPtr != NULL) {
+        Ns_GetTime(&expires);
+        Ns_IncrTime(&expires, ttlPtr->sec, ttlPtr->usec);
+        expiresPtr = &expires;
+    }
+
+    Ns_CacheLock(poolPtr->fragments);
+    entry = Ns_CacheCreateEntry(poolPtr->fragments, key, &new);
+    Ns_CacheSetValueExpires(entry, fragPtr, size, expiresPtr, 0);
+    Ns_CacheUnlock(poolPtr->fragments);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_FragmentFlush --
+ *
+ *      Flush the entries of the fragment cache of the pool which carry
+ *      the given tag, or all entries if tag is NULL.
+ *
+ * Results:
+ *      Number of entries flushed.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Dbi_FragmentFlush(Dbi_Pool *pool, const char *tag)
+{
+    Pool           *poolPtr = (Pool *) pool;
+    Ns_Entry       *entry;
+    Ns_CacheSearch  search;
+    const Fragment *fragPtr;
+    const char     *p;
+    int             nflushed = 0;
+
+    if (poolPtr->fragments == NULL) {
+        return 0;
+    }
+
+    Ns_CacheLock(poolPtr->fragments);
+    if (tag == NULL) {
+        nflushed = Ns_CacheFlush(poolPtr->fragments);
+    } else {
+        entry = Ns_CacheFirstEntry(poolPtr->fragments, &search);
+        while (entry != NULL) {
+            fragPtr = Ns_CacheGetValue(entry);
+            if (fragPtr != NULL) {
+                for (p = fragPtr->tags; *p != '\0'; p += strlen(p) + 1u) {
+                    if (STREQ(p, tag)) {
+                        Ns_CacheFlushEntry(entry);
+                        nflushed++;
+                        break;
+                    }
+                }
+            }
+            entry = Ns_CacheNextEntry(&search);
+        }
+    }
+    Ns_CacheUnlock(poolPtr->fragments);
+
+    return nflushed;
+}
+
 
 /*
  *----------------------------------------------------------------------
@@ -1598,9 +2320,18 @@ Dbi_ConfigInt(Dbi_Pool *pool, DBI_CONFIG_OPTION opt, int newValue)
             poolPtr->maxhandles = newValue;
         }
         break;
+
+    case DBI_CONFIG_RETRIES:
+        oldValue = poolPtr->retries;
+        if (newValue >= 0) {
+            poolPtr->retries = newValue;
+        }
+        break;
     case DBI_CONFIG_MAXIDLE:
     case DBI_CONFIG_MAXOPEN:
     case DBI_CONFIG_TIMEOUT:
+    case DBI_CONFIG_VALIDATIONINTERVAL:
+    case DBI_CONFIG_RETRYTIMEOUT:
         Ns_Log(Error, "Dbi_ConfigInt called with invalid parameter");
         break;
 
@@ -1621,6 +2352,7 @@ Dbi_ConfigTime(Dbi_Pool *pool, DBI_CONFIG_OPTION opt, Ns_Time *newValue, Ns_Time
     case DBI_CONFIG_MAXROWS:
     case DBI_CONFIG_MAXQUERIES:
     case DBI_CONFIG_MAXHANDLES:
+    case DBI_CONFIG_RETRIES:
         Ns_Log(Error, "Dbi_ConfigInt called with invalid parameter");
         break;
 
@@ -1642,6 +2374,19 @@ Dbi_ConfigTime(Dbi_Pool *pool, DBI_CONFIG_OPTION opt, Ns_Time *newValue, Ns_Time
             poolPtr->timeout = *newValue;
         }
         break;
+    case DBI_CONFIG_VALIDATIONINTERVAL:
+        *oldValuePtr = poolPtr->validationinterval;
+        if (newValue != NULL) {
+            poolPtr->validationinterval = *newValue;
+        }
+        break;
+
+    case DBI_CONFIG_RETRYTIMEOUT:
+        *oldValuePtr = poolPtr->retrytimeout;
+        if (newValue != NULL) {
+            poolPtr->retrytimeout = *newValue;
+        }
+        break;
 
     }
     Ns_MutexUnlock(&poolPtr->lock);
@@ -1873,6 +2618,9 @@ GetServer(const char *server)
  *      the front of the list, disconnected handles are appended to
  *      the end.
  *
+ *      While the server is stopping, or if the pool has more than
+ *      maxhandles, the handle is retired instead.
+ *
  * Results:
  *      None.
  *
@@ -1890,12 +2638,7 @@ ReturnHandle(Handle *handle)
 
     if (poolPtr->stopping
         || poolPtr->nhandles > poolPtr->maxhandles) {
-
-        Ns_CacheDestroy(handle->cache);
-        Tcl_DStringFree(&handle->dsExceptionMsg);
-        ns_free(handle);
-        poolPtr->nhandles--;
-
+        RetireHandle(handle, poolPtr->stopping ? "stopped" : "surplus");
         return;
     }
 
@@ -1913,260 +2656,754 @@ ReturnHandle(Handle *handle)
     poolPtr->idlehandles++;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CloseIfStale --
+ * RetireHandle --
  *
- *      If the handle is stale, close it.
+ *      Remove a handle from the pool for good. A connected handle is
+ *      queued for a closer thread so that the driver's close, which
+ *      may be a network round trip, does not run with the pool
+ *      locked. Its slot is available to new handles immediately.
  *
  * Results:
- *      NS_TRUE if connection closed, NS_FALSE otherwise.
+ *      None.
  *
  * Side effects:
- *      NB: Pool must be locked or handle otherwise protected.
+ *      NB: Pool must be locked. May start a closer thread.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-CloseIfStale(Handle *handlePtr, time_t now)
+static void
+RetireHandle(Handle *handlePtr, const char *reason)
 {
-    Dbi_Handle *handle  = (Dbi_Handle *) handlePtr;
-    Pool       *poolPtr = handlePtr->poolPtr;
-
-    if (Connected(handlePtr)) {
-        const char *reason  = NULL;
-
-        if (poolPtr->stopping) {
-            reason = "stopped";
-        } else if (poolPtr->epoch > handlePtr->epoch) {
-            reason = "bounced";
-        } else if (poolPtr->maxopen.sec != 0
-                   && poolPtr->maxopen.usec != 0
-                   && (handlePtr->otime < (now - poolPtr->maxopen.sec))) {
-            /*
-             * Time granularity is still on the seconds level
-             */
-            reason = "aged";
-        } else if (poolPtr->maxidle.sec != 0
-                   && poolPtr->maxidle.usec != 0
-                   && (handlePtr->atime < (now - poolPtr->maxidle.sec))) {
-            /*
-             * Time granularity is still on the seconds level
-             */
-            reason = "idle";
-            poolPtr->stats.atimecloses++;
-        } else if (poolPtr->maxqueries && ((int)handlePtr->stats.queries >= poolPtr->maxqueries)) {
-            reason = "used";
-            poolPtr->stats.querycloses++;
-        }
-        if (reason) {
+    Pool *poolPtr = handlePtr->poolPtr;
 
-            (void) Ns_CacheFlush(handlePtr->cache);
+    poolPtr->nhandles--;
+    poolPtr->stats.queries += handlePtr->stats.queries;
+    handlePtr->stats.queries = 0;
 
-            Log(handle, Notice, "closing %s handle, %d queries",
-                reason, handlePtr->stats.queries);
-
-            (*poolPtr->closeProc)(handle);
+    if (!Connected(handlePtr)) {
+        FreeHandle(handlePtr);
+        return;
+    }
 
-            handlePtr->driverData = NULL;
-            handlePtr->atime = handlePtr->otime = 0;
-            poolPtr->stats.queries += handlePtr->stats.queries;
-            handlePtr->stats.queries = 0;
+    handlePtr->closeReason = reason;
+    handlePtr->nextPtr = poolPtr->closePtr;
+    poolPtr->closePtr = handlePtr;
+    poolPtr->closing++;
 
-            return NS_TRUE;
-        }
+    if (poolPtr->closers < MAX_CLOSERS
+        && poolPtr->closers < poolPtr->closing) {
+        poolPtr->closers++;
+        Ns_ThreadCreate(Closer, poolPtr, 0, NULL);
     }
-
-    return NS_FALSE;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * CheckPool --
+ * RetireIdleHandles --
  *
- *      Verify all handles currently in a pool are not stale.
+ *      Retire all handles currently idle in the pool.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      Stale handles, if any, are disconnected.
+ *      NB: Pool must be locked. See: RetireHandle().
  *
  *----------------------------------------------------------------------
  */
 
 static void
-CheckPool(Pool *poolPtr, int stale)
+RetireIdleHandles(Pool *poolPtr, const char *reason)
 {
-    Handle  *handlePtr, *nextPtr;
-    time_t   now;
+    Handle *handlePtr, *nextPtr;
 
-    if (stale) {
-        poolPtr->epoch++;
-    }
     handlePtr = poolPtr->firstPtr;
     poolPtr->firstPtr = poolPtr->lastPtr = NULL;
     poolPtr->idlehandles = 0;
 
-    time(&now);
-
     while (handlePtr != NULL) {
         nextPtr = handlePtr->nextPtr;
-        (void) CloseIfStale(handlePtr, now);
-        ReturnHandle(handlePtr);
+        RetireHandle(handlePtr, reason);
         handlePtr = nextPtr;
     }
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * ScheduledPoolCheck, PoolCheckArgProc --
+ * RetireStaleHandle --
  *
- *      Periodically check a pool for stale handles.
+ *      Retire a handle found stale by StaleReason() and count the
+ *      close in the stats of its pool.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      NB: Pool must be locked. See: RetireHandle().
  *
  *----------------------------------------------------------------------
  */
 
 static void
-ScheduledPoolCheck(void *arg, int UNUSED(id))
+RetireStaleHandle(Handle *handlePtr, const char *reason)
 {
-    Pool *poolPtr = arg;
-
-    Ns_MutexLock(&poolPtr->lock);
-    CheckPool(poolPtr, 0);
-    Ns_CondBroadcast(&poolPtr->cond);
-    Ns_MutexUnlock(&poolPtr->lock);
+    Pool *poolPtr = handlePtr->poolPtr;
+
+    if (STREQ(reason, "aged")) {
+        poolPtr->stats.otimecloses++;
+    } else if (STREQ(reason, "idle")) {
+        poolPtr->stats.atimecloses++;
+    } else if (STREQ(reason, "used")) {
+        poolPtr->stats.querycloses++;
+    }
+    RetireHandle(handlePtr, reason);
 }
 
-static void
-PoolCheckArgProc(Tcl_DString *dsPtr, const void *arg)
-{
-    const Pool *poolPtr = arg;
-
-    Tcl_DStringAppendElement(dsPtr, poolPtr->module);
-}
 
-
 /*
  *----------------------------------------------------------------------
  *
- * AtShutdown --
+ * Closer --
  *
- *      Shutdown callback to close handles in a pool.
+ *      Thread which closes and frees retired handles until the
+ *      queue of its pool is empty.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      Waiters on the pool are notified as handles are closed.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-AtShutdown(const Ns_Time *toPtr, void *arg)
+Closer(void *arg)
 {
-    Pool       *poolPtr = arg;
-    Tcl_DString ds;
+    Pool   *poolPtr = arg;
+    Handle *handlePtr;
 
-    if (toPtr == NULL) {
-        Ns_MutexLock(&poolPtr->lock);
-        poolPtr->stopping = 1;
-        Ns_CondBroadcast(&poolPtr->cond);
-        Ns_MutexUnlock(&poolPtr->lock);
-    } else {
-        int status;
+    Ns_ThreadSetName("-dbi:close:%s-", poolPtr->module);
 
-        Tcl_DStringInit(&ds);
-        Ns_Log(Notice, "dbi[%s:%s]: %s", poolPtr->drivername, poolPtr->module,
-               Dbi_Stats(&ds, (Dbi_Pool *) poolPtr));
-        Tcl_DStringFree(&ds);
+    Ns_MutexLock(&poolPtr->lock);
+    while ((handlePtr = poolPtr->closePtr) != NULL) {
+        poolPtr->closePtr = handlePtr->nextPtr;
+        Ns_MutexUnlock(&poolPtr->lock);
 
-        Ns_MutexLock (&poolPtr->lock);
-        do {
-            status = NS_OK;
-            while (status == NS_OK
-                   && poolPtr->nhandles > 0
-                   && poolPtr->firstPtr == NULL) {
-                status = Ns_CondTimedWait(&poolPtr->cond, &poolPtr->lock, toPtr);
-            }
-            if (poolPtr->firstPtr != NULL) {
-                CheckPool(poolPtr, 1);
-            }
-        } while (poolPtr->nhandles > 0 && status == NS_OK);
+        Disconnect(handlePtr, handlePtr->closeReason);
+        FreeHandle(handlePtr);
 
-        Ns_MutexUnlock(&poolPtr->lock);
+        Ns_MutexLock(&poolPtr->lock);
+        poolPtr->closing--;
+        Ns_CondBroadcast(&poolPtr->cond);
     }
+    poolPtr->closers--;
+    Ns_MutexUnlock(&poolPtr->lock);
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * Connect --
+ * NewHandle --
  *
- *      Connect a handle by opening the database.
+ *      Allocate a new, disconnected handle for the pool.
  *
  * Results:
- *      NS_OK if connect ok, NS_ERROR on failure.
+ *      Pointer to handle.
  *
  * Side effects:
- *      None.
+ *      NB: Pool must be locked.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-Connect(Handle *handlePtr)
+static Handle *
+NewHandle(Pool *poolPtr)
 {
-    Dbi_Handle *handle  = (Dbi_Handle *) handlePtr;
-    Pool       *poolPtr = handlePtr->poolPtr;
-    int         status  = NS_ERROR;
+    Handle *handlePtr;
+    char    buf[100];
 
-    if (!poolPtr->stopping) {
-
-        Log(handle, Debug, "Dbi_OpenProc: opens: %u",
-            poolPtr->stats.handleopens);
+    poolPtr->nhandles++;
 
-        status = (*poolPtr->openProc)(poolPtr->configData, handle);
-        poolPtr->stats.handleopens++;
-
-        if (status != NS_OK) {
-            poolPtr->stats.handlefailures++;
-            Dbi_LogException(handle, Error);
-        } else {
-            const char *msg;
+    snprintf(buf, sizeof(buf), "dbi:stmts:%s:%d",
+             poolPtr->module, poolPtr->nhandles);
 
-            handlePtr->atime = handlePtr->otime = time(NULL);
-            msg = Dbi_ExceptionMsg(handle);
-            Log(handle, Notice, "opened handle %d/%d%s%s",
-                handlePtr->n, poolPtr->maxhandles,
-                msg ? ": " : "", msg ? msg : "");
-            Dbi_ResetException(handle);
-        }
-    }
+    handlePtr = ns_calloc(1, sizeof *handlePtr);
+    handlePtr->poolPtr = poolPtr;
+    Tcl_DStringInit(&handlePtr->dsExceptionMsg);
+    handlePtr->cache = Ns_CacheCreateSz(buf, TCL_STRING_KEYS,
+                                        poolPtr->cachesize, FreeStatement);
+    handlePtr->transDepth = -1;
+    handlePtr->n = poolPtr->nhandles;
+    handlePtr->epoch = poolPtr->epoch;
 
-    return status;
+    return handlePtr;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * Connected --
+ * FreeHandle --
+ *
+ *      Free a disconnected handle.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeHandle(Handle *handlePtr)
+{
+    Ns_CacheDestroy(handlePtr->cache);
+    Tcl_DStringFree(&handlePtr->dsExceptionMsg);
+    ns_free(handlePtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StaleReason --
+ *
+ *      Check whether a handle should be closed rather than reused.
+ *
+ * Results:
+ *      The reason the handle is stale, or NULL.
+ *
+ * Side effects:
+ *      None. The caller is expected to retire a stale handle, which
+ *      closes it outside the lock. See: RetireStaleHandle().
+ *
+ *      NB: Pool must be locked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+StaleReason(Handle *handlePtr, time_t now)
+{
+    Pool       *poolPtr = handlePtr->poolPtr;
+    const char *reason  = NULL;
+
+    if (Connected(handlePtr)) {
+
+        /*
+         * Time granularity is still on the seconds level.
+         */
+
+        if (poolPtr->stopping) {
+            reason = "stopped";
+        } else if (poolPtr->epoch > handlePtr->epoch) {
+            reason = "bounced";
+        } else if ((poolPtr->maxopen.sec != 0 || poolPtr->maxopen.usec != 0)
+                   && (handlePtr->otime < (now - poolPtr->maxopen.sec))) {
+            reason = "aged";
+        } else if ((poolPtr->maxidle.sec != 0 || poolPtr->maxidle.usec != 0)
+                   && (handlePtr->atime < (now - poolPtr->maxidle.sec))) {
+            reason = "idle";
+        } else if (poolPtr->maxqueries && ((int)handlePtr->stats.queries >= poolPtr->maxqueries)) {
+            reason = "used";
+        }
+    }
+
+    return reason;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CheckPool --
+ *
+ *      Verify all handles currently in a pool are not stale.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Stale handles, if any, are retired.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CheckPool(Pool *poolPtr)
+{
+    Handle     *handlePtr, *nextPtr;
+    const char *reason;
+    time_t      now;
+
+    handlePtr = poolPtr->firstPtr;
+    poolPtr->firstPtr = poolPtr->lastPtr = NULL;
+    poolPtr->idlehandles = 0;
+
+    time(&now);
+
+    while (handlePtr != NULL) {
+        nextPtr = handlePtr->nextPtr;
+        if ((reason = StaleReason(handlePtr, now)) != NULL) {
+            RetireStaleHandle(handlePtr, reason);
+        } else {
+            ReturnHandle(handlePtr);
+        }
+        handlePtr = nextPtr;
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ScheduledPoolCheck, PoolCheckArgProc --
+ *
+ *      Periodically check a pool for stale handles.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ScheduledPoolCheck(void *arg, int UNUSED(id))
+{
+    Pool   *poolPtr = arg;
+    Handle *handlePtr, *nextPtr, *checkPtr = NULL;
+    time_t  now;
+
+    Ns_MutexLock(&poolPtr->lock);
+    CheckPool(poolPtr);
+
+    /*
+     * Take idle handles which are due for validation out of the pool
+     * so they can be pinged without holding the lock.
+     */
+
+    if (poolPtr->pingProc != NULL
+        && (poolPtr->validationinterval.sec != 0
+            || poolPtr->validationinterval.usec != 0)) {
+
+        time(&now);
+        handlePtr = poolPtr->firstPtr;
+        poolPtr->firstPtr = poolPtr->lastPtr = NULL;
+        poolPtr->idlehandles = 0;
+
+        while (handlePtr != NULL) {
+            nextPtr = handlePtr->nextPtr;
+            if (Connected(handlePtr) && ValidationDue(handlePtr, now)) {
+                handlePtr->nextPtr = checkPtr;
+                checkPtr = handlePtr;
+            } else {
+                ReturnHandle(handlePtr);
+            }
+            handlePtr = nextPtr;
+        }
+    }
+    Ns_CondBroadcast(&poolPtr->cond);
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    if (checkPtr != NULL) {
+        for (handlePtr = checkPtr; handlePtr != NULL; handlePtr = handlePtr->nextPtr) {
+            (void) Validate(handlePtr);
+        }
+        Ns_MutexLock(&poolPtr->lock);
+        while (checkPtr != NULL) {
+            nextPtr = checkPtr->nextPtr;
+            ReturnHandle(checkPtr);
+            checkPtr = nextPtr;
+        }
+        Ns_CondBroadcast(&poolPtr->cond);
+        Ns_MutexUnlock(&poolPtr->lock);
+    }
+}
+
+static void
+PoolCheckArgProc(Tcl_DString *dsPtr, const void *arg)
+{
+    const Pool *poolPtr = arg;
+
+    Tcl_DStringAppendElement(dsPtr, poolPtr->module);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BreakerUpdate --
+ *
+ *      Record the outcome of a connection attempt or query. After
+ *      breakerthreshold consecutive failures the circuit breaker
+ *      opens and a background probe is scheduled.
+ *
+ *      A success with no failures recorded takes no lock. A stale read
+ *      of failures only defers the reset to the next success.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Handle requests fail fast until the probe succeeds.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+BreakerUpdate(Pool *poolPtr, int success)
+{
+    int trip = NS_FALSE;
+
+    if (poolPtr->breakerthreshold == 0
+        || (success && poolPtr->failures == 0)) {
+        return;
+    }
+
+    Ns_MutexLock(&poolPtr->lock);
+    if (success) {
+        poolPtr->failures = 0;
+    } else if (++poolPtr->failures >= poolPtr->breakerthreshold
+               && !poolPtr->breakerOpen
+               && !poolPtr->stopping) {
+        poolPtr->breakerOpen = NS_TRUE;
+        poolPtr->probeDelay = poolPtr->breakerbackoff;
+        poolPtr->stats.breakertrips++;
+        trip = NS_TRUE;
+    }
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    if (trip) {
+        Ns_Log(Warning, "dbi[%s]: %d consecutive failures, circuit breaker open",
+               poolPtr->module, poolPtr->breakerthreshold);
+        Ns_ScheduleProcEx(BreakerProbe, poolPtr, NS_SCHED_ONCE|NS_SCHED_THREAD,
+                          &poolPtr->probeDelay, NULL);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BreakerProbe --
+ *
+ *      Try to connect to the db of a pool with an open circuit
+ *      breaker. On success the breaker is closed, otherwise the
+ *      probe is rescheduled with twice the delay, up to
+ *      breakermaxbackoff.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A temporary connection is opened and closed again.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+BreakerProbe(void *arg, int UNUSED(id))
+{
+    Pool   *poolPtr = arg;
+    Handle  probe;
+    Ns_Time diff;
+    int     status, reschedule = NS_FALSE;
+
+    memset(&probe, 0, sizeof(probe));
+    probe.poolPtr = poolPtr;
+    probe.transDepth = -1;
+    Tcl_DStringInit(&probe.dsExceptionMsg);
+
+    status = Connect(&probe);
+    if (status == NS_OK) {
+        (*poolPtr->closeProc)((Dbi_Handle *) &probe);
+    }
+    Tcl_DStringFree(&probe.dsExceptionMsg);
+
+    Ns_MutexLock(&poolPtr->lock);
+    if (status == NS_OK || poolPtr->stopping) {
+        poolPtr->breakerOpen = NS_FALSE;
+        poolPtr->failures = 0;
+        Ns_CondBroadcast(&poolPtr->cond);
+    } else {
+        Ns_IncrTime(&poolPtr->probeDelay,
+                    poolPtr->probeDelay.sec, poolPtr->probeDelay.usec);
+        if (Ns_DiffTime(&poolPtr->probeDelay, &poolPtr->breakermaxbackoff, &diff) > 0) {
+            poolPtr->probeDelay = poolPtr->breakermaxbackoff;
+        }
+        reschedule = NS_TRUE;
+    }
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    if (reschedule) {
+        Ns_ScheduleProcEx(BreakerProbe, poolPtr, NS_SCHED_ONCE|NS_SCHED_THREAD,
+                          &poolPtr->probeDelay, NULL);
+    } else if (status == NS_OK) {
+        Ns_Log(Notice, "dbi[%s]: probe succeeded, circuit breaker closed",
+               poolPtr->module);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AtShutdown --
+ *
+ *      Shutdown callback to close handles in a pool.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AtShutdown(const Ns_Time *toPtr, void *arg)
+{
+    Pool       *poolPtr = arg;
+    Tcl_DString ds;
+
+    if (toPtr == NULL) {
+        Ns_MutexLock(&poolPtr->lock);
+        poolPtr->stopping = 1;
+        RetireIdleHandles(poolPtr, "stopped");
+        Ns_CondBroadcast(&poolPtr->cond);
+        Ns_MutexUnlock(&poolPtr->lock);
+    } else {
+        int status = NS_OK;
+
+        Tcl_DStringInit(&ds);
+        Ns_Log(Notice, "dbi[%s:%s]: %s", poolPtr->drivername, poolPtr->module,
+               Dbi_Stats(&ds, (Dbi_Pool *) poolPtr));
+        Tcl_DStringFree(&ds);
+
+        /*
+         * Wait for active handles to be returned and for the closer
+         * threads to drain the retired handles.
+         */
+
+        Ns_MutexLock(&poolPtr->lock);
+        while (status == NS_OK
+               && (poolPtr->nhandles > 0 || poolPtr->closing > 0)) {
+            if (poolPtr->firstPtr != NULL) {
+                RetireIdleHandles(poolPtr, "stopped");
+            } else {
+                status = Ns_CondTimedWait(&poolPtr->cond, &poolPtr->lock, toPtr);
+            }
+        }
+        if (status != NS_OK) {
+            Ns_Log(Warning, "dbi[%s]: timeout waiting for %d active, %d closing handles",
+                   poolPtr->module, poolPtr->nhandles, poolPtr->closing);
+        }
+        Ns_MutexUnlock(&poolPtr->lock);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Connect --
+ *
+ *      Connect a handle by opening the database.
+ *
+ * Results:
+ *      NS_OK if connect ok, NS_ERROR on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Connect(Handle *handlePtr)
+{
+    Dbi_Handle *handle  = (Dbi_Handle *) handlePtr;
+    Pool       *poolPtr = handlePtr->poolPtr;
+    int         status  = NS_ERROR;
+
+    if (!poolPtr->stopping) {
+
+        Log(handle, Debug, "Dbi_OpenProc: opens: %u",
+            poolPtr->stats.handleopens);
+
+        status = (*poolPtr->openProc)(poolPtr->configData, handle);
+        poolPtr->stats.handleopens++;
+
+        if (status != NS_OK) {
+            poolPtr->stats.handlefailures++;
+            Dbi_LogException(handle, Error);
+        } else {
+            const char *msg;
+
+            handlePtr->atime = handlePtr->otime = time(NULL);
+            handlePtr->epoch = poolPtr->epoch;
+            msg = Dbi_ExceptionMsg(handle);
+            Log(handle, Notice, "opened handle %d/%d%s%s",
+                handlePtr->n, poolPtr->maxhandles,
+                msg ? ": " : "", msg ? msg : "");
+            Dbi_ResetException(handle);
+        }
+    }
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Validate --
+ *
+ *      Ping a connected handle which has been idle for longer than
+ *      the pool's validationinterval. Recently used handles are not
+ *      checked.
+ *
+ * Results:
+ *      NS_TRUE if the handle is still usable, NS_FALSE if it was
+ *      found dead and has been disconnected.
+ *
+ * Side effects:
+ *      May cost a round trip to the db.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Validate(Handle *handlePtr)
+{
+    Dbi_Handle *handle  = (Dbi_Handle *) handlePtr;
+    Pool       *poolPtr = handlePtr->poolPtr;
+    time_t      now;
+    int         alive;
+
+    time(&now);
+    if (!ValidationDue(handlePtr, now)) {
+        return NS_TRUE;
+    }
+
+    Log(handle, Debug, "Dbi_PingProc: idle: %ld", (long) (now - handlePtr->atime));
+
+    alive = ((*poolPtr->pingProc)(handle) == NS_OK);
+    if (alive) {
+        handlePtr->atime = now;
+    } else {
+        Dbi_LogException(handle, Warning);
+        Disconnect(handlePtr, "dead");
+    }
+
+    Ns_MutexLock(&poolPtr->lock);
+    poolPtr->stats.validations++;
+    if (!alive) {
+        poolPtr->stats.validationfailures++;
+        poolPtr->stats.queries += handlePtr->stats.queries;
+        handlePtr->stats.queries = 0;
+    }
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    return alive;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ValidationDue --
+ *
+ *      Has the handle been idle for longer than the validationinterval
+ *      of its pool? Handle access times have a resolution of one
+ *      second, so a fractional interval is rounded up to the next
+ *      whole second.
+ *
+ * Results:
+ *      NS_TRUE if the handle should be pinged, NS_FALSE otherwise or
+ *      when validation is disabled.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ValidationDue(const Handle *handlePtr, time_t now)
+{
+    const Pool *poolPtr = handlePtr->poolPtr;
+    time_t      interval;
+
+    if (poolPtr->pingProc == NULL
+        || (poolPtr->validationinterval.sec == 0
+            && poolPtr->validationinterval.usec == 0)) {
+        return NS_FALSE;
+    }
+    interval = poolPtr->validationinterval.sec
+        + (poolPtr->validationinterval.usec > 0 ? 1 : 0);
+
+    return (handlePtr->atime < now - interval);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Disconnect --
+ *
+ *      Flush the statement cache of a handle and close its
+ *      connection to the db.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The handle query count is left for the caller to add to the
+ *      pool stats.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Disconnect(Handle *handlePtr, const char *reason)
+{
+    Dbi_Handle *handle  = (Dbi_Handle *) handlePtr;
+    const Pool *poolPtr = handlePtr->poolPtr;
+
+    (void) Ns_CacheFlush(handlePtr->cache);
+
+    Log(handle, Notice, "closing %s handle, %d queries",
+        reason, handlePtr->stats.queries);
+
+    (*poolPtr->closeProc)(handle);
+
+    handlePtr->driverData = NULL;
+    handlePtr->atime = handlePtr->otime = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Connected --
  *
  *      Is the given database handle currently connected?
  *
@@ -2257,6 +3494,9 @@ FreeStatement(void *arg)
         (*poolPtr->prepareCloseProc)(handle, (Dbi_Statement *) stmtPtr);
     }
     Tcl_DeleteHashTable(&stmtPtr->bindTable);
+    if (stmtPtr->vars != stmtPtr->staticVars) {
+        ns_free(stmtPtr->vars);
+    }
     ns_free(stmtPtr);
 }
 
@@ -2270,8 +3510,12 @@ FreeStatement(void *arg)
  *      and call the driver for a replacement string.  Store the
  *      identified bind variables in a hash table of keys.
  *
+ *      The Statement is allocated once the driver specific SQL is
+ *      complete, as the driver notation may be longer than the
+ *      original.
+ *
  * Results:
- *      New Statement pointer or NULL if max bind variables exceeded.
+ *      New Statement pointer.
  *
  * Side effects:
  *      Memory for Statement is allocated.
@@ -2282,33 +3526,28 @@ FreeStatement(void *arg)
 static Statement *
 ParseBindVars(Handle *handlePtr, const char *sql, TCL_SIZE_T sqlLength)
 {
-    Statement  *stmtPtr = NULL;
-    Tcl_DString ds, origDs;
-    char        save, *currentSql, *p, *chunk, *bind;
-    int         isQuoted, status = NS_OK;
-    TCL_SIZE_T  len;
+    const Pool  *poolPtr = handlePtr->poolPtr;
+    Statement   *stmtPtr;
+    Tcl_DString  ds, origDs, namesDs;
+    char         save, *currentSql, *p, *chunk, *bind;
+    const char  *name;
+    int          isQuoted, suffix, numVars = 0, i;
+    TCL_SIZE_T   len;
 
 #define preveq(c) (p != currentSql && *(p-1) == (c))
 #define nexteq(c) (*(p+1) == (c))
 
-    /*
-     * Allocate a new Statement. Allocate a little extra memory
-     * for driver notation which may (but is unlikely to) be
-     * larger than the original. Check for overrun at the end.
-     */
-
     if (sqlLength < 0) {
         sqlLength = (int)strlen(sql);
     }
-    stmtPtr = ns_calloc(1, sizeof(Statement) + (size_t)sqlLength + 32u);
-    stmtPtr->handlePtr = handlePtr;
-    Tcl_InitHashTable(&stmtPtr->bindTable, TCL_STRING_KEYS);
 
     /*
-     * Save a copy of the original sql to chop up.
+     * Save a copy of the original sql to chop up. The names of the
+     * bind variables are collected NUL-separated in namesDs.
      */
 
     Tcl_DStringInit(&ds);
+    Tcl_DStringInit(&namesDs);
     Tcl_DStringInit(&origDs);
     Tcl_DStringAppend(&origDs, sql, sqlLength);
 
@@ -2319,6 +3558,7 @@ ParseBindVars(Handle *handlePtr, const char *sql, TCL_SIZE_T sqlLength)
     chunk = currentSql;
     bind = NULL;
     isQuoted = 0;
+    suffix = 0;
 
     while (len > 0) {
 
@@ -2330,7 +3570,19 @@ ParseBindVars(Handle *handlePtr, const char *sql, TCL_SIZE_T sqlLength)
                 isQuoted = !isQuoted;
             }
         } else if (bind != NULL) {
-            if (!(isalnum((int)*p) || *p == '_') && p > bind) {
+            /*
+             * A list variable :name[] has the brackets as part of
+             * its name. Anything else in brackets, e.g. the array
+             * subscript of :name[1], follows the variable.
+             */
+            if (suffix == 0 && *p == '[' && p > bind + 1 && p[1] == ']') {
+                suffix = 1;
+            } else if (suffix == 1) {
+                if (*p == ']') {
+                    suffix = 2;
+                }
+            } else if ((suffix == 2 || !(isalnum((int)*p) || *p == '_')) && p > bind) {
+                suffix = 0;
                 /* End of bind var. Append the preceding chunk. */
                 *bind = '\0';
                 Tcl_DStringAppend(&ds, chunk, (int)(bind - chunk));
@@ -2339,10 +3591,8 @@ ParseBindVars(Handle *handlePtr, const char *sql, TCL_SIZE_T sqlLength)
                 ++bind;     /* beginning of bind var */
                 save = *p;
                 *p = '\0';  /* end of bind var */
-                if ((status = DefineBindVar(stmtPtr, bind, &ds))
-                    != NS_OK) {
-                    goto done;
-                }
+                AppendBindVar(poolPtr, bind, numVars++, &ds);
+                Tcl_DStringAppend(&namesDs, bind, (TCL_SIZE_T)(p - bind) + 1);
                 *p = save;
                 bind = NULL;
             }
@@ -2354,53 +3604,150 @@ ParseBindVars(Handle *handlePtr, const char *sql, TCL_SIZE_T sqlLength)
     Tcl_DStringAppend(&ds, chunk, (int)(bind ? bind - chunk : p - chunk));
     /* check for trailing bindvar */
     if (bind != NULL && p > bind) {
-        if ((status = DefineBindVar(stmtPtr, ++bind, &ds))
-            != NS_OK) {
-            goto done;
-        }
+        ++bind;
+        AppendBindVar(poolPtr, bind, numVars++, &ds);
+        Tcl_DStringAppend(&namesDs, bind, (TCL_SIZE_T)(p - bind) + 1);
     }
 
     /*
-     * Check for overrun.
+     * Allocate the Statement with room for the driver specific SQL
+     * and its terminating NUL, and define the bind variables.
      */
 
-    if (ds.length > sqlLength + 32) {
-        Dbi_SetException((Dbi_Handle *) handlePtr, "HY000",
-                         "bug: not enough memory for bound sql");
-        status = NS_ERROR;
-        goto done;
-    }
+    stmtPtr = ns_calloc(1, sizeof(Statement) + (size_t)ds.length);
+    stmtPtr->handlePtr = handlePtr;
+    stmtPtr->vars = stmtPtr->staticVars;
+    stmtPtr->varsAvailable = DBI_STATIC_BIND;
+    Tcl_InitHashTable(&stmtPtr->bindTable, TCL_STRING_KEYS);
 
- done:
-    if (status == NS_OK) {
-        stmtPtr->id = handlePtr->stmtid++;
-        strncpy(stmtPtr->driverSql, ds.string, (size_t)ds.length);
-        stmtPtr->sql = stmtPtr->driverSql;
-        stmtPtr->length = ds.length;
-    } else {
-        Tcl_DeleteHashTable(&stmtPtr->bindTable);
-        ns_free(stmtPtr);
-        stmtPtr = NULL;
+    name = namesDs.string;
+    for (i = 0; i < numVars; i++) {
+        DefineBindVar(stmtPtr, name);
+        name += strlen(name) + 1u;
     }
+
+    stmtPtr->id = handlePtr->stmtid++;
+    Ns_MutexLock(&serialLock);
+    stmtPtr->serial = nextSerial++;
+    Ns_MutexUnlock(&serialLock);
+    memcpy(stmtPtr->driverSql, ds.string, (size_t)ds.length + 1u);
+    stmtPtr->sql = stmtPtr->driverSql;
+    stmtPtr->length = ds.length;
+
     Tcl_DStringFree(&ds);
+    Tcl_DStringFree(&namesDs);
     Tcl_DStringFree(&origDs);
 
     return stmtPtr;
 }
 
-static int
-DefineBindVar(Statement *stmtPtr, const char *name, Tcl_DString *dsPtr)
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SplitBindVar --
+ *
+ *      Split a list variable, :name[], into the key under which the
+ *      list is found and the [] suffix.
+ *
+ * Results:
+ *      DBI_ELEMENT_ALL for a list or DBI_ELEMENT_NONE for a plain
+ *      variable.
+ *
+ * Side effects:
+ *      The length of the key is left in *keyLengthPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TCL_SIZE_T
+SplitBindVar(const char *name, TCL_SIZE_T *keyLengthPtr)
+{
+    size_t length;
+
+    length = strlen(name);
+    if (length > 2 && name[length - 2] == '[' && name[length - 1] == ']') {
+        *keyLengthPtr = (TCL_SIZE_T)(length - 2u);
+        return DBI_ELEMENT_ALL;
+    }
+    *keyLengthPtr = (TCL_SIZE_T) length;
+
+    return DBI_ELEMENT_NONE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendBindVar --
+ *
+ *      Append the driver notation for the bind variable with the
+ *      given name and index.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AppendBindVar(const Pool *poolPtr, const char *name, int index, Tcl_DString *dsPtr)
+{
+    TCL_SIZE_T keyLength;
+
+    if (poolPtr->bindListProc != NULL
+        && SplitBindVar(name, &keyLength) == DBI_ELEMENT_ALL) {
+        (*poolPtr->bindListProc)(dsPtr, name, index);
+    } else {
+        (*poolPtr->bindVarProc)(dsPtr, name, index);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DefineBindVar --
+ *
+ *      Add the next bind variable to a Statement.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The vars array of the Statement may grow.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DefineBindVar(Statement *stmtPtr, const char *name)
 {
     const Pool    *poolPtr = stmtPtr->handlePtr->poolPtr;
     Tcl_HashEntry *hPtr;
+    BindVar       *varPtr;
+    intptr_t       occurrence;
     int            new, index;
 
     index = (int) stmtPtr->numVars;
-    if (index >= DBI_MAX_BIND) {
-        Dbi_SetException((Dbi_Handle *) stmtPtr->handlePtr,
-                         "HY000", "max bind variables exceeded: %d",
-                         DBI_MAX_BIND);
-        return NS_ERROR;
+
+    /*
+     * Grow the vars array once the static space is used up.
+     */
+
+    if (stmtPtr->numVars == stmtPtr->varsAvailable) {
+        size_t size = (size_t) stmtPtr->varsAvailable * 2u * sizeof(BindVar);
+
+        if (stmtPtr->vars == stmtPtr->staticVars) {
+            stmtPtr->vars = ns_malloc(size);
+            memcpy(stmtPtr->vars, stmtPtr->staticVars, sizeof(stmtPtr->staticVars));
+        } else {
+            stmtPtr->vars = ns_realloc(stmtPtr->vars, size);
+        }
+        stmtPtr->varsAvailable *= 2u;
     }
 
     /*
@@ -2410,15 +3757,23 @@ DefineBindVar(Statement *stmtPtr, const char *name, Tcl_DString *dsPtr)
      */
 
     hPtr = Tcl_CreateHashEntry(&stmtPtr->bindTable, name, &new);
-    if (new) {
-        Tcl_SetHashValue(hPtr, (ClientData)(intptr_t) index);
-    }
-    stmtPtr->vars[index].name = Tcl_GetHashKey(&stmtPtr->bindTable, hPtr);
-    stmtPtr->numVars++;
+    occurrence = new ? 0 : (intptr_t) Tcl_GetHashValue(hPtr);
+    Tcl_SetHashValue(hPtr, (ClientData)(occurrence + 1));
+    varPtr = &stmtPtr->vars[index];
+    varPtr->name = Tcl_GetHashKey(&stmtPtr->bindTable, hPtr);
+    varPtr->element = SplitBindVar(name, &varPtr->keyLength);
+    varPtr->isList = (poolPtr->bindListProc != NULL
+                      && varPtr->element == DBI_ELEMENT_ALL);
 
-    (*poolPtr->bindVarProc)(dsPtr, name, index);
+    /*
+     * Without native lists each :name[] stands for one element of
+     * an expanded list. Number them by occurrence.
+     */
 
-    return NS_OK;
+    if (varPtr->element == DBI_ELEMENT_ALL && !varPtr->isList) {
+        varPtr->element = (TCL_SIZE_T) occurrence;
+    }
+    stmtPtr->numVars++;
 }
 
 /*
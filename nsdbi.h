@@ -41,13 +41,34 @@
 
 
 /*
- * The following defines the maximum number of bind variables
- * which may appear in a single statement.
+ * There is no longer a limit on the number of bind variables which
+ * may appear in a single statement. Statements with up to
+ * DBI_STATIC_BIND variables need no extra allocation.
+ *
+ * DBI_MAX_BIND is kept for source compatibility only: drivers must
+ * size bind arrays from the numValues passed to Dbi_ExecProc.
  */
 
-#define DBI_MAX_BIND 32
+#define DBI_STATIC_BIND 8
+#define DBI_MAX_BIND 32 /* Deprecated. */
 #define DBI_NUM_ROWS_UNKNOWN -1
 
+/*
+ * The element of an expanded list bind variable, :name[], counts its
+ * occurrences. The following mark a native list and a plain variable.
+ * See: Dbi_VariableKey().
+ */
+
+#define DBI_ELEMENT_ALL  -1  /* :name[] */
+#define DBI_ELEMENT_NONE -2  /* :name   */
+
+/*
+ * The following is returned by Dbi_GetHandle when the circuit breaker
+ * of a pool is open, i.e. the database is known to be unavailable.
+ */
+
+#define DBI_UNAVAILABLE (-10)
+
 /*
  * The following define SQL transaction isolation levels.
  */
@@ -66,7 +87,11 @@ typedef enum {
 typedef enum {
     Dbi_QuoteNone = 0,
     Dbi_QuoteHTML,
-    Dbi_QuoteJS
+    Dbi_QuoteJS,
+    Dbi_QuoteJSON,
+    Dbi_QuoteURL,
+    Dbi_QuoteXML,
+    Dbi_QuoteSQL
 } Dbi_quotingLevel;
 
 /*
@@ -79,7 +104,11 @@ typedef enum {
     Dbi_ResultDicts,
     Dbi_ResultAvLists,
     Dbi_ResultDict,
-    Dbi_ResultLists
+    Dbi_ResultLists,
+    Dbi_ResultColumns,
+    Dbi_ResultJson,
+    Dbi_ResultJsonArrays,
+    Dbi_ResultCsv
 } Dbi_resultFormat;
 
 
@@ -94,7 +123,10 @@ typedef enum {
     DBI_CONFIG_MAXIDLE,
     DBI_CONFIG_MAXOPEN,
     DBI_CONFIG_MAXQUERIES,
-    DBI_CONFIG_TIMEOUT
+    DBI_CONFIG_TIMEOUT,
+    DBI_CONFIG_VALIDATIONINTERVAL,
+    DBI_CONFIG_RETRIES,
+    DBI_CONFIG_RETRYTIMEOUT
 } DBI_CONFIG_OPTION;
 
 
@@ -112,19 +144,56 @@ typedef struct Dbi_Handle {
     Dbi_Pool           *pool;        /* The pool this handle belongs to. */
     unsigned int        rowIdx;      /* The current row of the result set. */
     ClientData          driverData;  /* Driver private handle context. */
-    int                 numRowsHint; /* Rows affected in a DBI_Exec() operation */
+    int                 numRowsHint; /* Rows affected by, or returned from, a Dbi_Exec(). */
 } Dbi_Handle;
 
+/*
+ * The following are the native types a value may carry in addition
+ * to its string or binary data.
+ */
+
+typedef enum {
+    DBI_VALUE_STRING = 0,   /* No native value: data, length, binary only. */
+    DBI_VALUE_INT,          /* v.i */
+    DBI_VALUE_WIDE,         /* v.w */
+    DBI_VALUE_DOUBLE,       /* v.d */
+    DBI_VALUE_BOOL,         /* v.i, 0 or 1 */
+    DBI_VALUE_TIMESTAMP,    /* v.t, since the epoch */
+    DBI_VALUE_BYTES,        /* data and length. Column values only. */
+    DBI_VALUE_NULL          /* SQL NULL. Column values only. */
+} Dbi_ValueType;
+
 /*
  * The following structure defines a single result value.
+ *
+ * Bind values taken from Tcl integers, doubles, booleans and ns_time
+ * values carry the native value as well as the string, so drivers may
+ * send binary protocol parameters. Callers filling a Dbi_Value for untyped data must set
+ * type to DBI_VALUE_STRING.
  */
 
 typedef struct Dbi_Value {
     const char   *data;  /* NULL for null SQL values. */
     size_t        length;   /* Length of data in bytes. */
     int           binary;   /* 1 if data is binary, utf8 otherwise. */
+    Dbi_ValueType type;     /* Native type, if any. */
+    union {
+        int          i;
+        Tcl_WideInt  w;
+        double       d;
+        Ns_Time      t;
+    } v;                    /* Native value unless DBI_VALUE_STRING. */
 } Dbi_Value;
 
+/*
+ * The following is called by Dbi_ExpandListVariables to find the
+ * number of elements bound to a list variable, :name[].
+ */
+
+typedef int
+Dbi_ListLengthProc(ClientData arg, const char *name, TCL_SIZE_T nameLength,
+                   TCL_SIZE_T *lengthPtr);
+
 
 /*
  * Library initialization.
@@ -163,6 +232,10 @@ NS_EXTERN int
 Dbi_Reset(Dbi_Handle *)
     NS_GNUC_NONNULL(1);
 
+NS_EXTERN int
+Dbi_Reconnect(Dbi_Handle *handle)
+    NS_GNUC_NONNULL(1);
+
 /*
  * Functions for preparing and describing queries.
  */
@@ -179,6 +252,25 @@ NS_EXTERN int
 Dbi_VariableName(Dbi_Handle *handle, unsigned int index, const char **namePtr)
     NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(3);
 
+NS_EXTERN int
+Dbi_VariableKey(Dbi_Handle *handle, unsigned int index,
+                TCL_SIZE_T *keyLengthPtr, TCL_SIZE_T *elementPtr)
+    NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(3) NS_GNUC_NONNULL(4);
+
+NS_EXTERN unsigned long
+Dbi_StatementSerial(Dbi_Handle *handle)
+    NS_GNUC_NONNULL(1);
+
+NS_EXTERN int
+Dbi_VariableIsList(Dbi_Handle *handle, unsigned int index)
+    NS_GNUC_NONNULL(1);
+
+NS_EXTERN int
+Dbi_ExpandListVariables(Dbi_Handle *handle, const char *sql, TCL_SIZE_T length,
+                        Dbi_ListLengthProc *lengthProc, ClientData arg,
+                        Tcl_DString *dsPtr)
+    NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(2) NS_GNUC_NONNULL(4) NS_GNUC_NONNULL(6);
+
 NS_EXTERN unsigned int
 Dbi_NumColumns(Dbi_Handle *handle)
     NS_GNUC_NONNULL(1);
@@ -209,6 +301,10 @@ Dbi_ColumnLength(Dbi_Handle *handle, unsigned int index,
                  size_t *lengthPtr, int *binaryPtr)
     NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(3) NS_GNUC_NONNULL(4);
 
+NS_EXTERN int
+Dbi_ColumnTypedValue(Dbi_Handle *handle, unsigned int index, Dbi_Value *valuePtr)
+    NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(3);
+
 NS_EXTERN int
 Dbi_ColumnValue(Dbi_Handle *handle, unsigned int index,
                 char *value, size_t size)
@@ -246,6 +342,23 @@ NS_EXTERN char *
 Dbi_Stats(Ns_DString *ds, Dbi_Pool *poolPtr)
     NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(2);
 
+/*
+ * Functions for the cache of rendered template output.
+ */
+
+NS_EXTERN int
+Dbi_FragmentGet(Dbi_Pool *pool, const char *key, Tcl_DString *dsPtr)
+    NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(2) NS_GNUC_NONNULL(3);
+
+NS_EXTERN void
+Dbi_FragmentSet(Dbi_Pool *pool, const char *key, const char *data, TCL_SIZE_T length,
+                const Ns_Time *ttlPtr, TCL_SIZE_T numTags, const char *const tags[])
+    NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(2) NS_GNUC_NONNULL(3);
+
+NS_EXTERN int
+Dbi_FragmentFlush(Dbi_Pool *pool, const char *tag)
+    NS_GNUC_NONNULL(1);
+
 NS_EXTERN const char *
 Dbi_PoolName(Dbi_Pool *pool)
     NS_GNUC_NONNULL(1);
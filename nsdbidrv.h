@@ -69,7 +69,8 @@ typedef struct Dbi_Statement {
 
 /*
  * The following enum defines ids for callback functions
- * which a driver must implement.
+ * which a driver must implement. Callbacks following
+ * Dbi_ResetProcId are optional.
  */
 
 typedef enum {
@@ -86,7 +87,10 @@ typedef enum {
     Dbi_ColumnNameProcId,
     Dbi_TransactionProcId,
     Dbi_FlushProcId,
-    Dbi_ResetProcId
+    Dbi_ResetProcId,
+    Dbi_PingProcId,
+    Dbi_BindListProcId,
+    Dbi_ColumnTypedValueProcId
 } Dbi_ProcId;
 
 /*
@@ -120,6 +124,13 @@ typedef void
 Dbi_PrepareCloseProc(Dbi_Handle *, Dbi_Statement *)
     NS_GNUC_NONNULL(1);
 
+/*
+ * Dbi_ExecProc may set handle->numRowsHint to the number of rows
+ * affected by a DML statement or, when the result is buffered, the
+ * total number of rows a query will return. It is reset to
+ * DBI_NUM_ROWS_UNKNOWN before each call.
+ */
+
 typedef int
 Dbi_ExecProc(Dbi_Handle *, Dbi_Statement *,
              Dbi_Value *values, unsigned int numValues)
@@ -159,6 +170,42 @@ typedef int
 Dbi_ResetProc(Dbi_Handle *)
     NS_GNUC_NONNULL(1);
 
+/*
+ * Optional: check with the db that a connected handle is still
+ * usable. Return NS_OK if so, NS_ERROR otherwise.
+ */
+
+typedef int
+Dbi_PingProc(Dbi_Handle *)
+    NS_GNUC_NONNULL(1);
+
+/*
+ * Optional: append the notation for a list bind variable, :name[],
+ * which the driver binds as a single native array parameter. The
+ * value is passed to Dbi_ExecProc as the string rep of a Tcl list.
+ * See: Dbi_VariableIsList(). Without this callback list variables
+ * are expanded into one bind variable per element.
+ */
+
+typedef void
+Dbi_BindListProc(Ns_DString *, const char *name, int bindIdx)
+    NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(2);
+
+/*
+ * Optional: fetch a column as a native value, setting valuePtr->type
+ * and valuePtr->v, or for DBI_VALUE_BYTES valuePtr->data and length,
+ * which must remain valid until the next row. Set the type to
+ * DBI_VALUE_STRING to have the value fetched as a string instead with
+ * the ColumnLength and ColumnValue procs, e.g. for text columns. SQL
+ * NULLs may be reported as DBI_VALUE_NULL; the string procs must still
+ * return an empty value for them.
+ */
+
+typedef int
+Dbi_ColumnTypedValueProc(Dbi_Handle *, Dbi_Statement *, unsigned int index,
+                         Dbi_Value *valuePtr)
+    NS_GNUC_NONNULL(1) NS_GNUC_NONNULL(2) NS_GNUC_NONNULL(4);
+
 /*
  * The following structure is used to register driver callbacks.
  */
@@ -184,6 +231,9 @@ typedef struct Dbi_DriverProc {
         Dbi_TransactionProc  *transProc;
         Dbi_FlushProc        *flushProc;
         Dbi_ResetProc        *resetProc;
+        Dbi_PingProc         *pingProc;
+        Dbi_BindListProc     *bindListProc;
+        Dbi_ColumnTypedValueProc *columnTypedValueProc;
     } u;
 } Dbi_DriverProc;
 
@@ -192,14 +242,31 @@ typedef struct Dbi_DriverProc {
 /*
  * The following function is used to register driver callbacks
  * and create a pool of handles to the configured database.
+ *
+ * Drivers are registered with the ABI version of the headers they
+ * were compiled against. Version 1 drivers are passed the Dbi_Value
+ * layout without a native type.
  */
 
+#define DBI_ABI_VERSION 2
+
+NS_EXTERN int
+Dbi_RegisterDriverAbi(const char *server, const char *module,
+                      const char *driver, const char *database,
+                      const Dbi_DriverProc *procs, ClientData configData,
+                      int abiVersion)
+     NS_GNUC_NONNULL(2) NS_GNUC_NONNULL(3) NS_GNUC_NONNULL(4) NS_GNUC_NONNULL(5);
+
 NS_EXTERN int
 Dbi_RegisterDriver(const char *server, const char *module,
                    const char *driver, const char *database,
                    const Dbi_DriverProc *procs, ClientData configData)
      NS_GNUC_NONNULL(2) NS_GNUC_NONNULL(3) NS_GNUC_NONNULL(4) NS_GNUC_NONNULL(5);
 
+#define Dbi_RegisterDriver(server, module, driver, database, procs, configData) \
+    Dbi_RegisterDriverAbi((server), (module), (driver), (database),           \
+                          (procs), (configData), DBI_ABI_VERSION)
+
 
 
 #endif /* NSDBIDRV_H */
@@ -49,6 +49,8 @@ typedef struct Connection {
 
     const char   *configData;     /* Pointer to per-pool config data. */
     int           connected;      /* Is the handle currently connected to the db? */
+    int           dead;           /* Simulate a dropped connection (PINGERR). */
+    unsigned int  queries;        /* Queries executed on this connection. */
 
     unsigned int  numCols;        /* Total number of columns in statement/result. */
     unsigned int  numRows;        /* Total number of rows to return in result. */
@@ -75,6 +77,8 @@ static Dbi_ConnectedProc    Connected;
 static Dbi_PrepareProc      Prepare;
 static Dbi_PrepareCloseProc PrepareClose;
 static Dbi_BindVarProc      Bind;
+static Dbi_BindListProc     BindList;
+static Dbi_ColumnTypedValueProc ColumnTypedValue;
 static Dbi_ExecProc         Exec;
 static Dbi_NextRowProc      NextRow;
 static Dbi_ColumnLengthProc ColumnLength;
@@ -83,6 +87,7 @@ static Dbi_ColumnNameProc   ColumnName;
 static Dbi_TransactionProc  Transaction;
 static Dbi_FlushProc        Flush;
 static Dbi_ResetProc        Reset;
+static Dbi_PingProc         Ping;
 
 
 /*
@@ -104,6 +109,7 @@ static const Dbi_DriverProc procs[] = {
     {Dbi_TransactionProcId,  .u.transProc        = Transaction},
     {Dbi_FlushProcId,        .u.flushProc        = Flush},
     {Dbi_ResetProcId,        .u.resetProc        = Reset},
+    {Dbi_PingProcId,         .u.pingProc         = Ping},
     {0, NULL}
 };
 
@@ -131,10 +137,30 @@ Ns_ModuleInit(const char *server, const char *module)
     const char *name       = "test";
     const char *database   = "db";
     const char *configData = "driver config data";
+    Dbi_DriverProc extraProcs[sizeof(procs) / sizeof(procs[0]) + 1];
+    size_t         n = sizeof(procs) / sizeof(procs[0]) - 1;
 
     Dbi_LibInit();
+
+    /*
+     * Pools named nativelist* bind :name[] as a single array parameter,
+     * pools named typed* return native column values.
+     */
+
+    memcpy(extraProcs, procs, n * sizeof(Dbi_DriverProc));
+
+    if (strncmp(module, "nativelist", 10) == 0) {
+        extraProcs[n].id = Dbi_BindListProcId;
+        extraProcs[n++].u.bindListProc = BindList;
+    } else if (strncmp(module, "typed", 5) == 0) {
+        extraProcs[n].id = Dbi_ColumnTypedValueProcId;
+        extraProcs[n++].u.columnTypedValueProc = ColumnTypedValue;
+    }
+    extraProcs[n].id = 0;
+    extraProcs[n].u.proc = NULL;
+
     return Dbi_RegisterDriver(server, module, name, database,
-                              procs, (char *)configData);
+                              extraProcs, (char *)configData);
 }
 
 
@@ -161,8 +187,7 @@ Open(ClientData configData, Dbi_Handle *handle)
 
     assert(handle);
 
-    if (STREQ(Dbi_PoolName(handle->pool), "OPENERR")
-            || STREQ(Dbi_PoolName(handle->pool), "OPENERR0")) {
+    if (strncmp(Dbi_PoolName(handle->pool), "OPENERR", 7) == 0) {
         Dbi_SetException(handle, "00000", "simulate failed open");
         return NS_ERROR;
     }
@@ -220,6 +245,14 @@ Close(Dbi_Handle *handle)
     assert(conn->numCols == 0);
     assert(conn->numRows == 0);
 
+    /*
+     * Simulate a close which waits on the network.
+     */
+
+    if (strncmp(Dbi_PoolName(handle->pool), "slowclose", 9) == 0) {
+        sleep(1);
+    }
+
     Tcl_DStringFree(&conn->ds);
     ns_free(conn);
 }
@@ -275,11 +308,38 @@ Bind(Tcl_DString *ds, const char *name, int bindIdx)
     assert(name);
     assert(*name != '\0');
     assert(bindIdx >= 0);
-    assert(bindIdx <= DBI_MAX_BIND);
 
     Ns_DStringPrintf(ds, "%d:%s", bindIdx, name);
 }
 
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BindList --
+ *
+ *      Append the notation for a list bound as a single array, in the
+ *      style of Postgres: = ANY($1).
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+BindList(Tcl_DString *ds, const char *name, int bindIdx)
+{
+    assert(ds);
+    assert(name);
+    assert(bindIdx >= 0);
+
+    Ns_DStringPrintf(ds, "ARRAY(%d:%s)", bindIdx, name);
+}
+
 
 /*
  *----------------------------------------------------------------------
@@ -343,6 +403,16 @@ Prepare(Dbi_Handle *handle, Dbi_Statement *stmt,
         Dbi_SetException(handle, "TEST", "test: prepare failure");
         return NS_ERROR;
     }
+
+    /*
+     * Simulate a connection which was lost before the statement could
+     * be prepared. A fresh connection succeeds.
+     */
+
+    if (STREQ(conn->cmd, "PREPCONNERR") && conn->queries > 0) {
+        Dbi_SetException(handle, "08006", "nsdbitest: connection failure");
+        return NS_ERROR;
+    }
     conn->numCols = numCols;
     conn->numRows = numRows;
 
@@ -434,7 +504,6 @@ Exec(Dbi_Handle *handle, Dbi_Statement *stmt,
 
     assert(stmt);
 
-    assert(numValues <= DBI_MAX_BIND);
     assert(numValues == 0 || (numValues > 0 && values != NULL));
 
     assert((stmt->nqueries == 0 && !stmt->driverData)
@@ -445,18 +514,44 @@ Exec(Dbi_Handle *handle, Dbi_Statement *stmt,
     assert(conn->connected == NS_TRUE);
 
 
+    /*
+     * Simulate a server which went away after the connection was
+     * first used, e.g. a failover. A fresh connection succeeds.
+     */
+
+    if (STREQ(conn->cmd, "CONNERR") && conn->queries > 0) {
+        Dbi_SetException(handle, "08006", "nsdbitest: connection failure");
+        return NS_ERROR;
+    }
+
     /*
      * Execute the test commands.
      */
 
     if (STREQ(conn->cmd, "DML")
-        || STREQ(conn->cmd, "ROWS")) {
+        || STREQ(conn->cmd, "ROWS")
+        || STREQ(conn->cmd, "TYPES")
+        || STREQ(conn->cmd, "NULLS")
+        || STREQ(conn->cmd, "GROUPS")
+        || STREQ(conn->cmd, "CONNERR")
+        || STREQ(conn->cmd, "PREPCONNERR")
+        || STREQ(conn->cmd, "PINGERR")) {
+
+        /*
+         * PINGERR behaves like ROWS but leaves the connection
+         * looking dead to the next ping.
+         */
+
+        if (STREQ(conn->cmd, "PINGERR")) {
+            conn->dead = NS_TRUE;
+        }
 
         /*
          * Record bound values, which we report as the first column
          * of the first row during fetch.
          *
-         * For binary values we record the length in bytes.
+         * For binary values we record the length in bytes. Pools
+         * named typed* record the native type of values.
          */
 
         for (i = 0; i < numValues; i++) {
@@ -464,9 +559,27 @@ Exec(Dbi_Handle *handle, Dbi_Statement *stmt,
             /* check nulls and lengths */
             assert((values[i].length && values[i].data)
                    || (!values[i].length && !values[i].data));
+            assert(values[i].data != NULL || values[i].type == DBI_VALUE_STRING);
 
             if (values[i].binary) {
                 Ns_DStringPrintf(&conn->ds, " %" PRIdz, values[i].length);
+            } else if (values[i].type != DBI_VALUE_STRING
+                       && strncmp(Dbi_PoolName(handle->pool), "typed", 5) == 0) {
+                char buf[64];
+
+                if (values[i].type == DBI_VALUE_INT) {
+                    snprintf(buf, sizeof(buf), "int:%d", values[i].v.i);
+                } else if (values[i].type == DBI_VALUE_WIDE) {
+                    snprintf(buf, sizeof(buf), "wide:%" TCL_LL_MODIFIER "d", values[i].v.w);
+                } else if (values[i].type == DBI_VALUE_DOUBLE) {
+                    snprintf(buf, sizeof(buf), "double:%g", values[i].v.d);
+                } else if (values[i].type == DBI_VALUE_BOOL) {
+                    snprintf(buf, sizeof(buf), "bool:%d", values[i].v.i);
+                } else {
+                    snprintf(buf, sizeof(buf), "time:%ld.%06ld",
+                             (long) values[i].v.t.sec, values[i].v.t.usec);
+                }
+                Tcl_DStringAppendElement(&conn->ds, buf);
             } else {
 	        Tcl_DStringAppendElement(&conn->ds, values[i].length > 0 ? values[i].data : "");
             }
@@ -475,7 +588,17 @@ Exec(Dbi_Handle *handle, Dbi_Statement *stmt,
             Tcl_DStringAppendElement(&conn->ds, conn->rest);
         }
 
+        /*
+         * Report the number of rows up front, as a driver with a
+         * buffered result would.
+         */
+
+        if (conn->numCols > 0 && !STREQ(conn->cmd, "DML")) {
+            handle->numRowsHint = (int) conn->numRows;
+        }
+
         conn->exec = 1;
+        conn->queries++;
 
         return NS_OK;
 
@@ -602,7 +725,8 @@ NextRow(Dbi_Handle *handle, Dbi_Statement *stmt, int *endPtr)
  * ColumnLength --
  *
  *      Return the length of the column value in bytes, and whether or
- *      not it is binary or text.
+ *      not it is binary or text. Columns of the NULLS command are
+ *      empty, as for SQL NULL.
  *
  * Results:
  *      NS_OK.
@@ -644,6 +768,22 @@ ColumnLength(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
         *lengthPtr = 8;
         *binaryPtr = 1;
 
+    } else if (STREQ(conn->cmd, "NULLS")) {
+
+        *lengthPtr = 0;
+        *binaryPtr = 0;
+
+    } else if (STREQ(conn->cmd, "GROUPS") && index == 0) {
+
+        /*
+         * The first column of GROUPS is the same for each pair of rows.
+         */
+
+        Tcl_DStringSetLength(&conn->ds, 0);
+        Ns_DStringPrintf(&conn->ds, "g%u", handle->rowIdx / 2);
+        *lengthPtr = (size_t)conn->ds.length;
+        *binaryPtr = 0;
+
     } else {
         Tcl_DStringSetLength(&conn->ds, 0);
         Ns_DStringPrintf(&conn->ds, "%u.%u",
@@ -656,6 +796,84 @@ ColumnLength(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * ColumnTypedValue --
+ *
+ *      Return the columns of the TYPES command as native values:
+ *      a wide integer, an integer, a double, a boolean, a timestamp
+ *      and bytes, repeating. Columns of the NULLS command are all
+ *      SQL NULL.
+ *
+ * Results:
+ *      NS_OK.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ColumnTypedValue(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
+                 Dbi_Value *valuePtr)
+{
+    Connection        *conn = handle->driverData;
+    static const char  bytesValue[3] = {0, 1, 2};
+
+    assert(stmt);
+    assert(valuePtr);
+
+    assert(conn);
+    assert(conn->exec == 1);
+    assert(conn->nextrow == 1);
+    assert(index < conn->numCols);
+
+    if (STREQ(conn->cmd, "NULLS")) {
+        valuePtr->type = DBI_VALUE_NULL;
+        return NS_OK;
+    }
+    if (!STREQ(conn->cmd, "TYPES")
+        || (handle->rowIdx == 0 && index == 0 && conn->rest)) {
+        valuePtr->type = DBI_VALUE_STRING;
+        return NS_OK;
+    }
+
+    switch (index % 6) {
+    case 0:
+        valuePtr->type = DBI_VALUE_WIDE;
+        valuePtr->v.w = ((Tcl_WideInt) 1 << 32) + handle->rowIdx;
+        break;
+    case 1:
+        valuePtr->type = DBI_VALUE_INT;
+        valuePtr->v.i = (int) handle->rowIdx;
+        break;
+    case 2:
+        valuePtr->type = DBI_VALUE_DOUBLE;
+        valuePtr->v.d = 0.5 + handle->rowIdx;
+        break;
+    case 3:
+        valuePtr->type = DBI_VALUE_BOOL;
+        valuePtr->v.i = (handle->rowIdx % 2 == 0);
+        break;
+    case 4:
+        valuePtr->type = DBI_VALUE_TIMESTAMP;
+        valuePtr->v.t.sec = 1000000000 + (long) handle->rowIdx;
+        valuePtr->v.t.usec = 500000;
+        break;
+    default:
+        valuePtr->type = DBI_VALUE_BYTES;
+        valuePtr->data = bytesValue;
+        valuePtr->length = sizeof(bytesValue);
+        valuePtr->binary = 1;
+        break;
+    }
+
+    return NS_OK;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -712,6 +930,13 @@ ColumnValue(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
         assert(length <= sizeof(binaryValue));
         memcpy(value, binaryValue, length);
 
+    } else if (STREQ(conn->cmd, "GROUPS") && index == 0) {
+        Tcl_DStringSetLength(&conn->ds, 0);
+        Ns_DStringPrintf(&conn->ds, "g%u", handle->rowIdx / 2);
+
+        assert(length <= (size_t)conn->ds.length);
+        memcpy(value, conn->ds.string, length);
+
     } else {
         Tcl_DStringSetLength(&conn->ds, 0);
         Ns_DStringPrintf(&conn->ds, "%u.%u",
@@ -858,3 +1083,36 @@ Reset(Dbi_Handle *handle)
 
     return NS_OK;
 }
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Ping --
+ *
+ *      Check that an idle connection is still usable.
+ *
+ * Results:
+ *      NS_OK, or NS_ERROR once a PINGERR query has been run.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Ping(Dbi_Handle *handle)
+{
+    const Connection *conn = handle->driverData;
+
+    assert(conn != NULL);
+    assert(STREQ(conn->configData, "driver config data"));
+    assert(conn->connected == NS_TRUE);
+
+    if (conn->dead) {
+        Dbi_SetException(handle, "08S01", "nsdbitest: connection lost");
+        return NS_ERROR;
+    }
+    return NS_OK;
+}
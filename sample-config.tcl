@@ -38,7 +38,13 @@ ns_param   maxrows        1000 ;# Default max rows a query may return.
 ns_param   maxidle        0    ;# Handle closed after maxidle seconds if unused.
 ns_param   maxopen        0    ;# Handle closed after maxopen seconds, regardless of use.
 ns_param   maxqueries     0    ;# Handle closed after maxqueries sql queries.
+ns_param   validationinterval 0 ;# Ping handles idle longer than this before use (0 = off).
+ns_param   retries        1    ;# Retry reads this many times after a lost connection.
+ns_param   retrytimeout   5s   ;# Time budget for retrying a read.
 ns_param   checkinterval  600  ;# Check for stale handles every 10 minutes.
+ns_param   breakerthreshold 0  ;# Fail fast after this many consecutive connection failures (0 = off).
+ns_param   breakerbackoff 1s   ;# Initial delay before probing an unavailable db.
+ns_param   breakermaxbackoff 1m ;# Max delay between probes.
 #
 # The following depend on which driver is being used, but you can
 # expect user, password, database.
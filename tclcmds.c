@@ -39,11 +39,24 @@
 #include "nsdbi.h"
 
 #define MAX_NESTING_DEPTH 32
+#define MAX_STMT_OBJS     1024  /* Cached statements per interp. */
+#define MAX_PARALLEL      16    /* Threads rendering a template. */
+#define MAX_PRESIZE       (1024 * 1024)  /* List elements presized for a result. */
 
 
 extern int
 DbiTclSubstTemplate(Tcl_Interp *, Dbi_Handle *,
-                    Tcl_Obj *templateObj, Tcl_Obj *defaultObj, int adp, Dbi_quotingLevel quote);
+                    Tcl_Obj *templateObj, Tcl_Obj *defaultObj, int adp, Dbi_quotingLevel quote,
+                    Tcl_Obj *groupObj, Tcl_Obj *headerObj, Tcl_Obj *footerObj,
+                    int parallel);
+extern int
+DbiTclSubstJson(Tcl_Interp *, Dbi_Handle *, int arrays, int adp);
+extern int
+DbiTclSubstCsv(Tcl_Interp *, Dbi_Handle *, char delimiter, int quoteAll, int adp);
+extern int
+DbiTemplateVariables(Tcl_Interp *interp, Tcl_Obj *templateObj, Tcl_DString *dsPtr);
+extern int
+DbiRenderThreads(int numThreads);
 
 
 /*
@@ -59,8 +72,46 @@ typedef struct InterpData {
     const char *server;
     int         depth;                      /* Nesting depth for dbi_eval */
     Dbi_Handle *handles[MAX_NESTING_DEPTH]; /* Handle cache, indexed by depth. */
+    Tcl_HashTable stmtObjsTable;            /* StmtObjs by statement serial. */
+    Tcl_HashTable fragmentKeysTable;        /* Bind keys of -fragmentcache queries. */
 } InterpData;
 
+/*
+ * The following struct caches the Tcl_Objs used with a prepared
+ * statement: the names of its result columns and the keys of its
+ * bind variables. Tcl_Objs may not be shared between threads and
+ * handles move between threads, so the cache is kept per interp.
+ */
+
+typedef struct StmtObjs {
+    Tcl_Obj      *colListObj;               /* Column names, created on demand. */
+    unsigned int  numVars;
+    Tcl_Obj      *keyObjs[1];               /* Bind keys, created on demand. */
+} StmtObjs;
+
+/*
+ * The following struct records where bind values come from.
+ */
+
+typedef struct BindSource {
+    Ns_Set     *set;                        /* ns_set, or... */
+    Tcl_Obj    *arrayObj;                   /* array, or... */
+    Tcl_Obj    *dictObj;                    /* dict, or local variables. */
+    int         arrayChecked;               /* arrayObj known to exist. */
+} BindSource;
+
+/*
+ * The following struct is passed to ListLength() while expanding
+ * list bind variables.
+ */
+
+typedef struct ListLengthCtx {
+    Tcl_Interp *interp;
+    Tcl_Obj    *valuesObj;
+    BindSource  src;                        /* Valid if initialized. */
+    int         initialized;
+} ListLengthCtx;
+
 
 /*
  * Static functions defined in this file
@@ -79,17 +130,37 @@ static TCL_OBJCMDPROC_T
 static InterpData *GetInterpData(Tcl_Interp *interp);
 static Tcl_InterpDeleteProc FreeInterpData;
 
+static StmtObjs *GetStmtObjs(InterpData *idataPtr, Dbi_Handle *handle);
+static void FlushStmtObjs(InterpData *idataPtr);
+static void SetFragmentKeys(InterpData *idataPtr, Tcl_Obj *queryObj, Dbi_Handle *handle);
+static void FlushFragmentKeys(InterpData *idataPtr);
+static int FragmentBindValues(InterpData *idataPtr, Tcl_Obj *queryObj, Tcl_Obj *valuesObj,
+                              int autoNull, Tcl_DString *dsPtr);
+static int ColumnNames(InterpData *idataPtr, Dbi_Handle *handle, Tcl_Obj **colListObjPtr);
+static int BindVariables(InterpData *idataPtr, Dbi_Handle *handle,
+                         Dbi_Value *dbValues, Tcl_Obj *tclValues, int autoNull);
+
 static int RowCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[],
                   int *foundRowPtr);
 
 static int Exec(InterpData *idataPtr, Tcl_Obj *poolObj, Ns_Time *timeoutPtr,
                 Tcl_Obj *queryObj, Tcl_Obj *valuesObj, int maxRows, int dml,
-                int autoNull, Dbi_Handle **handlePtrPtr);
+                int retry, int autoNull, Dbi_Handle **handlePtrPtr);
+
+static int Retry(InterpData *idataPtr, Dbi_Handle *handle, int dml,
+                 int *retriesPtr, Ns_Time *deadlinePtr);
+
+static int GetBindSource(Tcl_Interp *interp, Tcl_Obj *tclValues, BindSource *srcPtr);
+static int GetBindObj(Tcl_Interp *interp, BindSource *srcPtr, Tcl_Obj *keyObj,
+                      Tcl_Obj **valueObjPtr);
+static Dbi_ListLengthProc ListLength;
+static void SetNativeValue(Tcl_Obj *valueObj, Dbi_Value *valuePtr);
 
 static Dbi_Pool *GetPool(InterpData *, Tcl_Obj *poolObj);
 static Dbi_Handle *GetHandle(InterpData *, Dbi_Pool *, Ns_Time *);
 static void PutHandle(InterpData *idataPtr, Dbi_Handle *handle);
 
+static TCL_SIZE_T PresizeRows(Dbi_Handle *handle, int maxRows, unsigned int perRow);
 static int NextRow(Tcl_Interp *interp, Dbi_Handle *handle, int *endPtr);
 static int ColumnValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
                        Tcl_Obj **valueObjPtr);
@@ -100,6 +171,11 @@ static int ColumnValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int inde
  */
 
 static const Tcl_ObjType    *bytearrayTypePtr;
+static const Tcl_ObjType    *intTypePtr;
+static const Tcl_ObjType    *wideIntTypePtr;   /* NULL in Tcl 9 */
+static const Tcl_ObjType    *doubleTypePtr;
+static const Tcl_ObjType    *booleanTypePtr;
+static const Tcl_ObjType    *timeTypePtr;
 
 /*
  * The following are the values that can be passed to the
@@ -124,6 +200,10 @@ static Ns_ObjvTable quotingTypeStrings[] = {
     {"none", Dbi_QuoteNone},
     {"html", Dbi_QuoteHTML},
     {"js",   Dbi_QuoteJS},
+    {"json", Dbi_QuoteJSON},
+    {"url",  Dbi_QuoteURL},
+    {"xml",  Dbi_QuoteXML},
+    {"sql",  Dbi_QuoteSQL},
     {NULL, 0}
 };
 
@@ -139,6 +219,10 @@ static Ns_ObjvTable resultFormatStrings[] = {
     {"avlists",  Dbi_ResultAvLists},
     {"dict",     Dbi_ResultDict},
     {"lists",    Dbi_ResultLists},
+    {"columns",  Dbi_ResultColumns},
+    {"json",     Dbi_ResultJson},
+    {"jsonarrays", Dbi_ResultJsonArrays},
+    {"csv",      Dbi_ResultCsv},
     {NULL, 0}
 };
 
@@ -193,6 +277,19 @@ DbiInitInterp(Tcl_Interp *interp, const void *UNUSED(arg))
         if (bytearrayTypePtr == NULL) {
             Tcl_Panic("dbi: \"bytearray\" type not defined");
         }
+
+        /*
+         * Types whose values are also bound natively.
+         */
+
+        intTypePtr = Tcl_GetObjType("int");
+        wideIntTypePtr = Tcl_GetObjType("wideInt");
+        doubleTypePtr = Tcl_GetObjType("double");
+        booleanTypePtr = Tcl_GetObjType("booleanString");
+        if (booleanTypePtr == NULL) {
+            booleanTypePtr = Tcl_GetObjType("boolean");
+        }
+        timeTypePtr = Tcl_GetObjType("ns:time");
     }
 
 
@@ -234,6 +331,8 @@ GetInterpData(Tcl_Interp *interp)
         idataPtr->interp = interp;
         idataPtr->server = Ns_TclInterpServer(interp);
         idataPtr->depth = -1;
+        Tcl_InitHashTable(&idataPtr->stmtObjsTable, TCL_ONE_WORD_KEYS);
+        Tcl_InitHashTable(&idataPtr->fragmentKeysTable, TCL_STRING_KEYS);
         Tcl_SetAssocData(interp, key, FreeInterpData, idataPtr);
     }
     return idataPtr;
@@ -242,7 +341,326 @@ GetInterpData(Tcl_Interp *interp)
 static void
 FreeInterpData(ClientData arg, Tcl_Interp *UNUSED(interp))
 {
-    ns_free(arg);
+    InterpData *idataPtr = arg;
+
+    FlushStmtObjs(idataPtr);
+    Tcl_DeleteHashTable(&idataPtr->stmtObjsTable);
+    FlushFragmentKeys(idataPtr);
+    Tcl_DeleteHashTable(&idataPtr->fragmentKeysTable);
+    ns_free(idataPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetStmtObjs --
+ *
+ *      Find the cached Tcl_Objs for the current statement of the
+ *      handle, creating an empty entry if needed.
+ *
+ *      The cache is flushed when it grows beyond MAX_STMT_OBJS
+ *      entries. Entries of statements which are no longer cached by
+ *      any handle are never looked up again.
+ *
+ * Results:
+ *      Pointer to StmtObjs.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static StmtObjs *
+GetStmtObjs(InterpData *idataPtr, Dbi_Handle *handle)
+{
+    Tcl_HashEntry *hPtr;
+    StmtObjs      *stmtObjsPtr;
+    const char    *key;
+    unsigned int   numVars;
+    int            new;
+
+    key = (const char *)(uintptr_t) Dbi_StatementSerial(handle);
+
+    hPtr = Tcl_FindHashEntry(&idataPtr->stmtObjsTable, key);
+    if (hPtr != NULL) {
+        return Tcl_GetHashValue(hPtr);
+    }
+    if (idataPtr->stmtObjsTable.numEntries >= MAX_STMT_OBJS) {
+        FlushStmtObjs(idataPtr);
+    }
+
+    numVars = Dbi_NumVariables(handle);
+    stmtObjsPtr = ns_calloc(1, sizeof(StmtObjs)
+                            + (numVars > 0 ? numVars - 1 : 0) * sizeof(Tcl_Obj *));
+    stmtObjsPtr->numVars = numVars;
+
+    hPtr = Tcl_CreateHashEntry(&idataPtr->stmtObjsTable, key, &new);
+    Tcl_SetHashValue(hPtr, stmtObjsPtr);
+
+    return stmtObjsPtr;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FlushStmtObjs --
+ *
+ *      Release all cached statement Tcl_Objs of an interp.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FlushStmtObjs(InterpData *idataPtr)
+{
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    unsigned int    i;
+
+    hPtr = Tcl_FirstHashEntry(&idataPtr->stmtObjsTable, &search);
+    while (hPtr != NULL) {
+        StmtObjs *stmtObjsPtr = Tcl_GetHashValue(hPtr);
+
+        if (stmtObjsPtr->colListObj != NULL) {
+            Tcl_DecrRefCount(stmtObjsPtr->colListObj);
+        }
+        for (i = 0; i < stmtObjsPtr->numVars; i++) {
+            if (stmtObjsPtr->keyObjs[i] != NULL) {
+                Tcl_DecrRefCount(stmtObjsPtr->keyObjs[i]);
+            }
+        }
+        ns_free(stmtObjsPtr);
+        Tcl_DeleteHashEntry(hPtr);
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetFragmentKeys, FlushFragmentKeys --
+ *
+ *      Remember the distinct bind keys of a query run with
+ *      -fragmentcache, so that the cache key of its next run can be
+ *      built without a handle, or release all remembered keys.
+ *
+ *      Keys are looked up by query text. Like the statement cache
+ *      they are flushed when there are more than MAX_STMT_OBJS.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SetFragmentKeys(InterpData *idataPtr, Tcl_Obj *queryObj, Dbi_Handle *handle)
+{
+    Tcl_HashEntry *hPtr;
+    StmtObjs      *stmtObjsPtr = NULL;
+    Tcl_Obj       *keysObj, **keyObjv;
+    TCL_SIZE_T     numKeys, k;
+    unsigned int   numVars, i;
+    int            new;
+
+    numVars = Dbi_NumVariables(handle);
+    if (numVars > 0u) {
+        stmtObjsPtr = GetStmtObjs(idataPtr, handle);
+    }
+
+    /*
+     * A list variable, and a variable used more than once, appear
+     * once. The key objects were created by BindVariables().
+     */
+
+    keysObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < numVars; i++) {
+        Tcl_Obj *keyObj = stmtObjsPtr->keyObjs[i];
+
+        if (keyObj == NULL) {
+            continue;
+        }
+        Tcl_ListObjGetElements(NULL, keysObj, &numKeys, &keyObjv);
+        for (k = 0; k < numKeys; k++) {
+            if (STREQ(Tcl_GetString(keyObjv[k]), Tcl_GetString(keyObj))) {
+                break;
+            }
+        }
+        if (k == numKeys) {
+            Tcl_ListObjAppendElement(NULL, keysObj, keyObj);
+        }
+    }
+
+    if (idataPtr->fragmentKeysTable.numEntries >= MAX_STMT_OBJS) {
+        FlushFragmentKeys(idataPtr);
+    }
+    hPtr = Tcl_CreateHashEntry(&idataPtr->fragmentKeysTable, Tcl_GetString(queryObj), &new);
+    if (!new) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(hPtr));
+    }
+    Tcl_IncrRefCount(keysObj);
+    Tcl_SetHashValue(hPtr, keysObj);
+}
+
+static void
+FlushFragmentKeys(InterpData *idataPtr)
+{
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+
+    hPtr = Tcl_FirstHashEntry(&idataPtr->fragmentKeysTable, &search);
+    while (hPtr != NULL) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(hPtr));
+        Tcl_DeleteHashEntry(hPtr);
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FragmentBindValues --
+ *
+ *      Append the bind keys and values of a query to the fragment
+ *      cache key in dsPtr. The values of an ns_set are appended in
+ *      full.
+ *
+ * Results:
+ *      NS_TRUE if the key is complete. NS_FALSE if the bind keys of
+ *      the query are not yet known in this interp, or a value is
+ *      missing and the query would fail: the query must be run.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+FragmentBindValues(InterpData *idataPtr, Tcl_Obj *queryObj, Tcl_Obj *valuesObj,
+                   int autoNull, Tcl_DString *dsPtr)
+{
+    Tcl_Interp          *interp = idataPtr->interp;
+    const Tcl_HashEntry *hPtr;
+    const char          *query = Tcl_GetString(queryObj);
+    Tcl_Obj            **keyObjv, *valueObj;
+    BindSource           src;
+    TCL_SIZE_T           numKeys, k;
+    size_t               i;
+
+    /*
+     * A query without a colon has no bind variables.
+     */
+
+    if (strchr(query, ':') == NULL) {
+        return NS_TRUE;
+    }
+    hPtr = Tcl_FindHashEntry(&idataPtr->fragmentKeysTable, query);
+    if (hPtr == NULL) {
+        return NS_FALSE;
+    }
+    Tcl_ListObjGetElements(NULL, Tcl_GetHashValue(hPtr), &numKeys, &keyObjv);
+    if (numKeys == 0) {
+        return NS_TRUE;
+    }
+
+    /*
+     * Errors are reported when the query is run.
+     */
+
+    if (GetBindSource(interp, valuesObj, &src) != TCL_OK) {
+        Tcl_ResetResult(interp);
+        return NS_FALSE;
+    }
+    if (src.set != NULL) {
+        for (i = 0u; i < Ns_SetSize(src.set); i++) {
+            const char *value = Ns_SetValue(src.set, i);
+
+            Tcl_DStringAppendElement(dsPtr, Ns_SetKey(src.set, i));
+            Tcl_DStringAppendElement(dsPtr, value != NULL ? value : "");
+        }
+        return NS_TRUE;
+    }
+
+    /*
+     * A missing value binds a null, as does the empty string.
+     */
+
+    for (k = 0; k < numKeys; k++) {
+        if (GetBindObj(interp, &src, keyObjv[k], &valueObj) != TCL_OK) {
+            Tcl_ResetResult(interp);
+            return NS_FALSE;
+        }
+        if (valueObj == NULL && !autoNull) {
+            return NS_FALSE;
+        }
+        Tcl_DStringAppendElement(dsPtr, Tcl_GetString(keyObjv[k]));
+        Tcl_DStringAppendElement(dsPtr, valueObj != NULL ? Tcl_GetString(valueObj) : "");
+    }
+
+    return NS_TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ColumnNames --
+ *
+ *      The names of the result columns of the current statement as
+ *      a list, created once per statement and interp.
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR. *colListObjPtr is owned by the cache:
+ *      callers which keep it beyond the current command must take a
+ *      reference.
+ *
+ * Side effects:
+ *      Error message may be left in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ColumnNames(InterpData *idataPtr, Dbi_Handle *handle, Tcl_Obj **colListObjPtr)
+{
+    StmtObjs     *stmtObjsPtr = GetStmtObjs(idataPtr, handle);
+    Tcl_Obj      *colListObj;
+    const char   *colName;
+    unsigned int  colIdx, numCols;
+
+    if (stmtObjsPtr->colListObj == NULL) {
+        numCols = Dbi_NumColumns(handle);
+        colListObj = Tcl_NewListObj(0, NULL);
+
+        for (colIdx = 0; colIdx < numCols; colIdx++) {
+            if (Dbi_ColumnName(handle, colIdx, &colName) != NS_OK) {
+                Dbi_TclErrorResult(idataPtr->interp, handle);
+                Tcl_DecrRefCount(colListObj);
+                return TCL_ERROR;
+            }
+            Tcl_ListObjAppendElement(NULL, colListObj, Tcl_NewStringObj(colName, -1));
+        }
+        Tcl_IncrRefCount(colListObj);
+        stmtObjsPtr->colListObj = colListObj;
+    }
+    *colListObjPtr = stmtObjsPtr->colListObj;
+
+    return TCL_OK;
 }
 
 
@@ -371,6 +789,10 @@ GetHandle(InterpData *idataPtr, Dbi_Pool *pool, Ns_Time *timeoutPtr)
         Tcl_SetErrorCode(interp, "NS_TIMEOUT", (char *)0L);
         Tcl_SetObjResult(interp, Tcl_NewStringObj("wait for database handle timed out", -1));
         break;
+    case DBI_UNAVAILABLE:
+        Tcl_SetErrorCode(interp, "DBI_UNAVAILABLE", (char *)0L);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("database unavailable", -1));
+        break;
     default:
         Tcl_SetObjResult(interp, Tcl_NewStringObj("handle allocation failed", -1));
         break;
@@ -424,6 +846,9 @@ PutHandle(InterpData *idataPtr, Dbi_Handle *handle)
  *
  *      Test for the existence of an array with a given name.
  *
+ *      The implementation of "array exists" is called directly rather
+ *      than evaluated as a script.
+ *
  * Results:
  *      Boolean value indicating existence
  *
@@ -435,22 +860,31 @@ PutHandle(InterpData *idataPtr, Dbi_Handle *handle)
 
 static int
 ArrayExists(Tcl_Interp *interp, Tcl_Obj *arrayNameObj) {
-    static Tcl_Obj *arrayObj = NULL, *existsObj = NULL;
-    Tcl_Obj *oldResultObj, *objv[3];
-    int arrayExists = 0;
-
-    if (arrayObj == NULL) {
-        arrayObj  = Tcl_NewStringObj("array", 5);
-        existsObj = Tcl_NewStringObj("exists", 6);
-    }
-    objv[0] = arrayObj;
-    objv[1] = existsObj;
-    objv[2] = arrayNameObj;
+    Tcl_CmdInfo  info;
+    Tcl_Obj     *oldResultObj, *objv[3];
+    int          arrayExists = 0, status;
 
     oldResultObj = Tcl_GetObjResult(interp);
     Tcl_IncrRefCount(oldResultObj);
 
-    if (Tcl_EvalObjv(interp, 3, objv, 0) == TCL_OK) {
+    if (Tcl_GetCommandInfo(interp, "::tcl::array::exists", &info)
+        && info.isNativeObjectProc && info.objProc != NULL) {
+        objv[0] = Tcl_NewStringObj("exists", 6);
+        objv[1] = arrayNameObj;
+        Tcl_IncrRefCount(objv[0]);
+        status = (*info.objProc)(info.objClientData, interp, 2, objv);
+        Tcl_DecrRefCount(objv[0]);
+    } else {
+        objv[0] = Tcl_NewStringObj("array", 5);
+        objv[1] = Tcl_NewStringObj("exists", 6);
+        objv[2] = arrayNameObj;
+        Tcl_IncrRefCount(objv[0]);
+        Tcl_IncrRefCount(objv[1]);
+        status = Tcl_EvalObjv(interp, 3, objv, 0);
+        Tcl_DecrRefCount(objv[0]);
+        Tcl_DecrRefCount(objv[1]);
+    }
+    if (status == TCL_OK) {
         Tcl_GetIntFromObj(interp, Tcl_GetObjResult(interp), &arrayExists);
     }
 
@@ -460,14 +894,15 @@ ArrayExists(Tcl_Interp *interp, Tcl_Obj *arrayNameObj) {
     return arrayExists;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * Dbi_TclBindVariables --
+ * GetBindSource --
  *
- *      Bind values to the variables of a statement, looking at the keys
- *      of the array or set if given, or local variables otherwise.
+ *      Find where bind values come from: an ns_set or array named by
+ *      tclValues, a dict given as tclValues, or local variables if
+ *      tclValues is NULL.
  *
  * Results:
  *      TCL_OK or TCL_ERROR.
@@ -478,25 +913,13 @@ ArrayExists(Tcl_Interp *interp, Tcl_Obj *arrayNameObj) {
  *----------------------------------------------------------------------
  */
 
-int
-Dbi_TclBindVariables(Tcl_Interp *interp, Dbi_Handle *handle,
-                     Dbi_Value *dbValues, Tcl_Obj *tclValues,
-                     int autoNull)
+static int
+GetBindSource(Tcl_Interp *interp, Tcl_Obj *tclValues, BindSource *srcPtr)
 {
-    Ns_Set         *set;
-    Tcl_Obj        *valueObj, *dictObj = NULL;
-    const char     *key;
-    char           *name;
-    unsigned int    numVars, i;
-    TCL_SIZE_T      length = 0;
-
-    numVars = Dbi_NumVariables(handle);
-    if (numVars == 0) {
-        return TCL_OK;
-    }
-
-    set = NULL;
-    name = NULL;
+    srcPtr->set = NULL;
+    srcPtr->arrayObj = NULL;
+    srcPtr->dictObj = NULL;
+    srcPtr->arrayChecked = 0;
 
     if (tclValues != NULL) {
         TCL_SIZE_T valuesLength = 0;
@@ -510,24 +933,24 @@ Dbi_TclBindVariables(Tcl_Interp *interp, Dbi_Handle *handle,
         Tcl_ListObjLength(interp, tclValues, &valuesLength);
 
         if (valuesLength == 1) {
-            name = Tcl_GetString(tclValues);
+            const char *name = Tcl_GetString(tclValues);
 
             if ((name[0] == 'd' || name[0] == 't')
                 && name[1] != '\0'
                 && isdigit(UCHAR(name[1]))
-                && Ns_TclGetSet2(interp, name, &set) != TCL_OK
+                && Ns_TclGetSet2(interp, name, &srcPtr->set) != TCL_OK
                 ) {
                 return TCL_ERROR;
             }
 
             /*
-             * If set == NULL then it must be an array or an error.
+             * If set == NULL then it must be an array or an error. The
+             * array is checked for only when a value is missing. See:
+             * GetBindObj().
              */
 
-            if (set == NULL && !ArrayExists(interp, tclValues)) {
-                Ns_TclPrintfResult(interp, "dbi: array \"%s\" with bind values does not exist",
-                                   name);
-                return TCL_ERROR;
+            if (srcPtr->set == NULL) {
+                srcPtr->arrayObj = tclValues;
             }
 
         } else {
@@ -541,48 +964,303 @@ Dbi_TclBindVariables(Tcl_Interp *interp, Dbi_Handle *handle,
                 return TCL_ERROR;
             }
 
-            dictObj = tclValues;
+            srcPtr->dictObj = tclValues;
+        }
+    }
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetBindObj --
+ *
+ *      Look up the value of a bind variable in a dict, array or local
+ *      variable. Not for ns_set sources.
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR. *valueObjPtr is NULL if there is no value.
+ *      It is an error if a named array does not exist.
+ *
+ * Side effects:
+ *      Error message may be left in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+GetBindObj(Tcl_Interp *interp, BindSource *srcPtr, Tcl_Obj *keyObj,
+           Tcl_Obj **valueObjPtr)
+{
+    if (srcPtr->dictObj != NULL) {
+        return Tcl_DictObjGet(interp, srcPtr->dictObj, keyObj, valueObjPtr);
+    }
+
+    /*
+     * NB: handle both array and variable lookup here.
+     */
+
+    if (srcPtr->arrayObj != NULL) {
+        *valueObjPtr = Tcl_ObjGetVar2(interp, srcPtr->arrayObj, keyObj, 0);
+
+        if (*valueObjPtr == NULL && !srcPtr->arrayChecked) {
+            if (!ArrayExists(interp, srcPtr->arrayObj)) {
+                Ns_TclPrintfResult(interp, "dbi: array \"%s\" with bind values does not exist",
+                                   Tcl_GetString(srcPtr->arrayObj));
+                return TCL_ERROR;
+            }
+            srcPtr->arrayChecked = 1;
+        }
+    } else {
+        *valueObjPtr = Tcl_ObjGetVar2(interp, keyObj, NULL, 0);
+    }
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ListLength --
+ *
+ *      Dbi_ListLengthProc: the number of elements in the Tcl list
+ *      bound to :name[]. A missing value counts as an empty list.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      Error message may be left in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ListLength(ClientData arg, const char *name, TCL_SIZE_T nameLength,
+           TCL_SIZE_T *lengthPtr)
+{
+    ListLengthCtx *ctxPtr = arg;
+    Tcl_Interp    *interp = ctxPtr->interp;
+    Tcl_Obj       *keyObj, *valueObj;
+    int            status;
+
+    if (!ctxPtr->initialized) {
+        if (GetBindSource(interp, ctxPtr->valuesObj, &ctxPtr->src) != TCL_OK) {
+            return NS_ERROR;
+        }
+        ctxPtr->initialized = 1;
+    }
+    if (ctxPtr->src.set != NULL) {
+        Ns_TclPrintfResult(interp, "dbi: list bind variable \"%.*s[]\" "
+                           "cannot be bound from an ns set",
+                           (int) nameLength, name);
+        return NS_ERROR;
+    }
+
+    keyObj = Tcl_NewStringObj(name, nameLength);
+    Tcl_IncrRefCount(keyObj);
+    status = GetBindObj(interp, &ctxPtr->src, keyObj, &valueObj);
+    Tcl_DecrRefCount(keyObj);
+
+    *lengthPtr = 0;
+    if (status != TCL_OK
+        || (valueObj != NULL
+            && Tcl_ListObjLength(interp, valueObj, lengthPtr) != TCL_OK)) {
+        return NS_ERROR;
+    }
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetNativeValue --
+ *
+ *      Record the native value of a Tcl integer, double, boolean or
+ *      ns_time so that drivers may bind it without parsing the string.
+ *
+ *      Only the existing internal rep is looked at: strings are not
+ *      converted to numbers.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      valuePtr->type and valuePtr->v may be updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SetNativeValue(Tcl_Obj *valueObj, Dbi_Value *valuePtr)
+{
+    const Tcl_ObjType *typePtr = valueObj->typePtr;
+
+    if (typePtr == NULL) {
+        return;
+    }
+    if (typePtr == intTypePtr
+        || (typePtr == wideIntTypePtr && wideIntTypePtr != NULL)) {
+        Tcl_WideInt w;
+
+        if (Tcl_GetWideIntFromObj(NULL, valueObj, &w) == TCL_OK) {
+            if (w >= INT_MIN && w <= INT_MAX) {
+                valuePtr->type = DBI_VALUE_INT;
+                valuePtr->v.i = (int) w;
+            } else {
+                valuePtr->type = DBI_VALUE_WIDE;
+                valuePtr->v.w = w;
+            }
+        }
+    } else if (typePtr == doubleTypePtr && doubleTypePtr != NULL) {
+        double d;
+
+        if (Tcl_GetDoubleFromObj(NULL, valueObj, &d) == TCL_OK) {
+            valuePtr->type = DBI_VALUE_DOUBLE;
+            valuePtr->v.d = d;
+        }
+    } else if (typePtr == booleanTypePtr && booleanTypePtr != NULL) {
+        int b;
+
+        if (Tcl_GetBooleanFromObj(NULL, valueObj, &b) == TCL_OK) {
+            valuePtr->type = DBI_VALUE_BOOL;
+            valuePtr->v.i = b;
         }
+    } else if (typePtr == timeTypePtr && timeTypePtr != NULL) {
+        if (Ns_TclGetTimeFromObj(NULL, valueObj, &valuePtr->v.t) == TCL_OK) {
+            valuePtr->type = DBI_VALUE_TIMESTAMP;
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Dbi_TclBindVariables --
+ *
+ *      Bind values to the variables of a statement, looking at the keys
+ *      of the array or set if given, or local variables otherwise.
+ *
+ *      The occurrences of an expanded list variable, :name[], are
+ *      bound to the elements of the list in name, padded with the
+ *      last element. A native list is bound as a whole. See:
+ *      Dbi_VariableKey().
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR.
+ *
+ * Side effects:
+ *      Error message may be left in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+Dbi_TclBindVariables(Tcl_Interp *interp, Dbi_Handle *handle,
+                     Dbi_Value *dbValues, Tcl_Obj *tclValues,
+                     int autoNull)
+{
+    return BindVariables(GetInterpData(interp), handle,
+                         dbValues, tclValues, autoNull);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BindVariables --
+ *
+ *      Implements Dbi_TclBindVariables with the lookup keys cached
+ *      for the statement in the interp. See: GetStmtObjs().
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR.
+ *
+ * Side effects:
+ *      Error message may be left in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BindVariables(InterpData *idataPtr, Dbi_Handle *handle,
+              Dbi_Value *dbValues, Tcl_Obj *tclValues, int autoNull)
+{
+    Tcl_Interp     *interp = idataPtr->interp;
+    StmtObjs       *stmtObjsPtr;
+    BindSource      src;
+    Tcl_Obj        *keyObj, *valueObj;
+    const char     *key;
+    unsigned int    numVars, i;
+    TCL_SIZE_T      length = 0, keyLength, element, bucket;
+
+    numVars = Dbi_NumVariables(handle);
+    if (numVars == 0) {
+        return TCL_OK;
+    }
+    stmtObjsPtr = GetStmtObjs(idataPtr, handle);
+
+    if (GetBindSource(interp, tclValues, &src) != TCL_OK) {
+        return TCL_ERROR;
     }
 
     for (i = 0; i < numVars; i++) {
-        int         binary = 0;
+        int         binary = 0, isEmptyList = 0;
         const char *data;
 
-        if (Dbi_VariableName(handle, i, &key) != NS_OK) {
+        dbValues[i].type = DBI_VALUE_STRING;
+
+        if (Dbi_VariableName(handle, i, &key) != NS_OK
+            || Dbi_VariableKey(handle, i, &keyLength, &element) != NS_OK) {
             Dbi_TclErrorResult(interp, handle);
             return TCL_ERROR;
         }
+        if ((keyObj = stmtObjsPtr->keyObjs[i]) == NULL) {
+            keyObj = Tcl_NewStringObj(key, keyLength);
+            Tcl_IncrRefCount(keyObj);
+            stmtObjsPtr->keyObjs[i] = keyObj;
+        }
 
         data = NULL;
 
-        if (set != NULL) {
-            if ((data = Ns_SetGet(set, key)) != NULL) {
+        if (src.set != NULL) {
+            if ((data = Ns_SetGet(src.set, key)) != NULL) {
                 length = (TCL_SIZE_T)strlen(data);
             }
 
         } else {
             /*
-             * Set the valueObj either from the dict or from local variables
+             * Set the valueObj either from the dict or from local
+             * variables, using the key object cached for the statement.
              */
-            if (dictObj != NULL) {
-                Tcl_Obj *keyObj = Tcl_NewStringObj(key, -1);
 
-                if (Tcl_DictObjGet(interp, dictObj, keyObj, &valueObj) != TCL_OK) {
-                    Tcl_DecrRefCount(keyObj);
+            if (GetBindObj(interp, &src, keyObj, &valueObj) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (valueObj != NULL && element >= 0) {
+                Tcl_Obj    **elemv;
+                TCL_SIZE_T   elemc;
+
+                if (Tcl_ListObjGetElements(interp, valueObj,
+                                           &elemc, &elemv) != TCL_OK) {
                     return TCL_ERROR;
                 }
-                Tcl_DecrRefCount(keyObj);
-
-            } else {
-                /*
-                 * NB: handle both array and variable lookup here.
-                 */
-
-                valueObj = Tcl_GetVar2Ex(interp,
-                                         name ? name : key,
-                                         name ? key : NULL,
-                                         0 /*TCL_LEAVE_ERR_MSG*/);
+                if (elemc == 0) {
+                    valueObj = NULL;
+                    isEmptyList = 1;
+                } else {
+                    for (bucket = 1; bucket < elemc; bucket <<= 1) {
+                        ;
+                    }
+                    element %= bucket;
+                    valueObj = elemv[element < elemc ? element : elemc - 1];
+                }
             }
 
             if (valueObj != NULL) {
@@ -591,20 +1269,21 @@ Dbi_TclBindVariables(Tcl_Interp *interp, Dbi_Handle *handle,
                     binary = 1;
                 } else {
                     data = Tcl_GetStringFromObj(valueObj, &length);
+                    SetNativeValue(valueObj, &dbValues[i]);
                 }
             }
         }
         if (data == NULL) {
             length = 0;
 
-            if (!autoNull) {
+            if (!autoNull && !isEmptyList) {
                 const char *source;
 
-                if (set != NULL) {
+                if (src.set != NULL) {
                     source = "in ns set";
-                } else if (dictObj != NULL) {
+                } else if (src.dictObj != NULL) {
                     source = "in dict";
-                } else if (name != NULL) {
+                } else if (src.arrayObj != NULL) {
                     source = "in array";
                 } else {
                     source = "as local variable";
@@ -618,12 +1297,15 @@ Dbi_TclBindVariables(Tcl_Interp *interp, Dbi_Handle *handle,
         dbValues[i].data = length ? data : NULL; /* Coerce the empty string to null. */
         dbValues[i].length = (size_t)length;
         dbValues[i].binary = binary;
+        if (dbValues[i].data == NULL) {
+            dbValues[i].type = DBI_VALUE_STRING;
+        }
     }
 
     return TCL_OK;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
@@ -672,8 +1354,18 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
     Tcl_Obj      *resObj, *valueObj, *colListObj = NULL, *queryObj, **colV = NULL, **templateV = NULL;
     Tcl_Obj      *poolObj = NULL, *valuesObj = NULL, *colsNameObj = NULL, *rowObj = NULL;
     Tcl_Obj      *templateObj = NULL, *defaultObj = NULL;
-    Ns_Time      *timeoutPtr = NULL;
-    int           end, status, maxRows = -1, adp = 0, autoNull = 0;
+    Tcl_Obj      *groupObj = NULL, *headerObj = NULL, *footerObj = NULL;
+    Tcl_Obj      *fragmentObj = NULL, *tagsObj = NULL;
+    Ns_Time      *timeoutPtr = NULL, *ttlPtr = NULL;
+    Dbi_Pool     *pool = NULL;
+    Tcl_DString   fragmentKey, fragment;
+    const char  **tags = NULL;
+    int           end, status, maxRows = -1, adp = 0, autoNull = 0, quoteAll = 0;
+    int           parallel = 1, haveKey = 0, retry = 0;
+    TCL_SIZE_T    numTags = 0, shapeLength = 0;
+    char         *delimiter = ",";
+    unsigned int  colIdx, numCols = 0;
+    TCL_SIZE_T    numRows = 0;
     Dbi_quotingLevel quote = Dbi_QuoteNone;
     Dbi_resultFormat resultFormat = Dbi_ResultFlatList;
 
@@ -687,6 +1379,16 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
         {"-result",    Ns_ObjvIndex,  &resultFormat,  resultFormatStrings},
         {"-append",    Ns_ObjvBool,   &adp,           (void *) NS_TRUE},
         {"-quote",     Ns_ObjvIndex,  &quote,         quotingTypeStrings},
+        {"-delimiter", Ns_ObjvString, &delimiter,     NULL},
+        {"-quoteall",  Ns_ObjvBool,   &quoteAll,      (void *) NS_TRUE},
+        {"-groupby",   Ns_ObjvObj,    &groupObj,      NULL},
+        {"-header",    Ns_ObjvObj,    &headerObj,     NULL},
+        {"-footer",    Ns_ObjvObj,    &footerObj,     NULL},
+        {"-parallel",  Ns_ObjvInt,    &parallel,      NULL},
+        {"-fragmentcache", Ns_ObjvObj, &fragmentObj,  NULL},
+        {"-ttl",       Ns_ObjvTime,   &ttlPtr,        NULL},
+        {"-tags",      Ns_ObjvObj,    &tagsObj,       NULL},
+        {"-retry",     Ns_ObjvBool,   &retry,         (void *) NS_TRUE},
         {"--",         Ns_ObjvBreak,  NULL,           NULL},
         {NULL, NULL, NULL, NULL}
     };
@@ -700,9 +1402,45 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
         return TCL_ERROR;
     }
 
-    if (templateObj == NULL && quote != Dbi_QuoteNone) {
+    if (templateObj == NULL && quote != Dbi_QuoteNone) {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewStringObj("dbi: '-quote' is only allowed when template is given", -1));
+        return TCL_ERROR;
+    }
+
+    if (templateObj == NULL && groupObj != NULL) {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewStringObj("dbi: '-groupby' is only allowed when template is given", -1));
+        return TCL_ERROR;
+    }
+
+    if (groupObj == NULL && (headerObj != NULL || footerObj != NULL)) {
         Tcl_SetObjResult(interp,
-                         Tcl_NewStringObj("dbi: '-quote' is only allowed when template is given", -1));
+                         Tcl_NewStringObj("dbi: '-header' and '-footer' are only allowed with '-groupby'", -1));
+        return TCL_ERROR;
+    }
+
+    if (templateObj == NULL && fragmentObj != NULL) {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewStringObj("dbi: '-fragmentcache' is only allowed when template is given", -1));
+        return TCL_ERROR;
+    }
+
+    if (fragmentObj == NULL && (ttlPtr != NULL || tagsObj != NULL)) {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewStringObj("dbi: '-ttl' and '-tags' are only allowed with '-fragmentcache'", -1));
+        return TCL_ERROR;
+    }
+
+    if (parallel < 1 || parallel > MAX_PARALLEL) {
+        Ns_TclPrintfResult(interp, "dbi: '-parallel' must be between 1 and %d", MAX_PARALLEL);
+        return TCL_ERROR;
+    }
+
+    if (strlen(delimiter) != 1 || *delimiter == '"'
+        || *delimiter == '\n' || *delimiter == '\r') {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewStringObj("dbi: '-delimiter' must be a single character other than a quote or line break", -1));
         return TCL_ERROR;
     }
 
@@ -713,25 +1451,126 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
         return TCL_ERROR;
     }
 
+    /*
+     * Within dbi_eval the query may see the uncommitted changes of
+     * the transaction, so its output is neither replayed from nor
+     * kept in the fragment cache.
+     */
+
+    if (idataPtr->depth != -1) {
+        fragmentObj = NULL;
+    }
+
+    /*
+     * Replay the output of a template from the fragment cache of the
+     * pool without taking a handle. The cache key is made of the
+     * user's key, everything which shapes the output, the values of
+     * Tcl variables in the templates and the bind values of the
+     * query.
+     */
+
+    Tcl_DStringInit(&fragmentKey);
+    Tcl_DStringInit(&fragment);
+
+    if (fragmentObj != NULL) {
+        Tcl_Obj *shapeObjs[7];
+        char     buf[TCL_INTEGER_SPACE * 2 + 2];
+        size_t   i;
+
+        if ((pool = GetPool(idataPtr, poolObj)) == NULL
+            || (tagsObj != NULL
+                && Tcl_SplitList(interp, Tcl_GetString(tagsObj), &numTags, &tags) != TCL_OK)) {
+            status = TCL_ERROR;
+            goto release;
+        }
+        shapeObjs[0] = fragmentObj;
+        shapeObjs[1] = queryObj;
+        shapeObjs[2] = templateObj;
+        shapeObjs[3] = defaultObj;
+        shapeObjs[4] = groupObj;
+        shapeObjs[5] = headerObj;
+        shapeObjs[6] = footerObj;
+        for (i = 0u; i < sizeof(shapeObjs) / sizeof(shapeObjs[0]); i++) {
+            Tcl_DStringAppendElement(&fragmentKey,
+                                     shapeObjs[i] != NULL ? Tcl_GetString(shapeObjs[i]) : "");
+        }
+        snprintf(buf, sizeof(buf), "%d %d", (int) quote, maxRows);
+        Tcl_DStringAppendElement(&fragmentKey, buf);
+        if (DbiTemplateVariables(interp, templateObj, &fragmentKey) != TCL_OK
+            || (headerObj != NULL
+                && DbiTemplateVariables(interp, headerObj, &fragmentKey) != TCL_OK)
+            || (footerObj != NULL
+                && DbiTemplateVariables(interp, footerObj, &fragmentKey) != TCL_OK)) {
+            status = TCL_ERROR;
+            goto release;
+        }
+        shapeLength = Tcl_DStringLength(&fragmentKey);
+
+        haveKey = FragmentBindValues(idataPtr, queryObj, valuesObj, autoNull, &fragmentKey);
+        if (haveKey && Dbi_FragmentGet(pool, fragmentKey.string, &fragment) == NS_OK) {
+            goto replay;
+        }
+    }
+
     /*
      * Get a handle, prepare, bind, and run the query.
      */
 
-    if (Exec(idataPtr, poolObj, timeoutPtr, queryObj, valuesObj, maxRows, 0, autoNull,
-             &handle) != TCL_OK) {
-        return TCL_ERROR;
+    if (Exec(idataPtr, poolObj, timeoutPtr, queryObj, valuesObj, maxRows, 0, retry,
+             autoNull, &handle) != TCL_OK) {
+        status = TCL_ERROR;
+        goto release;
     }
 
     /*
      * Successful result is a flat list of all values (or an empty list)
      */
-    if (templateObj != NULL) {
+    if (fragmentObj != NULL) {
+
+        /*
+         * The first run of a query in this interp tells which bind
+         * values belong in the key. Output may have been cached by
+         * another interp meanwhile.
+         */
+
+        if (!haveKey) {
+            SetFragmentKeys(idataPtr, queryObj, handle);
+            Tcl_DStringSetLength(&fragmentKey, shapeLength);
+            haveKey = FragmentBindValues(idataPtr, queryObj, valuesObj, autoNull, &fragmentKey);
+            if (haveKey && Dbi_FragmentGet(pool, fragmentKey.string, &fragment) == NS_OK) {
+                PutHandle(idataPtr, handle);
+                goto replay;
+            }
+        }
+
+        /*
+         * Render into the result, whether or not for the ADP output,
+         * and keep a copy in the cache.
+         */
+
+        status = DbiTclSubstTemplate(interp, handle,
+                                     templateObj, defaultObj, 0, quote,
+                                     groupObj, headerObj, footerObj, parallel);
+        if (status == TCL_OK) {
+            TCL_SIZE_T  length;
+            const char *data = Tcl_GetStringFromObj(Tcl_GetObjResult(interp), &length);
+
+            if (haveKey) {
+                Dbi_FragmentSet(pool, fragmentKey.string, data, length,
+                                ttlPtr, numTags, tags);
+            }
+            if (adp) {
+                Tcl_DStringAppend(&fragment, data, length);
+                Tcl_ResetResult(interp);
+                status = Ns_AdpAppend(interp, fragment.string, fragment.length);
+            }
+        }
+    } else if (templateObj != NULL) {
         status = DbiTclSubstTemplate(interp, handle,
-                                     templateObj, defaultObj, adp, quote);
+                                     templateObj, defaultObj, adp, quote,
+                                     groupObj, headerObj, footerObj, parallel);
     } else {
         long rowNum = 0;
-        const char   *colName;
-        unsigned int  colIdx, numCols;
 
         numCols = Dbi_NumColumns(handle);
 
@@ -741,25 +1580,20 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
          */
 
         if (colsNameObj != NULL
-            || (resultFormat != Dbi_ResultFlatList && resultFormat != Dbi_ResultLists )) {
+            || (resultFormat != Dbi_ResultFlatList && resultFormat != Dbi_ResultLists
+                && resultFormat != Dbi_ResultJson && resultFormat != Dbi_ResultJsonArrays
+                && resultFormat != Dbi_ResultCsv)) {
             TCL_SIZE_T nrElements;
 
+            /*
+             * The list of names is cached per statement. Hold a
+             * reference while colV is in use.
+             */
 
-            colListObj = Tcl_NewListObj((int)numCols, NULL);
-
-            for (colIdx = 0; colIdx < numCols; colIdx++) {
-
-                if (Dbi_ColumnName(handle, colIdx, &colName) != NS_OK) {
-                    Dbi_TclErrorResult(interp, handle);
-                    goto error;
-                }
-                valueObj = Tcl_NewStringObj(colName, -1);
-                if (Tcl_ListObjAppendElement(interp, colListObj, valueObj) != TCL_OK) {
-                    Tcl_DecrRefCount(valueObj);
-                    goto error;
-                }
-
+            if (ColumnNames(idataPtr, handle, &colListObj) != TCL_OK) {
+                goto error;
             }
+            Tcl_IncrRefCount(colListObj);
 
             if (colsNameObj != NULL) {
                 if (Tcl_ObjSetVar2(interp, colsNameObj, NULL,
@@ -773,15 +1607,73 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
             }
         }
 
+        /*
+         * JSON and CSV are serialised straight from the column values
+         * into the result or the ADP output buffer.
+         */
+
+        if (resultFormat == Dbi_ResultJson || resultFormat == Dbi_ResultJsonArrays) {
+            status = DbiTclSubstJson(interp, handle,
+                                     resultFormat == Dbi_ResultJsonArrays, adp);
+            goto done;
+        } else if (resultFormat == Dbi_ResultCsv) {
+            status = DbiTclSubstCsv(interp, handle, *delimiter, quoteAll, adp);
+            goto done;
+        }
+
         status = TCL_OK;
 
-        if (resultFormat == Dbi_ResultAvLists) {
+        /*
+         * Rows of lists, dicts and avlists are collected in templateV
+         * and created in one go. Dict rows are built as key value lists
+         * which convert to dicts on first use.
+         */
+
+        /*
+         * Presize result lists if the driver knows how many rows
+         * there are. Flat lists and column lists hold numCols
+         * elements per row.
+         */
+
+        numRows = PresizeRows(handle, maxRows,
+                              (resultFormat == Dbi_ResultFlatList
+                               || resultFormat == Dbi_ResultColumns)
+                              ? numCols : 1u);
+
+        if (resultFormat == Dbi_ResultAvLists || resultFormat == Dbi_ResultDicts) {
+            templateV = ns_calloc(numCols * 2, sizeof(Tcl_Obj*));
+            for (colIdx = 0; colIdx < numCols; colIdx++) {
+                templateV[colIdx * 2] = colV[colIdx];
+            }
+        } else if (resultFormat == Dbi_ResultLists) {
+            templateV = ns_calloc(numCols, sizeof(Tcl_Obj*));
+        } else if (resultFormat == Dbi_ResultColumns) {
+
+            /*
+             * One value list per column, filled in a single pass over
+             * the rows. The lists are owned by templateV until the
+             * result is built.
+             */
+
             templateV = ns_calloc(numCols * 2, sizeof(Tcl_Obj*));
             for (colIdx = 0; colIdx < numCols; colIdx++) {
                 templateV[colIdx * 2] = colV[colIdx];
+                templateV[colIdx * 2 + 1] = Tcl_NewListObj(numRows, NULL);
+                Tcl_IncrRefCount(templateV[colIdx * 2 + 1]);
             }
-        } else if (resultFormat == Dbi_ResultDict) {
+        }
+
+        if (resultFormat == Dbi_ResultDict) {
             Tcl_SetObjResult(interp, Tcl_NewDictObj());
+        } else if (numRows > 0
+                   && resultFormat != Dbi_ResultSets
+                   && resultFormat != Dbi_ResultColumns) {
+            TCL_SIZE_T numElements = numRows;
+
+            if (resultFormat == Dbi_ResultFlatList) {
+                numElements *= (TCL_SIZE_T) numCols;
+            }
+            Tcl_SetObjResult(interp, Tcl_NewListObj(numElements, NULL));
         }
         resObj = Tcl_GetObjResult(interp);
 
@@ -795,12 +1687,14 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
             switch (resultFormat) {
             case Dbi_ResultFlatList:
             case Dbi_ResultAvLists:
-                break;
+            case Dbi_ResultDicts:
             case Dbi_ResultLists:
-                rowObj = Tcl_NewListObj((int)numCols, NULL);
+            case Dbi_ResultColumns:
+            case Dbi_ResultJson:
+            case Dbi_ResultJsonArrays:
+            case Dbi_ResultCsv:
                 break;
             case Dbi_ResultDict:
-            case Dbi_ResultDicts:
                 rowObj = Tcl_NewDictObj();
                 break;
             case Dbi_ResultSets:
@@ -813,6 +1707,20 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
              */
             for (colIdx = 0; colIdx < numCols; colIdx++) {
                 if (ColumnValue(interp, handle, colIdx, &valueObj) != TCL_OK) {
+
+                    /*
+                     * The values staged for this row are not yet
+                     * owned by a row list.
+                     */
+
+                    if (resultFormat == Dbi_ResultLists
+                        || resultFormat == Dbi_ResultAvLists
+                        || resultFormat == Dbi_ResultDicts) {
+                        while (colIdx-- > 0) {
+                            Tcl_DecrRefCount(templateV[resultFormat == Dbi_ResultLists
+                                                       ? colIdx : colIdx * 2 + 1]);
+                        }
+                    }
                     goto error;
                 }
 
@@ -822,18 +1730,23 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
                         goto error;
                     }
                 } else if (resultFormat == Dbi_ResultLists) {
-                    if (Tcl_ListObjAppendElement(interp, rowObj, valueObj) != TCL_OK) {
+
+                    templateV[colIdx] = valueObj;
+
+                } else if (resultFormat == Dbi_ResultColumns) {
+                    if (Tcl_ListObjAppendElement(interp, templateV[colIdx*2 + 1],
+                                                 valueObj) != TCL_OK) {
                         Tcl_DecrRefCount(valueObj);
                         goto error;
                     }
                 } else {
                     assert(colV[colIdx] != NULL);
 
-                    if (resultFormat == Dbi_ResultAvLists) {
+                    if (resultFormat == Dbi_ResultAvLists || resultFormat == Dbi_ResultDicts) {
 
                         templateV[colIdx*2 + 1] = valueObj;
 
-                    } else if (resultFormat == Dbi_ResultDicts || resultFormat == Dbi_ResultDict) {
+                    } else if (resultFormat == Dbi_ResultDict) {
 
                         if (Tcl_DictObjPut(interp, rowObj, colV[colIdx], valueObj) != TCL_OK) {
                             Tcl_DecrRefCount(valueObj);
@@ -853,7 +1766,12 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
              */
 
             switch (resultFormat) {
-            case Dbi_ResultFlatList: break;
+            case Dbi_ResultFlatList:
+            case Dbi_ResultColumns:
+            case Dbi_ResultJson:
+            case Dbi_ResultJsonArrays:
+            case Dbi_ResultCsv:
+                break;
             case Dbi_ResultSets: Ns_TclEnterSet(interp, set, 0); break;
             case Dbi_ResultDict:
                 {
@@ -862,38 +1780,57 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
                         Tcl_DecrRefCount(idxObj);
                         goto error;
                     }
+                    rowObj = NULL;
                 }
                 break;
             case Dbi_ResultAvLists:
-                rowObj = Tcl_NewListObj((int)numCols * 2, templateV);
+            case Dbi_ResultDicts:
+                rowObj = Tcl_NewListObj((TCL_SIZE_T)numCols * 2, templateV);
                 if (Tcl_ListObjAppendElement(interp, resObj, rowObj) != TCL_OK) {
-                    Tcl_DecrRefCount(rowObj);
                     goto error;
                 }
+                rowObj = NULL;
                 break;
             case Dbi_ResultLists:
-            case Dbi_ResultDicts:
+                rowObj = Tcl_NewListObj((TCL_SIZE_T)numCols, templateV);
                 if (Tcl_ListObjAppendElement(interp, resObj, rowObj) != TCL_OK) {
-                    Tcl_DecrRefCount(rowObj);
                     goto error;
                 }
+                rowObj = NULL;
                 break;
             }
 
         }
+
+        /*
+         * The column vectors are complete: the result is a dict of
+         * column names to value lists.
+         */
+
+        if (status == TCL_OK && resultFormat == Dbi_ResultColumns) {
+            Tcl_SetObjResult(interp, Tcl_NewListObj((TCL_SIZE_T)numCols * 2, templateV));
+        }
     }
 
 
  done:
     PutHandle(idataPtr, handle);
 
-    if (colListObj != NULL && colsNameObj == NULL) {
-        /*
-         * We have the object just for the names in the result
-         */
+ release:
+    Tcl_DStringFree(&fragmentKey);
+    Tcl_DStringFree(&fragment);
+    if (tags != NULL) {
+        Tcl_Free((char *) tags);
+    }
+    if (colListObj != NULL) {
         Tcl_DecrRefCount(colListObj);
     }
     if (templateV != NULL) {
+        if (resultFormat == Dbi_ResultColumns) {
+            for (colIdx = 0; colIdx < numCols; colIdx++) {
+                Tcl_DecrRefCount(templateV[colIdx * 2 + 1]);
+            }
+        }
         ns_free(templateV);
     }
 
@@ -906,6 +1843,15 @@ RowsObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const o
 
     status = TCL_ERROR;
     goto done;
+
+ replay:
+    if (adp) {
+        status = Ns_AdpAppend(interp, fragment.string, fragment.length);
+    } else {
+        Tcl_DStringResult(interp, &fragment);
+        status = TCL_OK;
+    }
+    goto release;
 }
 
 /*
@@ -952,6 +1898,12 @@ ConvertObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc
     if ((Tcl_ListObjGetElements(interp, listObj, &nrElements, &elemV) != TCL_OK)) {
         return TCL_ERROR;
     }
+    if (resultFormat == Dbi_ResultJson || resultFormat == Dbi_ResultJsonArrays
+        || resultFormat == Dbi_ResultCsv) {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewStringObj("dbi: JSON and CSV results are not supported by dbi_convert", -1));
+        return TCL_ERROR;
+    }
     if (nrColumns == 0 || nrColumns > nrElements || nrElements % nrColumns != 0) {
         Tcl_SetObjResult(interp,
                          Tcl_NewStringObj("dbi: number of elements in the list must be a multiple of the columns", -1));
@@ -966,6 +1918,27 @@ ConvertObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc
         for (colNum = 0; colNum < nrColumns; colNum++) {
             templateV[colNum * 2] = colV[colNum];
         }
+    } else if (resultFormat == Dbi_ResultColumns) {
+        TCL_SIZE_T nrRows = nrElements / nrColumns;
+        Tcl_Obj  **columnV;
+
+        /*
+         * Gather each column's values in turn and build its list in
+         * one go.
+         */
+
+        templateV = ns_calloc((size_t)(nrColumns * 2), sizeof(Tcl_Obj*));
+        columnV = ns_malloc((size_t)nrRows * sizeof(Tcl_Obj*));
+        for (colNum = 0; colNum < nrColumns; colNum++) {
+            for (rowNum = 0; rowNum < nrRows; rowNum++) {
+                columnV[rowNum] = elemV[rowNum * nrColumns + colNum];
+            }
+            templateV[colNum * 2] = colV[colNum];
+            templateV[colNum * 2 + 1] = Tcl_NewListObj(nrRows, columnV);
+        }
+        ns_free(columnV);
+        Tcl_SetObjResult(interp, Tcl_NewListObj(nrColumns * 2, templateV));
+        goto done;
     }
 
     for (rowNum = 0; rowNum * nrColumns < nrElements; rowNum ++) {
@@ -1053,7 +2026,12 @@ ConvertObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc
             }
             break;
 
-        case Dbi_ResultFlatList: break;
+        case Dbi_ResultFlatList:
+        case Dbi_ResultColumns:
+        case Dbi_ResultJson:
+        case Dbi_ResultJsonArrays:
+        case Dbi_ResultCsv:
+            break;
         }
 
     }
@@ -1096,8 +2074,8 @@ ForeachObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *cons
     InterpData   *idataPtr = arg;
     Dbi_Handle   *handle;
     unsigned int  colIdx, numCols;
-    const char   *colName;
-    Tcl_Obj      *valueObj, *queryObj, *bodyObj;
+    TCL_SIZE_T    nrElements;
+    Tcl_Obj      *valueObj, *queryObj, *bodyObj, *colListObj = NULL, **colV;
     Tcl_Obj      *poolObj = NULL, *valuesObj = NULL;
     Ns_Time      *timeoutPtr = NULL;
     int           end, status, maxRows = -1, autoNull = 0;
@@ -1124,28 +2102,28 @@ ForeachObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *cons
      * Get a handle, prepare, bind, and run the query.
      */
 
-    if (Exec(idataPtr, poolObj, timeoutPtr, queryObj, valuesObj, maxRows, 0, autoNull,
-             &handle) != TCL_OK) {
+    if (Exec(idataPtr, poolObj, timeoutPtr, queryObj, valuesObj, maxRows, 0, 0,
+             autoNull, &handle) != TCL_OK) {
         return TCL_ERROR;
     }
 
     status = TCL_OK;
     numCols = Dbi_NumColumns(handle);
 
+    if (ColumnNames(idataPtr, handle, &colListObj) != TCL_OK) {
+        colListObj = NULL;
+        goto error;
+    }
+    Tcl_IncrRefCount(colListObj);
+    Tcl_ListObjGetElements(NULL, colListObj, &nrElements, &colV);
+
     while ((status = NextRow(interp, handle, &end)) == TCL_OK && !end) {
 
         for (colIdx = 0; colIdx < numCols; colIdx++) {
             if (ColumnValue(interp, handle, colIdx, &valueObj) != TCL_OK) {
                 goto error;
             }
-
-            if (Dbi_ColumnName(handle, colIdx, &colName) != NS_OK) {
-                Dbi_TclErrorResult(interp, handle);
-                Tcl_DecrRefCount(valueObj);
-                goto error;
-            }
-
-            Tcl_SetVar2Ex(interp, colName, NULL, valueObj, 0);
+            Tcl_ObjSetVar2(interp, colV[colIdx], NULL, valueObj, 0);
         }
 
         status = Tcl_EvalObjEx(interp, bodyObj, 0);
@@ -1162,6 +2140,9 @@ ForeachObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *cons
     }
 
  done:
+    if (colListObj != NULL) {
+        Tcl_DecrRefCount(colListObj);
+    }
     PutHandle(idataPtr, handle);
 
     return status;
@@ -1219,8 +2200,8 @@ DmlObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const ob
      * Get a handle, prepare, bind, and run the query.
      */
 
-    if (Exec(idataPtr, poolObj, timeoutPtr, queryObj, valuesObj, -1, 1, autoNull,
-             &handle) != TCL_OK) {
+    if (Exec(idataPtr, poolObj, timeoutPtr, queryObj, valuesObj, -1, 1, 0,
+             autoNull, &handle) != TCL_OK) {
         return TCL_ERROR;
     }
 
@@ -1290,18 +2271,19 @@ RowCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[
     InterpData   *idataPtr = arg;
     Dbi_Handle   *handle;
     unsigned int  colIdx, numCols;
-    Tcl_Obj      *valueObj, *queryObj;
-    Tcl_Obj      *poolObj = NULL, *valuesObj = NULL;
+    Tcl_Obj      *valueObj, *queryObj, *colListObj, **colV;
+    Tcl_Obj      *poolObj = NULL, *valuesObj = NULL, *arrayObj = NULL;
     Ns_Time      *timeoutPtr = NULL;
-    const char   *column, *varName1, *varName2, *arrayName = NULL;
-    int           found, end, status, autoNull = 0;
+    TCL_SIZE_T    nrElements;
+    int           found, end, status, autoNull = 0, retry = 0;
 
     Ns_ObjvSpec opts[] = {
         {"-db",        Ns_ObjvObj,    &poolObj,    NULL},
         {"-autonull",  Ns_ObjvBool,   &autoNull,   (void *) NS_TRUE},
         {"-timeout",   Ns_ObjvTime,   &timeoutPtr, NULL},
         {"-bind",      Ns_ObjvObj,    &valuesObj,  NULL},
-        {"-array",     Ns_ObjvString, &arrayName,  NULL},
+        {"-array",     Ns_ObjvObj,    &arrayObj,   NULL},
+        {"-retry",     Ns_ObjvBool,   &retry,      (void *) NS_TRUE},
         {"--",         Ns_ObjvBreak,  NULL,        NULL},
         {NULL, NULL, NULL, NULL}
     };
@@ -1317,8 +2299,8 @@ RowCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[
      * Get handle, then prepare, bind, and run the query.
      */
 
-    if (Exec(idataPtr, poolObj, timeoutPtr, queryObj, valuesObj, 1, 0, autoNull,
-             &handle) != TCL_OK) {
+    if (Exec(idataPtr, poolObj, timeoutPtr, queryObj, valuesObj, 1, 0, retry,
+             autoNull, &handle) != TCL_OK) {
         return TCL_ERROR;
     }
 
@@ -1344,27 +2326,27 @@ RowCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[
     found = 1;
     numCols = Dbi_NumColumns(handle);
 
+    if (ColumnNames(idataPtr, handle, &colListObj) != TCL_OK
+        || Tcl_ListObjGetElements(interp, colListObj, &nrElements, &colV) != TCL_OK) {
+        goto cleanup;
+    }
+    Tcl_IncrRefCount(colListObj);
+
     for (colIdx = 0; colIdx < numCols; colIdx++) {
         if (ColumnValue(interp, handle, colIdx, &valueObj) != TCL_OK) {
+            Tcl_DecrRefCount(colListObj);
             goto cleanup;
         }
-        if (Dbi_ColumnName(handle, colIdx, &column) != NS_OK) {
-            Dbi_TclErrorResult(interp, handle);
-            goto cleanup;
-        }
-        if (arrayName != NULL) {
-            varName1 = arrayName;
-            varName2 = column;
-        } else {
-            varName1 = column;
-            varName2 = NULL;
-        }
-        if (Tcl_SetVar2Ex(interp, varName1, varName2, valueObj,
-                          TCL_LEAVE_ERR_MSG) == NULL) {
+        if (Tcl_ObjSetVar2(interp,
+                           arrayObj != NULL ? arrayObj : colV[colIdx],
+                           arrayObj != NULL ? colV[colIdx] : NULL,
+                           valueObj, TCL_LEAVE_ERR_MSG) == NULL) {
             Tcl_DecrRefCount(valueObj);
+            Tcl_DecrRefCount(colListObj);
             goto cleanup;
         }
     }
+    Tcl_DecrRefCount(colListObj);
 
     /*
      * Try to fetch again to check for more than 1 row.
@@ -1518,13 +2500,15 @@ CtlObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const ob
 
     static const char *cmds[] = {
         "bounce", "database", "dblist", "default", "driver",
-        "maxhandles", "maxrows", "maxidle", "maxopen", "maxqueries",
-        "stats", "timeout", NULL
+        "fragmentflush", "maxhandles", "maxrows", "maxidle", "maxopen", "maxqueries",
+        "renderthreads", "retries", "retrytimeout",
+        "stats", "timeout", "validationinterval", NULL
     };
     enum CmdIdx {
         CBounceCmd, CDatabaseCmd, CDBListCmd, CDefaultCmd, CDriverCmd,
-        CMaxHandlesCmd, CMaxRowsCmd, CMaxIdleCmd, CMaxOpenCmd, CMaxQueriesCmd,
-        CStatsCmd, CTimeoutCmd
+        CFragmentFlushCmd, CMaxHandlesCmd, CMaxRowsCmd, CMaxIdleCmd, CMaxOpenCmd, CMaxQueriesCmd,
+        CRenderThreadsCmd, CRetriesCmd, CRetryTimeoutCmd,
+        CStatsCmd, CTimeoutCmd, CValidationIntervalCmd
     };
     if (objc < 2) {
         Tcl_WrongNumArgs(interp, 1, objv, "command ?args?");
@@ -1557,6 +2541,24 @@ CtlObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const ob
 
         }
         return TCL_OK;
+
+    case CRenderThreadsCmd:
+        if (objc > 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "?threads?");
+            return TCL_ERROR;
+        }
+        newIntValue = -1;
+        if (objc == 3
+            && Tcl_GetIntFromObj(interp, objv[2], &newIntValue) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (objc == 3 && (newIntValue < 0 || newIntValue > 64)) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                "threads must be between 0 and 64", -1));
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(DbiRenderThreads(newIntValue)));
+        return TCL_OK;
     }
 
     /*
@@ -1589,6 +2591,11 @@ CtlObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const ob
         Dbi_Stats(&ds, pool);
         Tcl_DStringResult(interp, &ds);
         return TCL_OK;
+
+    case CFragmentFlushCmd:
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(
+            Dbi_FragmentFlush(pool, objc == 4 ? Tcl_GetString(objv[3]) : NULL)));
+        return TCL_OK;
     }
 
     /*
@@ -1601,6 +2608,7 @@ CtlObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const ob
       case CMaxHandlesCmd:
       case CMaxRowsCmd:
       case CMaxQueriesCmd:
+      case CRetriesCmd:
           if (Tcl_GetIntFromObj(interp, objv[3], &newIntValue) != TCL_OK) {
               return TCL_ERROR;
           }
@@ -1609,6 +2617,8 @@ CtlObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const ob
       case CMaxIdleCmd:
       case CMaxOpenCmd:
       case CTimeoutCmd:
+      case CValidationIntervalCmd:
+      case CRetryTimeoutCmd:
           if (Ns_GetTimeFromString(interp, Tcl_GetString(objv[3]), &newTimeValue) != TCL_OK) {
               return TCL_ERROR;
           }
@@ -1636,6 +2646,10 @@ CtlObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const ob
         resultObj = Tcl_NewIntObj(Dbi_ConfigInt(pool, DBI_CONFIG_MAXQUERIES, newIntValue));
         break;
 
+    case CRetriesCmd:
+        resultObj = Tcl_NewIntObj(Dbi_ConfigInt(pool, DBI_CONFIG_RETRIES, newIntValue));
+        break;
+
 
     case CMaxIdleCmd:
         Dbi_ConfigTime(pool, DBI_CONFIG_MAXIDLE, newTimeValuePtr, &oldTimeValue);
@@ -1652,6 +2666,16 @@ CtlObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const ob
         resultObj = Ns_TclNewTimeObj(&oldTimeValue);
         break;
 
+    case CValidationIntervalCmd:
+        Dbi_ConfigTime(pool, DBI_CONFIG_VALIDATIONINTERVAL, newTimeValuePtr, &oldTimeValue);
+        resultObj = Ns_TclNewTimeObj(&oldTimeValue);
+        break;
+
+    case CRetryTimeoutCmd:
+        Dbi_ConfigTime(pool, DBI_CONFIG_RETRYTIMEOUT, newTimeValuePtr, &oldTimeValue);
+        resultObj = Ns_TclNewTimeObj(&oldTimeValue);
+        break;
+
     default:
         resultObj = Tcl_NewStringObj("INVALID CMD", -1);
         result = TCL_ERROR;
@@ -1670,6 +2694,12 @@ CtlObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const ob
  *
  *      Get a handle, prepare, bind, and execute an SQL statement.
  *
+ *      A query returning rows which fails because the connection was
+ *      lost is retried on a fresh connection. See: Retry(). A failure
+ *      of the execution itself is only retried if retry is set: the
+ *      statement may have had side effects before the connection
+ *      dropped, e.g. an INSERT ... RETURNING or a call to nextval().
+ *
  * Results:
  *      TCL_OK or TCL_ERROR. handlePtrPtr updated with active db handle
  *      on successful return.
@@ -1684,15 +2714,19 @@ CtlObjCmd(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const ob
 static int
 Exec(InterpData *idataPtr, Tcl_Obj *poolObj, Ns_Time *timeoutPtr,
      Tcl_Obj *queryObj, Tcl_Obj *valuesObj, int maxRows, int dml,
-     int autoNull, Dbi_Handle **handlePtrPtr)
+     int retry, int autoNull, Dbi_Handle **handlePtrPtr)
 {
     Tcl_Interp       *interp = idataPtr->interp;
     Dbi_Pool         *pool;
     Dbi_Handle       *handle;
-    Dbi_Value         dbValues[DBI_MAX_BIND];
-    unsigned int      numCols;
+    Dbi_Value         staticValues[DBI_STATIC_BIND], *dbValues = staticValues;
+    unsigned int      numCols, numVars;
     char             *query;
     TCL_SIZE_T        qlength;
+    int               retries = -1;
+    Ns_Time           deadline;
+    ListLengthCtx     ctx;
+    Tcl_DString       sqlDs;
 
     /*
      * Grab a free handle, possibly from the interp cache.
@@ -1711,7 +2745,30 @@ Exec(InterpData *idataPtr, Tcl_Obj *poolObj, Ns_Time *timeoutPtr,
 
     query = Tcl_GetStringFromObj(queryObj, &qlength);
 
+    /*
+     * Expand list variables, :name[], unless the driver binds them
+     * natively.
+     */
+
+    Tcl_DStringInit(&sqlDs);
+    ctx.interp = interp;
+    ctx.valuesObj = valuesObj;
+    ctx.initialized = 0;
+
+    if (Dbi_ExpandListVariables(handle, query, qlength,
+                                ListLength, &ctx, &sqlDs) != NS_OK) {
+        goto error;
+    }
+    if (sqlDs.length > 0) {
+        query = sqlDs.string;
+        qlength = sqlDs.length;
+    }
+
+ retry:
     if (Dbi_Prepare(handle, query, qlength) != NS_OK) {
+        if (Retry(idataPtr, handle, dml, &retries, &deadline)) {
+            goto retry;
+        }
         Dbi_TclErrorResult(interp, handle);
         goto error;
     }
@@ -1730,24 +2787,143 @@ Exec(InterpData *idataPtr, Tcl_Obj *poolObj, Ns_Time *timeoutPtr,
      * Bind values to variable as required and execute the statement.
      */
 
-    if (Dbi_TclBindVariables(interp, handle, dbValues, valuesObj, autoNull) != TCL_OK) {
+    numVars = Dbi_NumVariables(handle);
+    if (numVars > DBI_STATIC_BIND && dbValues == staticValues) {
+        dbValues = ns_malloc(numVars * sizeof(Dbi_Value));
+    }
+    if (BindVariables(idataPtr, handle, dbValues, valuesObj, autoNull) != TCL_OK) {
         goto error;
     }
     if (Dbi_Exec(handle, dbValues, maxRows) != NS_OK) {
+        if (retry && Retry(idataPtr, handle, dml, &retries, &deadline)) {
+            goto retry;
+        }
         Dbi_TclErrorResult(interp, handle);
         goto error;
     }
+    if (dbValues != staticValues) {
+        ns_free(dbValues);
+    }
+    Tcl_DStringFree(&sqlDs);
 
     return TCL_OK;
 
  error:
+    if (dbValues != staticValues) {
+        ns_free(dbValues);
+    }
+    Tcl_DStringFree(&sqlDs);
     PutHandle(idataPtr, handle);
 
     return TCL_ERROR;
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * Retry --
+ *
+ *      Decide whether a failed prepare or exec may be retried, and if
+ *      so reconnect the handle.
+ *
+ *      Only queries returning rows are retried, and only on a handle
+ *      which is not shared with a dbi_eval block: a dml statement may
+ *      have been applied before the connection dropped, and a lost
+ *      connection aborts any transaction in progress.
+ *
+ *      The pool's retries and retrytimeout bound the number of
+ *      attempts and the time spent on them. *retriesPtr must be -1
+ *      before the first call for a query.
+ *
+ * Results:
+ *      NS_TRUE if the statement should be run again on the handle,
+ *      NS_FALSE otherwise with the exception left in the handle.
+ *
+ * Side effects:
+ *      The handle may be reconnected. See: Dbi_Reconnect().
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Retry(InterpData *idataPtr, Dbi_Handle *handle, int dml,
+      int *retriesPtr, Ns_Time *deadlinePtr)
+{
+    Ns_Time    now, diff;
+    TCL_SIZE_T i;
+
+    if (dml || strncmp(Dbi_ExceptionCode(handle), "08", 2) != 0) {
+        return NS_FALSE;
+    }
+    for (i = idataPtr->depth; i > -1; i--) {
+        if (idataPtr->handles[i] == handle) {
+            return NS_FALSE;
+        }
+    }
+
+    Ns_GetTime(&now);
+
+    if (*retriesPtr < 0) {
+        *retriesPtr = Dbi_ConfigInt(handle->pool, DBI_CONFIG_RETRIES, -1);
+        Dbi_ConfigTime(handle->pool, DBI_CONFIG_RETRYTIMEOUT, NULL, deadlinePtr);
+        Ns_IncrTime(deadlinePtr, now.sec, now.usec);
+    }
+    if (*retriesPtr == 0 || Ns_DiffTime(deadlinePtr, &now, &diff) < 0) {
+        return NS_FALSE;
+    }
+    (*retriesPtr)--;
+
+    Ns_Log(Notice, "dbi[%s]: retrying query after: %s: %s",
+           Dbi_PoolName(handle->pool),
+           Dbi_ExceptionCode(handle), Dbi_ExceptionMsg(handle));
+
+    return (Dbi_Reconnect(handle) == NS_OK);
+}
+
+
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * PresizeRows --
+ *
+ *      The number of rows to presize a result for, from the row count
+ *      hint of the driver. The hint is limited by the rows the query
+ *      may return, -max or else the pool maxrows, and to MAX_PRESIZE
+ *      list elements of perRow elements per row.
+ *
+ * Results:
+ *      Number of rows, 0 if unknown.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TCL_SIZE_T
+PresizeRows(Dbi_Handle *handle, int maxRows, unsigned int perRow)
+{
+    int numRows;
+
+    if (handle->numRowsHint <= 0) {
+        return 0;
+    }
+    numRows = handle->numRowsHint;
+    if (maxRows < 0) {
+        maxRows = Dbi_ConfigInt(handle->pool, DBI_CONFIG_MAXROWS, -1);
+    }
+    if (numRows > maxRows) {
+        numRows = maxRows;
+    }
+    if (perRow > 0u && (unsigned int) numRows > MAX_PRESIZE / perRow) {
+        numRows = (int)(MAX_PRESIZE / perRow);
+    }
+    return (TCL_SIZE_T) numRows;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1796,10 +2972,47 @@ ColumnValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
             Tcl_Obj **valueObjPtr)
 {
     Tcl_Obj   *objPtr;
+    Dbi_Value  value;
     char      *bytes;
     size_t     length;
     int        binary;
 
+    /*
+     * Create native values without a string rep if the driver can
+     * return them. The string rep is generated only if needed.
+     */
+
+    if (Dbi_ColumnTypedValue(handle, index, &value) != NS_OK) {
+        Dbi_TclErrorResult(interp, handle);
+        return TCL_ERROR;
+    }
+    switch (value.type) {
+    case DBI_VALUE_INT:
+        *valueObjPtr = Tcl_NewWideIntObj((Tcl_WideInt) value.v.i);
+        return TCL_OK;
+    case DBI_VALUE_WIDE:
+        *valueObjPtr = Tcl_NewWideIntObj(value.v.w);
+        return TCL_OK;
+    case DBI_VALUE_DOUBLE:
+        *valueObjPtr = Tcl_NewDoubleObj(value.v.d);
+        return TCL_OK;
+    case DBI_VALUE_BOOL:
+        *valueObjPtr = Tcl_NewBooleanObj(value.v.i);
+        return TCL_OK;
+    case DBI_VALUE_TIMESTAMP:
+        *valueObjPtr = Ns_TclNewTimeObj(&value.v.t);
+        return TCL_OK;
+    case DBI_VALUE_BYTES:
+        *valueObjPtr = Tcl_NewByteArrayObj((const unsigned char *) value.data,
+                                           (TCL_SIZE_T) value.length);
+        return TCL_OK;
+    case DBI_VALUE_NULL:
+        *valueObjPtr = Tcl_NewObj();
+        return TCL_OK;
+    case DBI_VALUE_STRING:
+        break;
+    }
+
     if (Dbi_ColumnLength(handle, index, &length, &binary) != NS_OK) {
         Dbi_TclErrorResult(interp, handle);
         return TCL_ERROR;
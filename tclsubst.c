@@ -30,22 +30,150 @@
  */
 
 #include "nsdbi.h"
+#include <math.h>
 
+#if defined(__SSE2__) && defined(__GNUC__)
+# include <emmintrin.h>
+# define DBI_HAVE_SSE2 1
+#endif
+
+
+
+/*
+ * The following describes a single instruction of a compiled template:
+ * a span of literal text, or a variable which is resolved to a column
+ * index, a special dbi variable or a Tcl variable.
+ */
+
+typedef struct Op {
+    int         varType;  /* VARTYPE_TEXT, other VARTYPE_* or column index. */
+    TCL_SIZE_T  start;    /* Offset of text or variable name in text buffer. */
+    TCL_SIZE_T  length;   /* Length of text or variable name. */
+    Tcl_Obj    *nameObj;  /* Name of a variable, NULL for text. */
+    int         quote;    /* Quoting of a variable, -1 for the default. */
+    int         modifier; /* MODIFIER_* applied to a variable. */
+    int         format;   /* FORMAT_* conversion of a variable. */
+    TCL_SIZE_T  fmtStart; /* Offset of the C format string in text buffer. */
+    TCL_SIZE_T  thenStart, thenLength;  /* Text for a true conditional. */
+    TCL_SIZE_T  elseStart, elseLength;  /* Text for NULL, empty or false. */
+    TCL_SIZE_T  valueStart, valueLength; /* Substituted Tcl variable, in the
+                                          * values buffer of a running template. */
+} Op;
+
+/*
+ * The following are the modifiers which may follow the name of a
+ * braced variable: ${name|default}, ${name?:default}, and
+ * ${name?then|else}.
+ */
+
+#define MODIFIER_NONE   0
+#define MODIFIER_NULL   1  /* Substitute else text for NULL. */
+#define MODIFIER_EMPTY  2  /* Substitute else text for NULL or empty. */
+#define MODIFIER_COND   3  /* Substitute then or else text, never the value. */
+
+/*
+ * The following are the numeric conversions of ${name%spec}.
+ */
 
+#define FORMAT_NONE     0
+#define FORMAT_INT      1  /* d i u o x X: as a Tcl_WideInt. */
+#define FORMAT_DOUBLE   2  /* e E f g G: as a double. */
 
 /*
  * The following describes the internal rep of a Template object
- * which is used to cache the parsed tokens.
+ * which is used to cache the compiled template.
+ *
+ * The variable types are resolved per statement. Each handle prepares
+ * its own statements, so the resolved types of the last few statements
+ * the template was used with are remembered to avoid remapping when
+ * successive calls get different handles.
+ */
+
+#define TEMPLATE_MAPS 8
+
+/*
+ * The output buffer is presized from the average row length and the
+ * row count hint of the driver, up to the following number of bytes.
  */
 
+#define MAX_PRESIZE (64 * 1024 * 1024)
+
 typedef struct Template {
-    Tcl_Parse    parse;
-    int          varColMap[DBI_MAX_BIND];
+    int            refCount;    /* Number of template objects sharing this. */
+    unsigned long  serial;      /* Statement the variables are resolved for. */
+    int            numOps;
+    int            numVars;
+    TCL_SIZE_T     textLength;  /* Total length of literal text per row. */
+    TCL_SIZE_T     avgRowLength; /* Moving average of rendered row length. */
+    Op            *ops;
+    char          *text;        /* Literal text and variable names. */
+    int            nextMap;     /* Slot of maps to replace next. */
+    struct {
+        unsigned long  serial;
+        int           *varTypes;  /* Type of each variable, in order. */
+    } maps[TEMPLATE_MAPS];
 } Template;
 
+/*
+ * The following describe a block of fetched rows which is rendered
+ * in chunks by parallel threads. The values of the column
+ * instructions of each row are copied, in order, into the data
+ * buffer so the handle is not touched while rendering.
+ */
+
+#define BLOCK_ROWS      8192  /* Rows fetched for each parallel render. */
+#define MIN_CHUNK_ROWS  512   /* Fewest rows worth a thread. */
+#define MAX_CHUNKS      16
+
+typedef struct Block {
+    const Template    *templatePtr;
+    const Tcl_DString *valuesPtr;  /* Resolved Tcl variables. */
+    Dbi_quotingLevel   quote;
+    unsigned int       rowIdx;     /* Row index of the first row. */
+    int                numRows;
+    int                numCols;    /* Column instructions per row. */
+    Tcl_DString        data;       /* Column values of all rows. */
+    TCL_SIZE_T        *spans;      /* Offset and length of each value. */
+} Block;
+
+typedef struct Chunk {
+    struct Chunk *nextPtr;         /* Next chunk queued for the render pool. */
+    const Block  *blockPtr;
+    int           firstRow;
+    int           lastRow;         /* One past the last row. */
+    int           done;            /* Rendered by a pool thread. */
+    Tcl_DString  *dsPtr;           /* Output buffer. */
+    Tcl_DString   ds;              /* Output of other than the first chunk. */
+} Chunk;
+
+/*
+ * The following is the pool of threads which render chunks, shared
+ * by all parallel templates. A template only queues as many chunks
+ * as there are free threads, and renders the others itself.
+ */
+
+static struct {
+    Ns_Mutex  lock;
+    Ns_Cond   queueCond;           /* Signalled when chunks are queued. */
+    Ns_Cond   doneCond;            /* Broadcast when a chunk is rendered. */
+    Chunk    *firstPtr;            /* Queued chunks. */
+    Chunk    *lastPtr;
+    int       numThreads;          /* Running threads. */
+    int       maxThreads;          /* Threads wanted, see: DbiRenderThreads. */
+    int       numFree;             /* Threads without a queued chunk. */
+    int       stopping;            /* Server is shutting down. */
+} renderPool;
+
 
 int DbiTclSubstTemplate(Tcl_Interp *, Dbi_Handle *,
-                        Tcl_Obj *templateObj, Tcl_Obj *defaultObj, int adp, Dbi_quotingLevel quote);
+                        Tcl_Obj *templateObj, Tcl_Obj *defaultObj, int adp, Dbi_quotingLevel quote,
+                        Tcl_Obj *groupObj, Tcl_Obj *headerObj, Tcl_Obj *footerObj,
+                        int parallel);
+int DbiTclSubstJson(Tcl_Interp *, Dbi_Handle *, int arrays, int adp);
+int DbiTclSubstCsv(Tcl_Interp *, Dbi_Handle *, char delimiter, int quoteAll, int adp);
+void DbiRenderPoolInit(int numThreads);
+int DbiRenderThreads(int numThreads);
+int DbiTemplateVariables(Tcl_Interp *interp, Tcl_Obj *templateObj, Tcl_DString *dsPtr);
 
 
 /*
@@ -54,18 +182,55 @@ int DbiTclSubstTemplate(Tcl_Interp *, Dbi_Handle *,
 
 static int GetTemplateFromObj(Tcl_Interp *interp, Dbi_Handle *,
                               Tcl_Obj *templateObj, Template **templatePtrPtr);
-static int AppendValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
-                       Tcl_Obj *resObj, Tcl_DString *dsPtr, Dbi_quotingLevel quote);
-static int AppendTokenVariable(Tcl_Interp *interp, Tcl_Token *tokenPtr,
-                               Tcl_Obj *resObj, Tcl_DString *dsPtr, Dbi_quotingLevel quote);
-static void AppendInt(Tcl_Interp *, unsigned int rowint,
-                      Tcl_Obj *resObj, Tcl_DString *dsPtr);
+static int AppendTemplate(Tcl_Interp *interp, Dbi_Handle *handle, Template *templatePtr,
+                          Tcl_DString *dsPtr, Tcl_DString *scratchPtr, size_t *lengths,
+                          const Tcl_DString *valuesPtr, Dbi_quotingLevel quote);
+static int ResolveTclVariables(Tcl_Interp *interp, Dbi_Handle *handle, Template *templatePtr,
+                               Tcl_DString *valuesPtr, Tcl_DString *scratchPtr,
+                               Dbi_quotingLevel quote);
+static int FindColumn(Dbi_Handle *handle, const char *name);
+static int CanRenderInParallel(const Template *templatePtr, int *numColsPtr);
+static int AppendParallel(Tcl_Interp *interp, Dbi_Handle *handle, const Template *templatePtr,
+                          Tcl_DString *dsPtr, const Tcl_DString *valuesPtr,
+                          Dbi_quotingLevel quote, int parallel, int adp, int stream,
+                          size_t maxBuffer, unsigned int *numRowsPtr, TCL_SIZE_T *renderedPtr);
+static int FetchBlock(Tcl_Interp *interp, Dbi_Handle *handle, Block *blockPtr, int *endPtr);
+static void RenderChunk(Chunk *chunkPtr);
+static Ns_ThreadProc RenderThread;
+static Ns_ShutdownProc RenderPoolShutdown;
+static int AppendColumn(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
+                        size_t length, Tcl_DString *dsPtr, Tcl_DString *scratchPtr,
+                        Dbi_quotingLevel quote);
+static int AppendTclVariable(Tcl_Interp *interp, const Op *opPtr,
+                             Tcl_DString *dsPtr, Dbi_quotingLevel quote);
+static int AppendModified(Tcl_Interp *interp, Dbi_Handle *handle,
+                          const Template *templatePtr, const Op *opPtr,
+                          Tcl_DString *dsPtr, Tcl_DString *scratchPtr,
+                          Dbi_quotingLevel quote);
+static int AppendFormatted(Tcl_Interp *interp, const char *format, int type,
+                           const Dbi_Value *valuePtr, const char *string,
+                           Tcl_DString *dsPtr, Dbi_quotingLevel quote);
+static void AppendInt(Tcl_DString *dsPtr, unsigned int rowint);
+static int AppendJsonValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
+                           Tcl_DString *dsPtr);
+static int AppendCsvValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
+                          Tcl_DString *dsPtr, Tcl_DString *scratchPtr,
+                          char delimiter, int quoteAll);
+static void QuoteCsv(Tcl_DString *dsPtr, const char *string, size_t length,
+                     char delimiter, int quoteAll);
+static void FormatTimestamp(const Ns_Time *timePtr, char *buf, size_t size);
+static int GetStringValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
+                          Tcl_DString *dsPtr, const char *format);
 static void MapVariablesToColumns(Dbi_Handle *handle, Template *templatePtr);
-static void NewTextToken(Tcl_Parse *parsePtr, char *string, int length);
+static int ParseQuoteSuffix(const char *name, TCL_SIZE_T *lengthPtr);
+static int ParseModifiers(Tcl_Interp *interp, const char *name, TCL_SIZE_T *lengthPtr,
+                          Op *opPtr, Tcl_DString *textPtr);
+static Op *NewOp(Template *templatePtr, int *opsAvailablePtr);
 static int NextRow(Tcl_Interp *interp, Dbi_Handle *handle, int *endPtr);
 
 static void FreeTemplate(Template *);
 static Tcl_FreeInternalRepProc FreeTemplateObj;
+static Tcl_DupInternalRepProc  DupTemplateObj;
 
 
 /*
@@ -75,7 +240,7 @@ static Tcl_FreeInternalRepProc FreeTemplateObj;
 static CONST86 Tcl_ObjType templateType = {
     "dbi:template",
     FreeTemplateObj,
-    (Tcl_DupInternalRepProc *) NULL,
+    DupTemplateObj,
     (Tcl_UpdateStringProc *) NULL,
     Ns_TclSetFromAnyError
 #ifdef TCL_OBJTYPE_V0
@@ -92,6 +257,7 @@ static CONST86 Tcl_ObjType templateType = {
 #define VARTYPE_ROWIDX  -2  /* The zero-based row number. */
 #define VARTYPE_ROWNUM  -3  /* The one-based row number. */
 #define VARTYPE_PARITY  -4  /* Whether the row is even or odd (zero-based). */
+#define VARTYPE_TEXT    -5  /* Literal text, not a variable. */
 
 static struct {
     const char *varName;
@@ -102,50 +268,254 @@ static struct {
     {"dbi(parity)", VARTYPE_PARITY},
 };
 
+/*
+ * The following are the names of quoting types which may be given
+ * for a single variable, as in ${name:html}.
+ */
+
+static struct {
+    const char       *name;
+    Dbi_quotingLevel  quote;
+} quoteNames[] = {
+    {"none", Dbi_QuoteNone},
+    {"html", Dbi_QuoteHTML},
+    {"js",   Dbi_QuoteJS},
+    {"json", Dbi_QuoteJSON},
+    {"url",  Dbi_QuoteURL},
+    {"xml",  Dbi_QuoteXML},
+    {"sql",  Dbi_QuoteSQL},
+};
+
+/*
+ * The following has bit (1 << quote) set for each character which
+ * must be escaped for the Dbi_quotingLevel quote: html, js, json,
+ * url, xml and sql.
+ */
+
+static const unsigned char quoteChars[256] = {
+    0x7c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c,
+    0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c, 0x3c,
+    0x10, 0x10, 0x3e, 0x10, 0x10, 0x10, 0x32, 0x76, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00, 0x00, 0x10,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x10, 0x3e, 0x10, 0x32, 0x10,
+    0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x5c, 0x10, 0x10, 0x00,
+    0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x10, 0x10, 0x00, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x1c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+};
+
 
 
 /*
  *----------------------------------------------------------------------
  *
- * QuoteJS --
+ * ScanQuote --
  *
- *      Append valid JavaScript strings (between single quotes)
- *      to first argument
+ *      Find the first character in the given span which must be
+ *      escaped for the quoting type. For html, js and json, sixteen
+ *      bytes are tested at a time where SSE2 is available.
  *
  * Results:
- *      none
+ *      Pointer to the character, or end if there is none.
  *
  * Side effects:
- *      Properly escaped string is returned in the passed DString object.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
-static void
-QuoteJS(Tcl_DString *dsPtr, char *string)
+
+static const char *
+ScanQuote(const char *p, const char *end, Dbi_quotingLevel quote)
+{
+    const unsigned char bit = (unsigned char) (1u << quote);
+
+#ifdef DBI_HAVE_SSE2
+    if (quote == Dbi_QuoteHTML) {
+        const __m128i amp = _mm_set1_epi8('&'), lt = _mm_set1_epi8('<'),
+                      gt = _mm_set1_epi8('>'), dquote = _mm_set1_epi8('"'),
+                      squote = _mm_set1_epi8('\'');
+
+        while (end - p >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) p);
+            __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, dquote)),
+                             _mm_cmpeq_epi8(v, squote)));
+            int mask = _mm_movemask_epi8(m);
+
+            if (mask != 0) {
+                return p + __builtin_ctz((unsigned int) mask);
+            }
+            p += 16;
+        }
+    } else if (quote == Dbi_QuoteJS || quote == Dbi_QuoteJSON) {
+
+        /*
+         * Control characters are those for which the unsigned
+         * minimum with 0x1f is the byte itself. 0xe2 starts the line
+         * separators. json leaves single quotes alone, so it tests
+         * for double quotes twice.
+         */
+
+        const __m128i ctrl = _mm_set1_epi8(0x1f), dquote = _mm_set1_epi8('"'),
+                      squote = _mm_set1_epi8(quote == Dbi_QuoteJS ? '\'' : '"'),
+                      bslash = _mm_set1_epi8('\\'), lt = _mm_set1_epi8('<'),
+                      lsep = _mm_set1_epi8((char) 0xe2);
+
+        while (end - p >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) p);
+            __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, dquote), _mm_cmpeq_epi8(v, squote))),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, bslash), _mm_cmpeq_epi8(v, lt)),
+                             _mm_cmpeq_epi8(v, lsep)));
+            int mask = _mm_movemask_epi8(m);
+
+            if (mask != 0) {
+                return p + __builtin_ctz((unsigned int) mask);
+            }
+            p += 16;
+        }
+    }
+#endif
+
+    while (p < end && (quoteChars[(unsigned char) *p] & bit) == 0) {
+        p++;
+    }
+    return p;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendEscape --
+ *
+ *      Append the escaped form of the character at p, which was
+ *      found by ScanQuote, for the quoting type.
+ *
+ *      For js and json, the sequences "</" and the line separators
+ *      U+2028 and U+2029 are escaped as well so the output is safe
+ *      within a script element.
+ *
+ *      For sql, quotes are doubled and backslash and NUL are escaped
+ *      with a backslash, as for databases which take backslash as an
+ *      escape character within string literals.
+ *
+ * Results:
+ *      Number of bytes of input consumed.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TCL_SIZE_T
+AppendEscape(Tcl_DString *dsPtr, const char *p, const char *end, Dbi_quotingLevel quote)
 {
-    Tcl_DStringAppend(dsPtr, "'", 1);
-    while (likely(*string != '\0')) {
-        switch (*string) {
+    unsigned char c = (unsigned char) *p;
+    char          buf[8];
+
+    switch (quote) {
+    case Dbi_QuoteHTML:
+    case Dbi_QuoteXML:
+        switch (c) {
+        case '&':  Tcl_DStringAppend(dsPtr, "&amp;", 5); break;
+        case '<':  Tcl_DStringAppend(dsPtr, "&lt;", 4);  break;
+        case '>':  Tcl_DStringAppend(dsPtr, "&gt;", 4);  break;
+        case '"':
+            Tcl_DStringAppend(dsPtr, quote == Dbi_QuoteXML ? "&quot;" : "&#34;", TCL_INDEX_NONE);
+            break;
         case '\'':
-            Tcl_DStringAppend(dsPtr, "\\'", 2);
+            Tcl_DStringAppend(dsPtr, quote == Dbi_QuoteXML ? "&apos;" : "&#39;", TCL_INDEX_NONE);
+            break;
+        case '\t':
+        case '\n':
+        case '\r':
+            snprintf(buf, sizeof(buf), "&#%d;", c);
+            Tcl_DStringAppend(dsPtr, buf, TCL_INDEX_NONE);
+            break;
+        default:
+            /* Other control characters are not allowed in XML. */
+            break;
+        }
+        return 1;
+
+    case Dbi_QuoteURL:
+        snprintf(buf, sizeof(buf), "%%%02X", c);
+        Tcl_DStringAppend(dsPtr, buf, 3);
+        return 1;
+
+    case Dbi_QuoteSQL:
+        switch (c) {
+        case '\'': Tcl_DStringAppend(dsPtr, "''", 2);   break;
+        case '\\': Tcl_DStringAppend(dsPtr, "\\\\", 2); break;
+        default:   Tcl_DStringAppend(dsPtr, "\\0", 2);  break;
+        }
+        return 1;
+
+    case Dbi_QuoteJS:
+    case Dbi_QuoteJSON:
+        switch (c) {
+        case '\\': Tcl_DStringAppend(dsPtr, "\\\\", 2); break;
+        case '\'': Tcl_DStringAppend(dsPtr, "\\'", 2);  break;
+        case '"':  Tcl_DStringAppend(dsPtr, "\\\"", 2); break;
+        case '\n': Tcl_DStringAppend(dsPtr, "\\n", 2);  break;
+        case '\r': Tcl_DStringAppend(dsPtr, "\\r", 2);  break;
+        case '\t': Tcl_DStringAppend(dsPtr, "\\t", 2);  break;
+        case '\b': Tcl_DStringAppend(dsPtr, "\\b", 2);  break;
+        case '\f': Tcl_DStringAppend(dsPtr, "\\f", 2);  break;
+        case '<':
+            if (end - p > 1 && p[1] == '/') {
+                Tcl_DStringAppend(dsPtr, "<\\/", 3);
+                return 2;
+            }
+            Tcl_DStringAppend(dsPtr, "<", 1);
+            break;
+        case 0xE2:
+            if (end - p > 2 && (unsigned char) p[1] == 0x80
+                && ((unsigned char) p[2] == 0xA8 || (unsigned char) p[2] == 0xA9)) {
+                Tcl_DStringAppend(dsPtr, (unsigned char) p[2] == 0xA8 ? "\\u2028" : "\\u2029", 6);
+                return 3;
+            }
+            Tcl_DStringAppend(dsPtr, p, 1);
             break;
-
         default:
-            Tcl_DStringAppend(dsPtr, string, 1);
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            Tcl_DStringAppend(dsPtr, buf, 6);
             break;
         }
-        ++string;
+        return 1;
+
+    case Dbi_QuoteNone:
+        break;
     }
-    Tcl_DStringAppend(dsPtr, "'", 1);
+
+    Tcl_DStringAppend(dsPtr, p, 1);
+    return 1;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
  * Quote --
  *
- *      Append a potentially quoted string to first argument.
+ *      Append a potentially quoted string of the given length to
+ *      first argument. js and sql values are enclosed in single
+ *      quotes, json values in double quotes; html, xml and url
+ *      values are escaped only.
+ *
+ *      Runs of characters which need no escaping are appended in one
+ *      go.
  *
  * Results:
  *      None
@@ -156,19 +526,37 @@ QuoteJS(Tcl_DString *dsPtr, char *string)
  *----------------------------------------------------------------------
  */
 static void
-Quote(Tcl_DString *dsPtr, char *value, Dbi_quotingLevel quote)
+Quote(Tcl_DString *dsPtr, const char *value, TCL_SIZE_T length, Dbi_quotingLevel quote)
 {
-    if (likely(quote == Dbi_QuoteHTML)) {
-        Ns_QuoteHtml(dsPtr, value);
-    } else if (quote == Dbi_QuoteJS) {
-        QuoteJS(dsPtr, value);
-    } else {
-        Tcl_DStringAppend(dsPtr, value, -1);
+    const char *p, *end = value + length;
+
+    if (quote == Dbi_QuoteNone) {
+        Tcl_DStringAppend(dsPtr, value, length);
+        return;
+    }
+    if (quote == Dbi_QuoteJS || quote == Dbi_QuoteSQL) {
+        Tcl_DStringAppend(dsPtr, "'", 1);
+    } else if (quote == Dbi_QuoteJSON) {
+        Tcl_DStringAppend(dsPtr, "\"", 1);
+    }
+
+    for (;;) {
+        p = ScanQuote(value, end, quote);
+        Tcl_DStringAppend(dsPtr, value, (TCL_SIZE_T)(p - value));
+        if (p == end) {
+            break;
+        }
+        value = p + AppendEscape(dsPtr, p, end, quote);
+    }
+
+    if (quote == Dbi_QuoteJS || quote == Dbi_QuoteSQL) {
+        Tcl_DStringAppend(dsPtr, "'", 1);
+    } else if (quote == Dbi_QuoteJSON) {
+        Tcl_DStringAppend(dsPtr, "\"", 1);
     }
 }
 
 
-
 /*
  *----------------------------------------------------------------------
  *
@@ -177,57 +565,114 @@ Quote(Tcl_DString *dsPtr, char *value, Dbi_quotingLevel quote)
  *      Substitute the template for each row of the pending db result and
  *      append to the Tcl result.
  *
+ *      If groupObj names a column the rows are taken to be ordered by
+ *      it, and the optional header and footer templates are
+ *      substituted before the first and after the last row of each
+ *      run of rows with the same value. The footer is substituted
+ *      with the last row of its group.
+ *
+ *      The output buffer is grown once for all the rows the driver
+ *      expects, from the average row length of the template.
+ *
+ *      If parallel is greater than one, rows after the first are
+ *      rendered by that many threads, when the template needs nothing
+ *      from the handle but column values. See AppendParallel.
+ *
  * Results:
  *      Standard Tcl result.
  *
  * Side effects:
- *      Template object may be converted to dbi:template type / an
- *      existing template object will have it varColMap recomputed.
+ *      Template objects may be converted to dbi:template type / an
+ *      existing template object will have its variables resolved for
+ *      a new statement.
  *
  *----------------------------------------------------------------------
  */
 
 int
 DbiTclSubstTemplate(Tcl_Interp *interp, Dbi_Handle *handle,
-                    Tcl_Obj *templateObj, Tcl_Obj *defaultObj, int adp, Dbi_quotingLevel quote)
-{
-    Template      *templatePtr;
-    Tcl_Parse     *parsePtr;
-    Tcl_Token     *tokenPtr;
-    Tcl_Obj       *resObj;
-    Tcl_DString   *dsPtr;
-    const char    *parity;
-    int           *varColMap, end;
-    TCL_SIZE_T     len, tokIdx, varIdx;
-    int            stream = 0, colIdx;
-    size_t         maxBuffer = 0u;
+                    Tcl_Obj *templateObj, Tcl_Obj *defaultObj, int adp, Dbi_quotingLevel quote,
+                    Tcl_Obj *groupObj, Tcl_Obj *headerObj, Tcl_Obj *footerObj,
+                    int parallel)
+{
+    Template      *templatePtr, *headerPtr = NULL, *footerPtr = NULL;
+    Tcl_DString    ds, scratch, key, footer, values, *dsPtr;
+    size_t        *lengths, staticLengths[DBI_STATIC_BIND], maxBuffer = 0u, keyLength;
+    TCL_SIZE_T     len, rowStart, rendered = 0;
+    Tcl_WideInt    presize;
+    int            stream = 0, binary, end, groupIdx = -1, maxOps, numCols, status = TCL_OK;
     unsigned int   numRows;
 
 
     /*
-     * Convert the template into a stream of text + variable tokens.
-     * Map the template variables to column indexes and Tcl variable names.
+     * Compile the templates into lists of text and variable
+     * instructions, with variables resolved to columns of this
+     * statement.
      */
 
     if (GetTemplateFromObj(interp, handle, templateObj, &templatePtr)
             != TCL_OK) {
         return TCL_ERROR;
     }
-    parsePtr = &templatePtr->parse;
-    varColMap = templatePtr->varColMap;
+    if (templatePtr->numVars == 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("template contains no variables", -1));
+        return TCL_ERROR;
+    }
+    maxOps = templatePtr->numOps;
+
+    if (groupObj != NULL) {
+        groupIdx = FindColumn(handle, Tcl_GetString(groupObj));
+        if (groupIdx < 0) {
+            Ns_TclPrintfResult(interp, "dbi: '-groupby' column \"%s\" is not in the result",
+                               Tcl_GetString(groupObj));
+            return TCL_ERROR;
+        }
+        if ((headerObj != NULL
+             && GetTemplateFromObj(interp, handle, headerObj, &headerPtr) != TCL_OK)
+            || (footerObj != NULL
+             && GetTemplateFromObj(interp, handle, footerObj, &footerPtr) != TCL_OK)) {
+            return TCL_ERROR;
+        }
+        if (headerPtr != NULL && headerPtr->numOps > maxOps) {
+            maxOps = headerPtr->numOps;
+        }
+        if (footerPtr != NULL && footerPtr->numOps > maxOps) {
+            maxOps = footerPtr->numOps;
+        }
+    }
 
     /*
      * Append to the Tcl result or directly to the ADP output buffer.
      */
 
     if (adp) {
-        resObj = NULL;
         if (Ns_AdpGetOutput(interp, &dsPtr, &stream, &maxBuffer) != TCL_OK) {
             return TCL_ERROR;
         }
     } else {
-        resObj = Tcl_GetObjResult(interp);
-        dsPtr = NULL;
+        dsPtr = &ds;
+        Tcl_DStringInit(dsPtr);
+    }
+    Tcl_DStringInit(&scratch);
+    Tcl_DStringInit(&key);
+    Tcl_DStringInit(&footer);
+    Tcl_DStringInit(&values);
+
+    /*
+     * Hold references: a Tcl variable read may shimmer the template
+     * objects while the templates are running.
+     */
+
+    templatePtr->refCount++;
+    if (headerPtr != NULL) {
+        headerPtr->refCount++;
+    }
+    if (footerPtr != NULL) {
+        footerPtr->refCount++;
+    }
+    lengths = staticLengths;
+    if (maxOps > DBI_STATIC_BIND) {
+        lengths = ns_malloc((size_t)maxOps * sizeof(size_t));
     }
 
     /*
@@ -237,72 +682,104 @@ DbiTclSubstTemplate(Tcl_Interp *interp, Dbi_Handle *handle,
 
     numRows = 0;
 
-    while (NextRow(interp, handle, &end) == TCL_OK
+    while ((status = NextRow(interp, handle, &end)) == TCL_OK
            && !end) {
 
         numRows++;
+        rowStart = Tcl_DStringLength(dsPtr);
 
-        for (tokIdx = 0, varIdx = 0;
-             tokIdx < parsePtr->numTokens;
-             tokIdx += (tokenPtr->numComponents + 1)) {
+        /*
+         * Tcl variables can't change while the rows are substituted,
+         * so they are looked up and quoted once, on the first row.
+         */
 
-            tokenPtr = &parsePtr->tokenPtr[tokIdx];
+        if (numRows == 1
+            && (ResolveTclVariables(interp, handle, templatePtr, &values, &scratch, quote) != TCL_OK
+                || (headerPtr != NULL
+                    && ResolveTclVariables(interp, handle, headerPtr, &values, &scratch, quote) != TCL_OK)
+                || (footerPtr != NULL
+                    && ResolveTclVariables(interp, handle, footerPtr, &values, &scratch, quote) != TCL_OK))) {
+            status = TCL_ERROR;
+            goto done;
+        }
 
-            switch (tokenPtr->type) {
+        /*
+         * Start a new group when the key changes, closing the last.
+         */
 
-            case TCL_TOKEN_TEXT:
-                if (adp) {
-                    if (Ns_AdpAppend(interp, tokenPtr->start, tokenPtr->size)
-                            != TCL_OK) {
-                        return TCL_ERROR;
-                    }
-                } else {
-                    Tcl_AppendToObj(resObj, tokenPtr->start, tokenPtr->size);
+        if (groupIdx >= 0) {
+            if (Dbi_ColumnLength(handle, (unsigned int)groupIdx, &keyLength, &binary) != NS_OK) {
+                Dbi_TclErrorResult(interp, handle);
+                status = TCL_ERROR;
+                goto done;
+            }
+            Tcl_DStringSetLength(&scratch, (TCL_SIZE_T)keyLength);
+            if (Dbi_ColumnValue(handle, (unsigned int)groupIdx, scratch.string, keyLength) != NS_OK) {
+                Dbi_TclErrorResult(interp, handle);
+                status = TCL_ERROR;
+                goto done;
+            }
+            if (numRows == 1
+                || (size_t)Tcl_DStringLength(&key) != keyLength
+                || memcmp(key.string, scratch.string, keyLength) != 0) {
+
+                Tcl_DStringAppend(dsPtr, footer.string, Tcl_DStringLength(&footer));
+                Tcl_DStringSetLength(&key, 0);
+                Tcl_DStringAppend(&key, scratch.string, (TCL_SIZE_T)keyLength);
+
+                if (headerPtr != NULL
+                    && AppendTemplate(interp, handle, headerPtr, dsPtr, &scratch,
+                                      lengths, &values, quote) != TCL_OK) {
+                    status = TCL_ERROR;
+                    goto done;
                 }
-                break;
-
-            case TCL_TOKEN_VARIABLE:
-
-                colIdx = varColMap[varIdx++];
+            }
+        }
 
-                switch (colIdx) {
-                case VARTYPE_TCL:
-                    if (AppendTokenVariable(interp, tokenPtr, resObj, dsPtr, quote)
-                            != TCL_OK) {
-                        return TCL_ERROR;
-                    }
-                    break;
+        if (AppendTemplate(interp, handle, templatePtr, dsPtr, &scratch,
+                           lengths, &values, quote) != TCL_OK) {
+            status = TCL_ERROR;
+            goto done;
+        }
 
-                case VARTYPE_ROWIDX:
-                    AppendInt(interp, handle->rowIdx, resObj, dsPtr);
-                    break;
+        /*
+         * The footer is kept for the current row, in case it is the
+         * last of its group. Footers of text only are substituted once.
+         */
 
-                case VARTYPE_ROWNUM:
-                    AppendInt(interp, handle->rowIdx +1, resObj, dsPtr);
-                    break;
+        if (footerPtr != NULL
+            && (footerPtr->numVars > 0 || numRows == 1)) {
+            Tcl_DStringSetLength(&footer, 0);
+            if (AppendTemplate(interp, handle, footerPtr, &footer, &scratch,
+                               lengths, &values, quote) != TCL_OK) {
+                status = TCL_ERROR;
+                goto done;
+            }
+        }
 
-                case VARTYPE_PARITY:
-                    parity = handle->rowIdx % 2 == 0 ? "even" : "odd";
-                    if (dsPtr != NULL) {
-                        Tcl_DStringAppend(dsPtr, parity, TCL_INDEX_NONE);
-                    } else {
-                        Tcl_AppendToObj(resObj, parity, TCL_INDEX_NONE);
-                    }
-                    break;
+        rendered += Tcl_DStringLength(dsPtr) - rowStart;
 
-                default:
-                    if (AppendValue(interp, handle, (unsigned int)colIdx, resObj, dsPtr, quote)
-                            != TCL_OK) {
-                        return TCL_ERROR;
-                    }
-                    break;
-                }
-                break;
+        /*
+         * Once the first row is rendered, grow the buffer for all the
+         * rows the driver expects, using the average row length of
+         * earlier calls or else the length of this row. An ADP buffer
+         * is only grown up to the size at which it is flushed.
+         */
 
-            default:
-                Ns_Fatal("DbiTclSubstTemplate: unexpected token type: %d",
-                         tokenPtr->type);
-                /*break;*/
+        if (numRows == 1 && handle->numRowsHint > 1 && stream == 0) {
+            presize = (Tcl_WideInt)(templatePtr->avgRowLength > 0
+                                    ? templatePtr->avgRowLength : rendered)
+                * handle->numRowsHint;
+            if (adp && presize > (Tcl_WideInt)maxBuffer) {
+                presize = (Tcl_WideInt)maxBuffer;
+            }
+            if (presize > MAX_PRESIZE) {
+                presize = MAX_PRESIZE;
+            }
+            len = Tcl_DStringLength(dsPtr);
+            if (presize > len) {
+                Tcl_DStringSetLength(dsPtr, (TCL_SIZE_T)presize);
+                Tcl_DStringSetLength(dsPtr, len);
             }
         }
 
@@ -311,125 +788,207 @@ DbiTclSubstTemplate(Tcl_Interp *interp, Dbi_Handle *handle,
          * mode or the buffer grows too large.
          */
 
-        if (dsPtr != NULL
+        if (adp
             && (stream != 0 || (dsPtr->length > (int)maxBuffer))
             && Ns_AdpFlush(interp, 1) != TCL_OK) {
-            return TCL_ERROR;
+            status = TCL_ERROR;
+            goto done;
         }
 
+        /*
+         * Hand the remaining rows to the parallel renderer once the
+         * Tcl variables are resolved.
+         */
+
+        if (numRows == 1 && parallel > 1 && groupIdx < 0
+            && CanRenderInParallel(templatePtr, &numCols)) {
+            status = AppendParallel(interp, handle, templatePtr, dsPtr, &values, quote,
+                                    parallel, adp, stream, maxBuffer, &numRows, &rendered);
+            break;
+        }
     }
 
-    if (numRows == 0) {
-        if (defaultObj != NULL) {
-            if (adp) {
-                char *def = Tcl_GetStringFromObj(defaultObj, &len);
+    if (status == TCL_OK) {
+        if (numRows == 0) {
+            if (defaultObj != NULL) {
+                if (adp) {
+                    char *def = Tcl_GetStringFromObj(defaultObj, &len);
 
-                if (Ns_AdpAppend(interp, def, len) != TCL_OK) {
-                    return TCL_ERROR;
+                    if (Ns_AdpAppend(interp, def, len) != TCL_OK) {
+                        status = TCL_ERROR;
+                    }
+                } else {
+                    Tcl_SetObjResult(interp, defaultObj);
                 }
             } else {
-                Tcl_SetObjResult(interp, defaultObj);
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("query was not a statement returning rows", -1));
+                status = TCL_ERROR;
             }
         } else {
-            Tcl_SetObjResult(interp, Tcl_NewStringObj("query was not a statement returning rows", -1));
-            return TCL_ERROR;
+            Tcl_DStringAppend(dsPtr, footer.string, Tcl_DStringLength(&footer));
+
+            /*
+             * Remember the row length for the next call, weighting
+             * this call as much as all earlier calls.
+             */
+
+            len = rendered / (TCL_SIZE_T)numRows;
+            templatePtr->avgRowLength = templatePtr->avgRowLength > 0
+                ? (templatePtr->avgRowLength + len) / 2 : len;
+            if (!adp) {
+                Tcl_DStringResult(interp, dsPtr);
+            }
         }
     }
 
-    return TCL_OK;
+ done:
+    if (!adp) {
+        Tcl_DStringFree(dsPtr);
+    }
+    Tcl_DStringFree(&scratch);
+    Tcl_DStringFree(&key);
+    Tcl_DStringFree(&footer);
+    Tcl_DStringFree(&values);
+    if (lengths != staticLengths) {
+        ns_free(lengths);
+    }
+    if (--templatePtr->refCount == 0) {
+        FreeTemplate(templatePtr);
+    }
+    if (headerPtr != NULL && --headerPtr->refCount == 0) {
+        FreeTemplate(headerPtr);
+    }
+    if (footerPtr != NULL && --footerPtr->refCount == 0) {
+        FreeTemplate(footerPtr);
+    }
+
+    return status;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * AppendValue --
+ * AppendTemplate --
+ *
+ *      Substitute a compiled template for the current row.
  *
- *      Append the string value of the given result row index to the
- *      Tcl result.
+ *      The template is run as a flat list of instructions. The length
+ *      of the literal text and column values of the row is computed
+ *      first so the output buffer grows at most once per row. Tcl
+ *      variables are copied from the values buffer filled by
+ *      ResolveTclVariables.
  *
  * Results:
- *      TCL_ERROR if the database complains, TCL_OK otherwise.
+ *      Standard Tcl result.
  *
  * Side effects:
- *      None.
+ *      The lengths array, which holds at least one slot per
+ *      instruction, is overwritten.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-AppendValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
-            Tcl_Obj *resObj, Tcl_DString *dsPtr, Dbi_quotingLevel quote)
+AppendTemplate(Tcl_Interp *interp, Dbi_Handle *handle, Template *templatePtr,
+               Tcl_DString *dsPtr, Tcl_DString *scratchPtr, size_t *lengths,
+               const Tcl_DString *valuesPtr, Dbi_quotingLevel quote)
 {
-    int         binary;
-    size_t      valueLength;
-    TCL_SIZE_T  resultLength;
-    char       *bytes;
+    const Op    *opPtr;
+    const char  *parity;
+    TCL_SIZE_T   len, rowLength;
+    int          binary, opIdx;
 
-    if (Dbi_ColumnLength(handle, index, &valueLength, &binary) != NS_OK) {
-        Dbi_TclErrorResult(interp, handle);
-        return TCL_ERROR;
-    }
-    if (binary) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("can't substitute binary value in template", -1));
-        return TCL_ERROR;
-    }
+    /*
+     * Size the row and grow the buffer once.
+     */
 
-    if (dsPtr) {
-        resultLength = dsPtr->length;
-        Tcl_DStringSetLength(dsPtr, (resultLength + (int)valueLength));
-        bytes = dsPtr->string + resultLength;
-    } else {
-        (void) Tcl_GetStringFromObj(resObj, &resultLength);
-        Tcl_SetObjLength(resObj, (resultLength + (int)valueLength));
-        bytes = resObj->bytes + resultLength;
+    rowLength = templatePtr->textLength;
+    for (opIdx = 0; opIdx < templatePtr->numOps; opIdx++) {
+        opPtr = &templatePtr->ops[opIdx];
+        if (opPtr->varType >= 0
+            && opPtr->modifier == MODIFIER_NONE
+            && opPtr->format == FORMAT_NONE) {
+            if (Dbi_ColumnLength(handle, (unsigned int)opPtr->varType,
+                                 &lengths[opIdx], &binary) != NS_OK) {
+                Dbi_TclErrorResult(interp, handle);
+                return TCL_ERROR;
+            }
+            if (binary) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("can't substitute binary value in template", -1));
+                return TCL_ERROR;
+            }
+            rowLength += (TCL_SIZE_T)lengths[opIdx];
+        } else if (opPtr->varType == VARTYPE_TCL) {
+            rowLength += opPtr->valueLength;
+        }
     }
+    len = Tcl_DStringLength(dsPtr);
+    Tcl_DStringSetLength(dsPtr, len + rowLength);
+    Tcl_DStringSetLength(dsPtr, len);
 
-    if (Dbi_ColumnValue(handle, index, bytes, valueLength) != NS_OK) {
-        Dbi_TclErrorResult(interp, handle);
-        return TCL_ERROR;
-    }
+    for (opIdx = 0; opIdx < templatePtr->numOps; opIdx++) {
+        opPtr = &templatePtr->ops[opIdx];
+
+        if (opPtr->varType == VARTYPE_TCL) {
+            Tcl_DStringAppend(dsPtr, valuesPtr->string + opPtr->valueStart, opPtr->valueLength);
+            continue;
+        }
+        if (opPtr->modifier != MODIFIER_NONE || opPtr->format != FORMAT_NONE) {
+            if (AppendModified(interp, handle, templatePtr, opPtr, dsPtr, scratchPtr,
+                               opPtr->quote < 0 ? quote : (Dbi_quotingLevel)opPtr->quote)
+                    != TCL_OK) {
+                return TCL_ERROR;
+            }
+            continue;
+        }
 
+        switch (opPtr->varType) {
+
+        case VARTYPE_TEXT:
+            Tcl_DStringAppend(dsPtr, templatePtr->text + opPtr->start, opPtr->length);
+            break;
 
-    if (quote != Dbi_QuoteNone) {
-        Tcl_DString ds, *dsPtr2 = &ds;
-        TCL_SIZE_T  quotedLength;
+        case VARTYPE_ROWIDX:
+            AppendInt(dsPtr, handle->rowIdx);
+            break;
 
-        Tcl_DStringInit(dsPtr2);
-        Quote(dsPtr2, bytes, quote);
-        quotedLength = Tcl_DStringLength(dsPtr2);
+        case VARTYPE_ROWNUM:
+            AppendInt(dsPtr, handle->rowIdx +1);
+            break;
 
-        /*
-         * If nothing has to be quoted, the sizes are identical, no
-         * need to copy result from quoteing
-         */
+        case VARTYPE_PARITY:
+            parity = handle->rowIdx % 2 == 0 ? "even" : "odd";
+            Tcl_DStringAppend(dsPtr, parity, TCL_INDEX_NONE);
+            break;
 
-        if (quotedLength != (int)valueLength) {
-            if (dsPtr) {
-                Tcl_DStringSetLength(dsPtr, (resultLength + quotedLength));
-                memcpy(dsPtr->string + resultLength, dsPtr2->string, (size_t)quotedLength);
-            } else {
-                Tcl_SetObjLength(resObj, (resultLength + quotedLength));
-                memcpy(resObj->bytes + resultLength, dsPtr2->string, (size_t)quotedLength);
+        default:
+            if (AppendColumn(interp, handle, (unsigned int)opPtr->varType,
+                             lengths[opIdx], dsPtr, scratchPtr,
+                             opPtr->quote < 0 ? quote : (Dbi_quotingLevel)opPtr->quote)
+                    != TCL_OK) {
+                return TCL_ERROR;
             }
+            break;
         }
-        Tcl_DStringFree(dsPtr2);
     }
 
     return TCL_OK;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * AppendTokenVariable --
+ * CanRenderInParallel --
  *
- *      Given a Tcl_Token of type TCL_TOKEN_VARIABLE, lookup the
- *      value and append it to the current result.
+ *      Check whether a template needs nothing but literal text,
+ *      resolved Tcl variables, the row number and plain column values,
+ *      and so can be rendered from a block of fetched rows.
  *
  * Results:
- *      TCL_ERROR if variable name does not resolve, TCL_OK otherwise.
+ *      1 if so, 0 otherwise. The number of column instructions is
+ *      returned in numColsPtr.
  *
  * Side effects:
  *      None.
@@ -438,95 +997,1427 @@ AppendValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
  */
 
 static int
-AppendTokenVariable(Tcl_Interp *interp, Tcl_Token *tokenPtr,
-                    Tcl_Obj *resObj, Tcl_DString *dsPtr, Dbi_quotingLevel quote)
+CanRenderInParallel(const Template *templatePtr, int *numColsPtr)
 {
-    Tcl_Obj   *objPtr;
-    char      *name, *value, save;
-    TCL_SIZE_T size;
-
-    /* NB: Skip past leading '$' */
-    name = (char *) tokenPtr->start + 1;
-    size = tokenPtr->size - 1;
-
-    save = name[size];
-    name[size] = '\0';
-    objPtr = Tcl_GetVar2Ex(interp, name, NULL, TCL_LEAVE_ERR_MSG);
-    if (objPtr == NULL) {
-        Tcl_ResetResult(interp);
-        Tcl_AppendResult(interp, "can't read \"", name,
-                         "\": no such column or variable", (char *)0L);
-        name[size] = save;
-
-        return TCL_ERROR;
-    }
-    name[size] = save;
-    value = Tcl_GetStringFromObj(objPtr, &size);
-
-    if (dsPtr) {
-        Quote(dsPtr, value, quote);
-    } else {
-        if (quote != Dbi_QuoteNone) {
-            Tcl_DString ds1, *ds1Ptr = &ds1;
-
-            Tcl_DStringInit(ds1Ptr);
-            Quote(ds1Ptr, value, quote);
-            Tcl_AppendToObj(resObj,
-                            ds1Ptr->string,
-                            ds1Ptr->length);
-            Tcl_DStringFree(ds1Ptr);
-        } else {
-            Tcl_AppendObjToObj(resObj, objPtr);
+    const Op *opPtr;
+    int       opIdx;
+
+    *numColsPtr = 0;
+    for (opIdx = 0; opIdx < templatePtr->numOps; opIdx++) {
+        opPtr = &templatePtr->ops[opIdx];
+        if (opPtr->varType >= 0) {
+            if (opPtr->modifier != MODIFIER_NONE || opPtr->format != FORMAT_NONE) {
+                return 0;
+            }
+            (*numColsPtr)++;
         }
     }
-
-    return TCL_OK;
+    return 1;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * AppendInt --
+ * AppendParallel --
+ *
+ *      Render the remaining rows of the result in blocks. Each block
+ *      of up to BLOCK_ROWS rows is fetched by this thread, then split
+ *      into up to parallel chunks of consecutive rows, each rendered
+ *      into its own buffer. The buffers are appended in order.
  *
- *      Append the string rep of the given int to the result buffer.
+ *      Chunks are queued for free threads of the render pool. This
+ *      thread renders the first chunk, and any others for which no
+ *      pool thread was free, then waits for the queued ones.
+ *
+ *      Fetching is no faster than before, but quoting and assembling
+ *      the rows is spread over the threads.
  *
  * Results:
- *      None.
+ *      Standard Tcl result. The number of rows and bytes rendered are
+ *      added to numRowsPtr and renderedPtr.
  *
  * Side effects:
- *      None.
+ *      The ADP buffer is flushed after each block as for single rows.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-AppendInt(Tcl_Interp *UNUSED(interp), unsigned int rowint,
-          Tcl_Obj *resObj, Tcl_DString *dsPtr)
+static int
+AppendParallel(Tcl_Interp *interp, Dbi_Handle *handle, const Template *templatePtr,
+               Tcl_DString *dsPtr, const Tcl_DString *valuesPtr,
+               Dbi_quotingLevel quote, int parallel, int adp, int stream,
+               size_t maxBuffer, unsigned int *numRowsPtr, TCL_SIZE_T *renderedPtr)
 {
-    char buf[TCL_INTEGER_SPACE];
+    Block       block;
+    Chunk       chunks[MAX_CHUNKS];
+    TCL_SIZE_T  start;
+    int         numChunks, numQueued, chunkRows, i, end = 0, status = TCL_OK;
 
-    snprintf(buf, sizeof(buf), "%u", rowint);
-    if (dsPtr) {
-        Tcl_DStringAppend(dsPtr, buf, TCL_INDEX_NONE);
-    } else {
-        Tcl_AppendToObj(resObj, buf, TCL_INDEX_NONE);
+    if (parallel > MAX_CHUNKS) {
+        parallel = MAX_CHUNKS;
     }
-}
 
-
-/*
+    block.templatePtr = templatePtr;
+    block.valuesPtr = valuesPtr;
+    block.quote = quote;
+    (void) CanRenderInParallel(templatePtr, &block.numCols);
+    block.spans = ns_malloc((size_t)BLOCK_ROWS * (size_t)block.numCols * 2u
+                            * sizeof(TCL_SIZE_T) + 1u);
+    Tcl_DStringInit(&block.data);
+
+    while (!end) {
+        if (FetchBlock(interp, handle, &block, &end) != TCL_OK) {
+            status = TCL_ERROR;
+            break;
+        }
+        if (block.numRows == 0) {
+            break;
+        }
+
+        /*
+         * Split the block in chunks of at least MIN_CHUNK_ROWS, the
+         * first of which is rendered straight into the output.
+         */
+
+        numChunks = block.numRows / MIN_CHUNK_ROWS;
+        if (numChunks > parallel) {
+            numChunks = parallel;
+        } else if (numChunks < 1) {
+            numChunks = 1;
+        }
+        chunkRows = (block.numRows + numChunks - 1) / numChunks;
+
+        for (i = 0; i < numChunks; i++) {
+            chunks[i].blockPtr = &block;
+            chunks[i].firstRow = i * chunkRows;
+            chunks[i].lastRow = (i + 1) * chunkRows;
+            if (chunks[i].lastRow > block.numRows) {
+                chunks[i].lastRow = block.numRows;
+            }
+            if (i == 0) {
+                chunks[i].dsPtr = dsPtr;
+            } else {
+                Tcl_DStringInit(&chunks[i].ds);
+                chunks[i].dsPtr = &chunks[i].ds;
+            }
+        }
+
+        /*
+         * Queue chunks after the first for the free pool threads.
+         * Nothing is queued once the pool is stopping: the threads
+         * may already have exited.
+         */
+
+        Ns_MutexLock(&renderPool.lock);
+        numQueued = renderPool.stopping ? 0 : numChunks - 1;
+        if (numQueued > renderPool.numFree) {
+            numQueued = renderPool.numFree;
+        }
+        renderPool.numFree -= numQueued;
+        for (i = 1; i <= numQueued; i++) {
+            chunks[i].nextPtr = NULL;
+            chunks[i].done = 0;
+            if (renderPool.lastPtr == NULL) {
+                renderPool.firstPtr = &chunks[i];
+            } else {
+                renderPool.lastPtr->nextPtr = &chunks[i];
+            }
+            renderPool.lastPtr = &chunks[i];
+        }
+        if (numQueued > 0) {
+            Ns_CondBroadcast(&renderPool.queueCond);
+        }
+        Ns_MutexUnlock(&renderPool.lock);
+
+        start = Tcl_DStringLength(dsPtr);
+        RenderChunk(&chunks[0]);
+        for (i = numQueued + 1; i < numChunks; i++) {
+            RenderChunk(&chunks[i]);
+        }
+        if (numQueued > 0) {
+            Ns_MutexLock(&renderPool.lock);
+            for (i = 1; i <= numQueued; i++) {
+                while (!chunks[i].done) {
+                    Ns_CondWait(&renderPool.doneCond, &renderPool.lock);
+                }
+            }
+            Ns_MutexUnlock(&renderPool.lock);
+        }
+        for (i = 1; i < numChunks; i++) {
+            Tcl_DStringAppend(dsPtr, chunks[i].ds.string, Tcl_DStringLength(&chunks[i].ds));
+            Tcl_DStringFree(&chunks[i].ds);
+        }
+
+        *numRowsPtr += (unsigned int)block.numRows;
+        *renderedPtr += Tcl_DStringLength(dsPtr) - start;
+
+        if (adp
+            && (stream != 0 || (dsPtr->length > (int)maxBuffer))
+            && Ns_AdpFlush(interp, 1) != TCL_OK) {
+            status = TCL_ERROR;
+            break;
+        }
+    }
+
+    Tcl_DStringFree(&block.data);
+    ns_free(block.spans);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FetchBlock --
+ *
+ *      Fetch up to BLOCK_ROWS rows, copying the values of the column
+ *      instructions of the template into the block. A NULL to be
+ *      quoted for sql is recorded with a length of -1.
+ *
+ * Results:
+ *      Standard Tcl result. *endPtr is set to 1 if the end of the
+ *      result was reached.
+ *
+ * Side effects:
+ *      The block is overwritten.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+FetchBlock(Tcl_Interp *interp, Dbi_Handle *handle, Block *blockPtr, int *endPtr)
+{
+    const Template *templatePtr = blockPtr->templatePtr;
+    const Op       *opPtr;
+    Dbi_Value       value;
+    TCL_SIZE_T     *spans = blockPtr->spans, offset;
+    size_t          length;
+    int             binary, opIdx;
+
+    blockPtr->numRows = 0;
+    Tcl_DStringSetLength(&blockPtr->data, 0);
+
+    while (blockPtr->numRows < BLOCK_ROWS) {
+        if (NextRow(interp, handle, endPtr) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (*endPtr) {
+            break;
+        }
+        if (blockPtr->numRows == 0) {
+            blockPtr->rowIdx = handle->rowIdx;
+        }
+        for (opIdx = 0; opIdx < templatePtr->numOps; opIdx++) {
+            opPtr = &templatePtr->ops[opIdx];
+            if (opPtr->varType < 0) {
+                continue;
+            }
+            if (Dbi_ColumnLength(handle, (unsigned int)opPtr->varType,
+                                 &length, &binary) != NS_OK) {
+                Dbi_TclErrorResult(interp, handle);
+                return TCL_ERROR;
+            }
+            if (binary) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("can't substitute binary value in template", -1));
+                return TCL_ERROR;
+            }
+            offset = Tcl_DStringLength(&blockPtr->data);
+            Tcl_DStringSetLength(&blockPtr->data, offset + (TCL_SIZE_T)length);
+            if (Dbi_ColumnValue(handle, (unsigned int)opPtr->varType,
+                                blockPtr->data.string + offset, length) != NS_OK) {
+                Dbi_TclErrorResult(interp, handle);
+                return TCL_ERROR;
+            }
+            *spans++ = offset;
+            *spans++ = (TCL_SIZE_T)length;
+
+            if (length == 0u
+                && (opPtr->quote < 0 ? blockPtr->quote : (Dbi_quotingLevel)opPtr->quote)
+                   == Dbi_QuoteSQL) {
+                if (Dbi_ColumnTypedValue(handle, (unsigned int)opPtr->varType,
+                                         &value) != NS_OK) {
+                    Dbi_TclErrorResult(interp, handle);
+                    return TCL_ERROR;
+                }
+                if (value.type == DBI_VALUE_NULL) {
+                    spans[-1] = -1;
+                }
+            }
+        }
+        blockPtr->numRows++;
+    }
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RenderChunk --
+ *
+ *      Render the rows of a chunk of a block into its output buffer.
+ *      Only the block and the compiled template are read, so chunks
+ *      may be rendered by concurrent threads.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RenderChunk(Chunk *chunkPtr)
+{
+    const Block      *blockPtr = chunkPtr->blockPtr;
+    const Template   *templatePtr = blockPtr->templatePtr;
+    const Op         *opPtr;
+    const TCL_SIZE_T *spans, *last;
+    Tcl_DString      *dsPtr = chunkPtr->dsPtr;
+    TCL_SIZE_T        len, dataLength = 0;
+    unsigned int      rowIdx;
+    int               row, opIdx;
+
+    /*
+     * Grow the buffer for the unquoted size of the chunk. The values
+     * of consecutive rows are contiguous in the data buffer.
+     */
+
+    spans = blockPtr->spans + (size_t)chunkPtr->firstRow * (size_t)blockPtr->numCols * 2u;
+    if (blockPtr->numCols > 0) {
+        last = blockPtr->spans + (size_t)chunkPtr->lastRow * (size_t)blockPtr->numCols * 2u - 2;
+        dataLength = last[0] + (last[1] > 0 ? last[1] : 0) - spans[0];
+    }
+    len = Tcl_DStringLength(dsPtr);
+    Tcl_DStringSetLength(dsPtr, len + dataLength
+                         + templatePtr->textLength * (chunkPtr->lastRow - chunkPtr->firstRow));
+    Tcl_DStringSetLength(dsPtr, len);
+
+    for (row = chunkPtr->firstRow; row < chunkPtr->lastRow; row++) {
+        rowIdx = blockPtr->rowIdx + (unsigned int)row;
+
+        for (opIdx = 0; opIdx < templatePtr->numOps; opIdx++) {
+            opPtr = &templatePtr->ops[opIdx];
+
+            switch (opPtr->varType) {
+
+            case VARTYPE_TEXT:
+                Tcl_DStringAppend(dsPtr, templatePtr->text + opPtr->start, opPtr->length);
+                break;
+
+            case VARTYPE_TCL:
+                Tcl_DStringAppend(dsPtr, blockPtr->valuesPtr->string + opPtr->valueStart,
+                                  opPtr->valueLength);
+                break;
+
+            case VARTYPE_ROWIDX:
+                AppendInt(dsPtr, rowIdx);
+                break;
+
+            case VARTYPE_ROWNUM:
+                AppendInt(dsPtr, rowIdx + 1);
+                break;
+
+            case VARTYPE_PARITY:
+                Tcl_DStringAppend(dsPtr, rowIdx % 2 == 0 ? "even" : "odd", TCL_INDEX_NONE);
+                break;
+
+            default:
+                if (spans[1] < 0) {
+                    Tcl_DStringAppend(dsPtr, "NULL", 4);
+                } else {
+                    Quote(dsPtr, blockPtr->data.string + spans[0], spans[1],
+                          opPtr->quote < 0 ? blockPtr->quote : (Dbi_quotingLevel)opPtr->quote);
+                }
+                spans += 2;
+                break;
+            }
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DbiRenderPoolInit --
+ *
+ *      Create the threads of the render pool. With no threads all
+ *      templates are rendered serially.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Threads are created which run until server shutdown.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+DbiRenderPoolInit(int numThreads)
+{
+    Ns_MutexInit(&renderPool.lock);
+    Ns_MutexSetName(&renderPool.lock, "dbi:render");
+    Ns_CondInit(&renderPool.queueCond);
+    Ns_CondInit(&renderPool.doneCond);
+
+    Ns_RegisterAtShutdown(RenderPoolShutdown, NULL);
+    (void) DbiRenderThreads(numThreads);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DbiRenderThreads --
+ *
+ *      Get or set the number of render pool threads. Threads beyond
+ *      the new number exit once the queue is empty.
+ *
+ * Results:
+ *      The previous number of threads.
+ *
+ * Side effects:
+ *      Threads may be created. None once the server is shutting down.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+DbiRenderThreads(int numThreads)
+{
+    int oldThreads;
+
+    Ns_MutexLock(&renderPool.lock);
+    oldThreads = renderPool.maxThreads;
+    if (numThreads >= 0 && !renderPool.stopping) {
+        renderPool.maxThreads = numThreads;
+        while (renderPool.numThreads < renderPool.maxThreads) {
+            renderPool.numThreads++;
+            renderPool.numFree++;
+            Ns_ThreadCreate(RenderThread, NULL, 0, NULL);
+        }
+        Ns_CondBroadcast(&renderPool.queueCond);
+    }
+    Ns_MutexUnlock(&renderPool.lock);
+
+    return oldThreads;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RenderThread --
+ *
+ *      Render queued chunks until the server shuts down or the pool
+ *      is shrunk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Marks each chunk done and wakes the waiting templates. An
+ *      exiting thread is no longer counted free, so no chunk is
+ *      queued for it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RenderThread(void *UNUSED(arg))
+{
+    Chunk *chunkPtr;
+
+    Ns_ThreadSetName("-dbi:render-");
+
+    Ns_MutexLock(&renderPool.lock);
+    for (;;) {
+        while (renderPool.firstPtr == NULL
+               && !renderPool.stopping
+               && renderPool.numThreads <= renderPool.maxThreads) {
+            Ns_CondWait(&renderPool.queueCond, &renderPool.lock);
+        }
+        if (renderPool.firstPtr == NULL) {
+            renderPool.numThreads--;
+            renderPool.numFree--;
+            break;
+        }
+        chunkPtr = renderPool.firstPtr;
+        renderPool.firstPtr = chunkPtr->nextPtr;
+        if (renderPool.firstPtr == NULL) {
+            renderPool.lastPtr = NULL;
+        }
+        Ns_MutexUnlock(&renderPool.lock);
+
+        RenderChunk(chunkPtr);
+
+        Ns_MutexLock(&renderPool.lock);
+        chunkPtr->done = 1;
+        renderPool.numFree++;
+        Ns_CondBroadcast(&renderPool.doneCond);
+    }
+    Ns_MutexUnlock(&renderPool.lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RenderPoolShutdown --
+ *
+ *      Let the render threads exit once the queue is empty.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RenderPoolShutdown(const Ns_Time *toPtr, void *UNUSED(arg))
+{
+    if (toPtr == NULL) {
+        Ns_MutexLock(&renderPool.lock);
+        renderPool.stopping = 1;
+        Ns_CondBroadcast(&renderPool.queueCond);
+        Ns_MutexUnlock(&renderPool.lock);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResolveTclVariables --
+ *
+ *      Look up the Tcl variables of the template and append their
+ *      quoted, formatted or defaulted values to the values buffer,
+ *      recording where each is in its instruction.
+ *
+ * Results:
+ *      TCL_ERROR if a variable is unset and has no default, or does
+ *      not match its format, TCL_OK otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ResolveTclVariables(Tcl_Interp *interp, Dbi_Handle *handle, Template *templatePtr,
+                    Tcl_DString *valuesPtr, Tcl_DString *scratchPtr,
+                    Dbi_quotingLevel quote)
+{
+    Op               *opPtr;
+    Dbi_quotingLevel  opQuote;
+    int               opIdx, status;
+
+    for (opIdx = 0; opIdx < templatePtr->numOps; opIdx++) {
+        opPtr = &templatePtr->ops[opIdx];
+        if (opPtr->varType != VARTYPE_TCL) {
+            continue;
+        }
+        opQuote = opPtr->quote < 0 ? quote : (Dbi_quotingLevel)opPtr->quote;
+        opPtr->valueStart = Tcl_DStringLength(valuesPtr);
+        if (opPtr->modifier != MODIFIER_NONE || opPtr->format != FORMAT_NONE) {
+            status = AppendModified(interp, handle, templatePtr, opPtr, valuesPtr,
+                                    scratchPtr, opQuote);
+        } else {
+            status = AppendTclVariable(interp, opPtr, valuesPtr, opQuote);
+        }
+        if (status != TCL_OK) {
+            return TCL_ERROR;
+        }
+        opPtr->valueLength = Tcl_DStringLength(valuesPtr) - opPtr->valueStart;
+    }
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindColumn --
+ *
+ *      Find a result column by name.
+ *
+ * Results:
+ *      The column index, or -1 if there is no such column.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+FindColumn(Dbi_Handle *handle, const char *name)
+{
+    const char   *colName;
+    unsigned int  colIdx, numCols;
+
+    numCols = Dbi_NumColumns(handle);
+    for (colIdx = 0; colIdx < numCols; colIdx++) {
+        if (Dbi_ColumnName(handle, colIdx, &colName) == NS_OK
+            && STREQ(colName, name)) {
+            return (int)colIdx;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DbiTclSubstJson --
+ *
+ *      Serialise the rows of the pending db result as a JSON array of
+ *      objects, or of arrays if arrays is true, and append it to the
+ *      ADP output buffer or set it as the Tcl result.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+DbiTclSubstJson(Tcl_Interp *interp, Dbi_Handle *handle, int arrays, int adp)
+{
+    Tcl_DString    ds, keys, *dsPtr;
+    TCL_SIZE_T    *keyOffsets = NULL;
+    unsigned int   colIdx, numCols, numRows;
+    int            end, stream = 0, status = TCL_OK;
+    size_t         maxBuffer = 0u;
+
+    numCols = Dbi_NumColumns(handle);
+
+    /*
+     * Quote the column names once as "name": prefixes.
+     */
+
+    Tcl_DStringInit(&keys);
+    if (!arrays) {
+        keyOffsets = ns_malloc((numCols + 1) * sizeof(TCL_SIZE_T));
+        for (colIdx = 0; colIdx < numCols; colIdx++) {
+            const char *name;
+
+            if (Dbi_ColumnName(handle, colIdx, &name) != NS_OK) {
+                Dbi_TclErrorResult(interp, handle);
+                Tcl_DStringFree(&keys);
+                ns_free(keyOffsets);
+                return TCL_ERROR;
+            }
+            keyOffsets[colIdx] = Tcl_DStringLength(&keys);
+            Quote(&keys, name, (TCL_SIZE_T)strlen(name), Dbi_QuoteJSON);
+            Tcl_DStringAppend(&keys, ":", 1);
+        }
+        keyOffsets[numCols] = Tcl_DStringLength(&keys);
+    }
+
+    /*
+     * Append directly to the ADP output buffer or to a local buffer
+     * which becomes the Tcl result.
+     */
+
+    if (adp) {
+        if (Ns_AdpGetOutput(interp, &dsPtr, &stream, &maxBuffer) != TCL_OK) {
+            Tcl_DStringFree(&keys);
+            ns_free(keyOffsets);
+            return TCL_ERROR;
+        }
+    } else {
+        dsPtr = &ds;
+        Tcl_DStringInit(dsPtr);
+    }
+
+    Tcl_DStringAppend(dsPtr, "[", 1);
+    numRows = 0;
+
+    while ((status = NextRow(interp, handle, &end)) == TCL_OK && !end) {
+
+        if (numRows++ > 0) {
+            Tcl_DStringAppend(dsPtr, ",", 1);
+        }
+        Tcl_DStringAppend(dsPtr, arrays ? "[" : "{", 1);
+
+        for (colIdx = 0; colIdx < numCols; colIdx++) {
+            if (colIdx > 0) {
+                Tcl_DStringAppend(dsPtr, ",", 1);
+            }
+            if (!arrays) {
+                Tcl_DStringAppend(dsPtr, keys.string + keyOffsets[colIdx],
+                                  keyOffsets[colIdx + 1] - keyOffsets[colIdx]);
+            }
+            if (AppendJsonValue(interp, handle, colIdx, dsPtr) != TCL_OK) {
+                status = TCL_ERROR;
+                goto done;
+            }
+        }
+        Tcl_DStringAppend(dsPtr, arrays ? "]" : "}", 1);
+
+        /*
+         * Flush the ADP buffer as for templates.
+         */
+
+        if (adp
+            && (stream != 0 || (dsPtr->length > (int)maxBuffer))
+            && Ns_AdpFlush(interp, 1) != TCL_OK) {
+            status = TCL_ERROR;
+            goto done;
+        }
+    }
+
+    if (status == TCL_OK) {
+        Tcl_DStringAppend(dsPtr, "]", 1);
+        if (!adp) {
+            Tcl_DStringResult(interp, dsPtr);
+        }
+    }
+
+ done:
+    if (!adp) {
+        Tcl_DStringFree(dsPtr);
+    }
+    Tcl_DStringFree(&keys);
+    if (keyOffsets != NULL) {
+        ns_free(keyOffsets);
+    }
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendJsonValue --
+ *
+ *      Append the given column of the current row as a JSON value.
+ *      Native numbers and booleans are written as such, SQL NULL as
+ *      null and everything else as a quoted string.
+ *
+ * Results:
+ *      TCL_ERROR if the database complains or the value is binary,
+ *      TCL_OK otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AppendJsonValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
+                Tcl_DString *dsPtr)
+{
+    Dbi_Value   value;
+    Tcl_DString scratch;
+    char        buf[TCL_DOUBLE_SPACE + TCL_INTEGER_SPACE];
+
+    if (Dbi_ColumnTypedValue(handle, index, &value) != NS_OK) {
+        Dbi_TclErrorResult(interp, handle);
+        return TCL_ERROR;
+    }
+
+    switch (value.type) {
+    case DBI_VALUE_NULL:
+        Tcl_DStringAppend(dsPtr, "null", 4);
+        return TCL_OK;
+    case DBI_VALUE_INT:
+        snprintf(buf, sizeof(buf), "%d", value.v.i);
+        Tcl_DStringAppend(dsPtr, buf, TCL_INDEX_NONE);
+        return TCL_OK;
+    case DBI_VALUE_BOOL:
+        Tcl_DStringAppend(dsPtr, value.v.i ? "true" : "false", TCL_INDEX_NONE);
+        return TCL_OK;
+    case DBI_VALUE_WIDE:
+        snprintf(buf, sizeof(buf), "%" TCL_LL_MODIFIER "d", value.v.w);
+        Tcl_DStringAppend(dsPtr, buf, TCL_INDEX_NONE);
+        return TCL_OK;
+    case DBI_VALUE_DOUBLE:
+        if (isfinite(value.v.d)) {
+            Tcl_PrintDouble(NULL, value.v.d, buf);
+            Tcl_DStringAppend(dsPtr, buf, TCL_INDEX_NONE);
+        } else {
+            Tcl_DStringAppend(dsPtr, "null", 4);
+        }
+        return TCL_OK;
+    case DBI_VALUE_TIMESTAMP:
+        FormatTimestamp(&value.v.t, buf, sizeof(buf));
+        Tcl_DStringAppend(dsPtr, buf, TCL_INDEX_NONE);
+        return TCL_OK;
+    case DBI_VALUE_BYTES:
+        Ns_TclPrintfResult(interp, "can't serialise binary value as %s", "JSON");
+        return TCL_ERROR;
+    case DBI_VALUE_STRING:
+        break;
+    }
+
+    Tcl_DStringInit(&scratch);
+    if (GetStringValue(interp, handle, index, &scratch, "JSON") != TCL_OK) {
+        Tcl_DStringFree(&scratch);
+        return TCL_ERROR;
+    }
+    Quote(dsPtr, scratch.string, Tcl_DStringLength(&scratch), Dbi_QuoteJSON);
+    Tcl_DStringFree(&scratch);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DbiTclSubstCsv --
+ *
+ *      Write the pending db result as CSV: a header line of column
+ *      names followed by one line per row, CRLF terminated. Fields
+ *      are quoted when they contain the delimiter, a double quote or
+ *      a line break, or always if quoteAll is true. SQL NULLs are
+ *      written as empty, unquoted fields.
+ *
+ *      With adp the output is appended to the ADP output buffer which
+ *      is flushed as for templates, so large exports are streamed to
+ *      the client rather than built in memory.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+DbiTclSubstCsv(Tcl_Interp *interp, Dbi_Handle *handle, char delimiter, int quoteAll, int adp)
+{
+    Tcl_DString    ds, scratch, *dsPtr;
+    unsigned int   colIdx, numCols;
+    int            end, stream = 0, status = TCL_OK;
+    size_t         maxBuffer = 0u;
+
+    numCols = Dbi_NumColumns(handle);
+
+    if (adp) {
+        if (Ns_AdpGetOutput(interp, &dsPtr, &stream, &maxBuffer) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    } else {
+        dsPtr = &ds;
+        Tcl_DStringInit(dsPtr);
+    }
+    Tcl_DStringInit(&scratch);
+
+    for (colIdx = 0; colIdx < numCols; colIdx++) {
+        const char *name;
+
+        if (Dbi_ColumnName(handle, colIdx, &name) != NS_OK) {
+            Dbi_TclErrorResult(interp, handle);
+            status = TCL_ERROR;
+            goto done;
+        }
+        if (colIdx > 0) {
+            Tcl_DStringAppend(dsPtr, &delimiter, 1);
+        }
+        QuoteCsv(dsPtr, name, strlen(name), delimiter, quoteAll);
+    }
+    Tcl_DStringAppend(dsPtr, "\r\n", 2);
+
+    while ((status = NextRow(interp, handle, &end)) == TCL_OK && !end) {
+
+        for (colIdx = 0; colIdx < numCols; colIdx++) {
+            if (colIdx > 0) {
+                Tcl_DStringAppend(dsPtr, &delimiter, 1);
+            }
+            if (AppendCsvValue(interp, handle, colIdx, dsPtr, &scratch,
+                               delimiter, quoteAll) != TCL_OK) {
+                status = TCL_ERROR;
+                goto done;
+            }
+        }
+        Tcl_DStringAppend(dsPtr, "\r\n", 2);
+
+        if (adp
+            && (stream != 0 || (dsPtr->length > (int)maxBuffer))
+            && Ns_AdpFlush(interp, 1) != TCL_OK) {
+            status = TCL_ERROR;
+            goto done;
+        }
+    }
+
+    if (status == TCL_OK && !adp) {
+        Tcl_DStringResult(interp, dsPtr);
+    }
+
+ done:
+    if (!adp) {
+        Tcl_DStringFree(dsPtr);
+    }
+    Tcl_DStringFree(&scratch);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendCsvValue --
+ *
+ *      Append the given column of the current row as a CSV field,
+ *      using scratchPtr as a buffer for the unquoted value.
+ *
+ * Results:
+ *      TCL_ERROR if the database complains or the value is binary,
+ *      TCL_OK otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AppendCsvValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
+               Tcl_DString *dsPtr, Tcl_DString *scratchPtr,
+               char delimiter, int quoteAll)
+{
+    Dbi_Value value;
+    char      buf[TCL_DOUBLE_SPACE + TCL_INTEGER_SPACE];
+
+    if (Dbi_ColumnTypedValue(handle, index, &value) != NS_OK) {
+        Dbi_TclErrorResult(interp, handle);
+        return TCL_ERROR;
+    }
+
+    /*
+     * Native values are formatted as their Tcl string rep and never
+     * need quoting.
+     */
+
+    switch (value.type) {
+    case DBI_VALUE_NULL:
+        return TCL_OK;
+    case DBI_VALUE_INT:
+    case DBI_VALUE_BOOL:
+        snprintf(buf, sizeof(buf), "%d", value.v.i);
+        break;
+    case DBI_VALUE_WIDE:
+        snprintf(buf, sizeof(buf), "%" TCL_LL_MODIFIER "d", value.v.w);
+        break;
+    case DBI_VALUE_DOUBLE:
+        Tcl_PrintDouble(NULL, value.v.d, buf);
+        break;
+    case DBI_VALUE_TIMESTAMP:
+        FormatTimestamp(&value.v.t, buf, sizeof(buf));
+        break;
+    case DBI_VALUE_BYTES:
+        Ns_TclPrintfResult(interp, "can't serialise binary value as %s", "CSV");
+        return TCL_ERROR;
+    case DBI_VALUE_STRING:
+        Tcl_DStringSetLength(scratchPtr, 0);
+        if (GetStringValue(interp, handle, index, scratchPtr, "CSV") != TCL_OK) {
+            return TCL_ERROR;
+        }
+        QuoteCsv(dsPtr, scratchPtr->string, (size_t)Tcl_DStringLength(scratchPtr),
+                 delimiter, quoteAll);
+        return TCL_OK;
+    }
+
+    QuoteCsv(dsPtr, buf, strlen(buf), delimiter, quoteAll);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FormatTimestamp --
+ *
+ *      Format a timestamp for JSON and CSV as seconds since the epoch
+ *      with six decimals, e.g. 1000000000.500000, which spreadsheets
+ *      and loaders read as a number.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The string is written to buf.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FormatTimestamp(const Ns_Time *timePtr, char *buf, size_t size)
+{
+    snprintf(buf, size, "%ld.%06ld", (long) timePtr->sec, timePtr->usec);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QuoteCsv --
+ *
+ *      Append a CSV field to the first argument, enclosed in double
+ *      quotes with embedded quotes doubled if needed or requested.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+QuoteCsv(Tcl_DString *dsPtr, const char *string, size_t length,
+         char delimiter, int quoteAll)
+{
+    const char *p, *end = string + length, *start = string;
+
+    if (!quoteAll) {
+        for (p = string; p < end; p++) {
+            if (*p == delimiter || *p == '"' || *p == '\n' || *p == '\r') {
+                break;
+            }
+        }
+        if (p == end) {
+            Tcl_DStringAppend(dsPtr, string, (TCL_SIZE_T)length);
+            return;
+        }
+    }
+
+    Tcl_DStringAppend(dsPtr, "\"", 1);
+    for (p = string; p < end; p++) {
+        if (*p == '"') {
+            Tcl_DStringAppend(dsPtr, start, (TCL_SIZE_T)(p - start + 1));
+            start = p;
+        }
+    }
+    Tcl_DStringAppend(dsPtr, start, (TCL_SIZE_T)(end - start));
+    Tcl_DStringAppend(dsPtr, "\"", 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetStringValue --
+ *
+ *      Fetch the string value of the given column of the current row
+ *      into the empty DString.
+ *
+ * Results:
+ *      TCL_ERROR if the database complains or the value is binary,
+ *      TCL_OK otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+GetStringValue(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
+               Tcl_DString *dsPtr, const char *format)
+{
+    size_t valueLength;
+    int    binary;
+
+    if (Dbi_ColumnLength(handle, index, &valueLength, &binary) != NS_OK) {
+        Dbi_TclErrorResult(interp, handle);
+        return TCL_ERROR;
+    }
+    if (binary) {
+        Ns_TclPrintfResult(interp, "can't serialise binary value as %s", format);
+        return TCL_ERROR;
+    }
+    Tcl_DStringSetLength(dsPtr, (TCL_SIZE_T)valueLength);
+    if (Dbi_ColumnValue(handle, index, dsPtr->string, valueLength) != NS_OK) {
+        Dbi_TclErrorResult(interp, handle);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendColumn --
+ *
+ *      Append the string value of the given column of the current row,
+ *      which is length bytes long, to the output buffer. A NULL is
+ *      appended as the keyword NULL when quoting for sql.
+ *
+ * Results:
+ *      TCL_ERROR if the database complains, TCL_OK otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AppendColumn(Tcl_Interp *interp, Dbi_Handle *handle, unsigned int index,
+             size_t length, Tcl_DString *dsPtr, Tcl_DString *scratchPtr,
+             Dbi_quotingLevel quote)
+{
+    Dbi_Value  value;
+    TCL_SIZE_T offset;
+
+    if (quote == Dbi_QuoteSQL && length == 0u) {
+        if (Dbi_ColumnTypedValue(handle, index, &value) != NS_OK) {
+            Dbi_TclErrorResult(interp, handle);
+            return TCL_ERROR;
+        }
+        if (value.type == DBI_VALUE_NULL) {
+            Tcl_DStringAppend(dsPtr, "NULL", 4);
+            return TCL_OK;
+        }
+    }
+
+    /*
+     * Fetch unquoted values in place, others into the scratch buffer
+     * to be quoted into the output in a single pass.
+     */
+
+    if (quote == Dbi_QuoteNone) {
+        offset = Tcl_DStringLength(dsPtr);
+        Tcl_DStringSetLength(dsPtr, offset + (TCL_SIZE_T)length);
+        if (Dbi_ColumnValue(handle, index, dsPtr->string + offset, length) != NS_OK) {
+            Dbi_TclErrorResult(interp, handle);
+            return TCL_ERROR;
+        }
+    } else {
+        Tcl_DStringSetLength(scratchPtr, (TCL_SIZE_T)length);
+        if (Dbi_ColumnValue(handle, index, scratchPtr->string, length) != NS_OK) {
+            Dbi_TclErrorResult(interp, handle);
+            return TCL_ERROR;
+        }
+        Quote(dsPtr, scratchPtr->string, (TCL_SIZE_T)length, quote);
+    }
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendTclVariable --
+ *
+ *      Lookup the value of the Tcl variable of the given instruction
+ *      and append it to the output buffer.
+ *
+ * Results:
+ *      TCL_ERROR if variable name does not resolve, TCL_OK otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AppendTclVariable(Tcl_Interp *interp, const Op *opPtr,
+                  Tcl_DString *dsPtr, Dbi_quotingLevel quote)
+{
+    Tcl_Obj    *objPtr;
+    const char *value;
+    TCL_SIZE_T  length;
+
+    objPtr = Tcl_ObjGetVar2(interp, opPtr->nameObj, NULL, 0);
+    if (objPtr == NULL) {
+        Ns_TclPrintfResult(interp, "can't read \"%s\": no such column or variable",
+                           Tcl_GetString(opPtr->nameObj));
+        return TCL_ERROR;
+    }
+    value = Tcl_GetStringFromObj(objPtr, &length);
+    Quote(dsPtr, value, length, quote);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendModified --
+ *
+ *      Append a variable with a default, conditional or numeric
+ *      format. NULL column values and unset Tcl variables are NULL.
+ *      The default and conditional texts are appended as they are,
+ *      only values are quoted.
+ *
+ * Results:
+ *      TCL_ERROR if the database complains, the value is binary, a
+ *      Tcl variable without a default is unset or a value does not
+ *      match the format, TCL_OK otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AppendModified(Tcl_Interp *interp, Dbi_Handle *handle, const Template *templatePtr,
+               const Op *opPtr, Tcl_DString *dsPtr, Tcl_DString *scratchPtr,
+               Dbi_quotingLevel quote)
+{
+    Dbi_Value    value;
+    Tcl_Obj     *objPtr;
+    const char  *string = "";
+    TCL_SIZE_T   length = 0;
+    size_t       valueLength;
+    int          binary, isNull = 0;
+    unsigned int index;
+
+    value.type = DBI_VALUE_STRING;
+
+    switch (opPtr->varType) {
+
+    case VARTYPE_TCL:
+        objPtr = Tcl_ObjGetVar2(interp, opPtr->nameObj, NULL, 0);
+        if (objPtr != NULL) {
+            string = Tcl_GetStringFromObj(objPtr, &length);
+        } else if (opPtr->modifier != MODIFIER_NONE) {
+            isNull = 1;
+        } else {
+            Ns_TclPrintfResult(interp, "can't read \"%s\": no such column or variable",
+                               Tcl_GetString(opPtr->nameObj));
+            return TCL_ERROR;
+        }
+        break;
+
+    case VARTYPE_ROWIDX:
+    case VARTYPE_ROWNUM:
+        value.type = DBI_VALUE_WIDE;
+        value.v.w = (Tcl_WideInt)handle->rowIdx + (opPtr->varType == VARTYPE_ROWNUM ? 1 : 0);
+        Tcl_DStringSetLength(scratchPtr, 0);
+        AppendInt(scratchPtr, (unsigned int)value.v.w);
+        string = scratchPtr->string;
+        length = Tcl_DStringLength(scratchPtr);
+        break;
+
+    case VARTYPE_PARITY:
+        string = handle->rowIdx % 2 == 0 ? "even" : "odd";
+        length = (TCL_SIZE_T)strlen(string);
+        break;
+
+    default:
+        index = (unsigned int)opPtr->varType;
+        if (Dbi_ColumnTypedValue(handle, index, &value) != NS_OK) {
+            Dbi_TclErrorResult(interp, handle);
+            return TCL_ERROR;
+        }
+        if (value.type == DBI_VALUE_NULL) {
+            isNull = 1;
+            break;
+        }
+        if (Dbi_ColumnLength(handle, index, &valueLength, &binary) != NS_OK) {
+            Dbi_TclErrorResult(interp, handle);
+            return TCL_ERROR;
+        }
+        if (binary || value.type == DBI_VALUE_BYTES) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("can't substitute binary value in template", -1));
+            return TCL_ERROR;
+        }
+        length = (TCL_SIZE_T)valueLength;
+
+        /*
+         * A conditional only needs to know whether there is a value.
+         */
+
+        if (opPtr->modifier != MODIFIER_COND) {
+            Tcl_DStringSetLength(scratchPtr, length);
+            if (Dbi_ColumnValue(handle, index, scratchPtr->string, valueLength) != NS_OK) {
+                Dbi_TclErrorResult(interp, handle);
+                return TCL_ERROR;
+            }
+            string = scratchPtr->string;
+        }
+        break;
+    }
+
+    if (opPtr->modifier == MODIFIER_COND) {
+        if (isNull || length == 0) {
+            Tcl_DStringAppend(dsPtr, templatePtr->text + opPtr->elseStart, opPtr->elseLength);
+        } else {
+            Tcl_DStringAppend(dsPtr, templatePtr->text + opPtr->thenStart, opPtr->thenLength);
+        }
+        return TCL_OK;
+    }
+
+    /*
+     * Empty values are not formatted, so they too get the default.
+     */
+
+    if (isNull
+        || (length == 0
+            && (opPtr->modifier == MODIFIER_EMPTY || opPtr->format != FORMAT_NONE))) {
+        Tcl_DStringAppend(dsPtr, templatePtr->text + opPtr->elseStart, opPtr->elseLength);
+        return TCL_OK;
+    }
+    if (opPtr->format != FORMAT_NONE) {
+        return AppendFormatted(interp, templatePtr->text + opPtr->fmtStart, opPtr->format,
+                               &value, string, dsPtr, quote);
+    }
+    Quote(dsPtr, string, length, quote);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendFormatted --
+ *
+ *      Format a value as an integer or a double with the given C
+ *      format. A native column value is used as is, otherwise the
+ *      string is converted.
+ *
+ * Results:
+ *      TCL_ERROR if the value is not a number, TCL_OK otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AppendFormatted(Tcl_Interp *interp, const char *format, int type,
+                const Dbi_Value *valuePtr, const char *string,
+                Tcl_DString *dsPtr, Dbi_quotingLevel quote)
+{
+    char         buf[512];
+    char        *end;
+    Tcl_WideInt  w;
+    double       d;
+    int          n;
+
+    if (type == FORMAT_INT) {
+        switch (valuePtr->type) {
+        case DBI_VALUE_INT:
+        case DBI_VALUE_BOOL:
+            w = valuePtr->v.i;
+            break;
+        case DBI_VALUE_WIDE:
+            w = valuePtr->v.w;
+            break;
+        default:
+            w = (Tcl_WideInt)strtoll(string, &end, 10);
+            if (end == string || *end != '\0') {
+                Ns_TclPrintfResult(interp, "expected integer but got \"%s\"", string);
+                return TCL_ERROR;
+            }
+            break;
+        }
+        n = snprintf(buf, sizeof(buf), format, w);
+    } else {
+        switch (valuePtr->type) {
+        case DBI_VALUE_INT:
+        case DBI_VALUE_BOOL:
+            d = valuePtr->v.i;
+            break;
+        case DBI_VALUE_WIDE:
+            d = (double)valuePtr->v.w;
+            break;
+        case DBI_VALUE_DOUBLE:
+            d = valuePtr->v.d;
+            break;
+        default:
+            d = strtod(string, &end);
+            if (end == string || *end != '\0') {
+                Ns_TclPrintfResult(interp, "expected floating-point number but got \"%s\"",
+                                   string);
+                return TCL_ERROR;
+            }
+            break;
+        }
+        n = snprintf(buf, sizeof(buf), format, d);
+    }
+
+    /*
+     * Width and precision are limited to two digits when the template
+     * is compiled, so the result always fits.
+     */
+
+    if (n < 0 || (size_t)n >= sizeof(buf)) {
+        n = (int)strlen(buf);
+    }
+    Quote(dsPtr, buf, (TCL_SIZE_T)n, quote);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendInt --
+ *
+ *      Append the string rep of the given int to the output buffer.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AppendInt(Tcl_DString *dsPtr, unsigned int rowint)
+{
+    char buf[TCL_INTEGER_SPACE];
+
+    snprintf(buf, sizeof(buf), "%u", rowint);
+    Tcl_DStringAppend(dsPtr, buf, TCL_INDEX_NONE);
+}
+
+
+/*
  *----------------------------------------------------------------------
  *
  * GetTemplateFromObj --
  *
- *      ???
+ *      Get the compiled template from the given object, compiling it
+ *      if needed. Templates are compiled into a flat list of text and
+ *      variable instructions. Adjacent runs of text, including a $
+ *      which does not start a variable name, become a single text
+ *      instruction.
  *
  * Results:
  *      Standard Tcl result.
  *
  * Side effects:
- *      None.
+ *      The object is converted to the dbi:template type. Variables
+ *      are resolved to the columns of the current statement.
  *
  *----------------------------------------------------------------------
  */
@@ -535,12 +2426,13 @@ static int
 GetTemplateFromObj(Tcl_Interp *interp, Dbi_Handle *handle, Tcl_Obj *templateObj,
                    Template **templatePtrPtr)
 {
-    Template   *templatePtr;
-    Tcl_Parse  *parsePtr;
-    Tcl_Token  *tokenPtr;
-    char       *string, *p;
-    int         numVarTokens;
-    TCL_SIZE_T  length, varIdx;
+    Template    *templatePtr;
+    Tcl_Parse    parse;
+    Tcl_DString  ds;
+    Op          *opPtr;
+    const char  *string, *p, *name;
+    TCL_SIZE_T   length, nameLength;
+    int          opsAvailable = 0, quote;
 
     /*
      * Check for cached representation.
@@ -548,98 +2440,115 @@ GetTemplateFromObj(Tcl_Interp *interp, Dbi_Handle *handle, Tcl_Obj *templateObj,
 
     if (templateObj->typePtr == &templateType) {
         templatePtr = templateObj->internalRep.otherValuePtr;
-        MapVariablesToColumns(handle, templatePtr);
+        if (handle != NULL) {
+            MapVariablesToColumns(handle, templatePtr);
+        }
         *templatePtrPtr = templatePtr;
         return TCL_OK;
     }
 
     string = p = Tcl_GetStringFromObj(templateObj, &length);
 
-    /*
-     * Initialise the parse struct as in Tcl generic/tclParse.c
-     */
-
-    templatePtr = ns_malloc(sizeof(Template));
-    parsePtr = &templatePtr->parse;
-    parsePtr->tokenPtr = parsePtr->staticTokens;
-    parsePtr->numTokens = 0;
-    parsePtr->tokensAvailable = NUM_STATIC_TOKENS;
-    parsePtr->string = string;
-    parsePtr->end = (string + length);
-    parsePtr->interp = interp;
-    parsePtr->errorType = TCL_PARSE_SUCCESS;
+    templatePtr = ns_calloc(1u, sizeof(Template));
+    templatePtr->refCount = 1;
+    Tcl_DStringInit(&ds);
 
     /*
-     * Scan the string for dollar substitutions. Variables are substituted
-     * and added to the parse struct, everything else is added as text.
+     * Scan the string for dollar substitutions. Variable names are
+     * recorded in the text buffer after any pending run of text.
      */
 
-    numVarTokens = 0;
-
-    while (length) {
-
-        if (*p == '$') {
-            /*
-             * First check for a pending run of text.
-             */
+    while (length > 0) {
 
-            if (p != string) {
-                NewTextToken(parsePtr, string, (int)(p-string));
-                string = p;
-            }
+        if (*p != '$') {
+            p++; length--;
+            continue;
+        }
+        if (Tcl_ParseVarName(interp, p, length, &parse, 0) != TCL_OK) {
+            Tcl_DStringFree(&ds);
+            FreeTemplate(templatePtr);
+            return TCL_ERROR;
+        }
+        if (parse.tokenPtr[0].type == TCL_TOKEN_TEXT) {
 
             /*
-             * Check for a valid variable name.
+             * There isn't a variable name after all: the $ is
+             * just a $ and part of the text.
              */
 
-            varIdx = parsePtr->numTokens;
-            if (Tcl_ParseVarName(interp, p, length, parsePtr, 1) != TCL_OK) {
-                FreeTemplate(templatePtr);
-                return TCL_ERROR;
-            }
-
-            tokenPtr = &parsePtr->tokenPtr[varIdx];
-            if (tokenPtr->type == TCL_TOKEN_TEXT) {
-                /*
-                 * There isn't a variable name after all: the $ is
-                 * just a $.
-                 */
-                parsePtr->numTokens--;
-                p++; length--;
-            }
+            Tcl_FreeParse(&parse);
+            p++; length--;
+            continue;
+        }
 
-            /*
-             * Found a valid variable name.
-             * Advance past all it's components.
-             */
+        if (p != string) {
+            opPtr = NewOp(templatePtr, &opsAvailable);
+            opPtr->varType = VARTYPE_TEXT;
+            opPtr->start = Tcl_DStringLength(&ds);
+            opPtr->length = (TCL_SIZE_T)(p - string);
+            Tcl_DStringAppend(&ds, string, opPtr->length);
+            templatePtr->textLength += opPtr->length;
+        }
 
-            numVarTokens++;
+        /*
+         * Skip the leading $, and the braces of ${name}, which may
+         * carry modifiers and a quoting type for this variable as
+         * ${name%spec|default:type}.
+         */
 
-            p += tokenPtr->size;
-            length -= tokenPtr->size;
-            string = p;
+        name = p + 1;
+        nameLength = parse.tokenPtr[0].size - 1;
+        quote = -1;
+        if (*name == '{') {
+            name++;
+            nameLength -= 2;
+            quote = ParseQuoteSuffix(name, &nameLength);
+        }
 
-        } else {
-            p++; length--;
+        opPtr = NewOp(templatePtr, &opsAvailable);
+        opPtr->varType = VARTYPE_TCL;
+        opPtr->quote = quote;
+        if (p[1] == '{'
+            && ParseModifiers(interp, name, &nameLength, opPtr, &ds) != TCL_OK) {
+            Tcl_FreeParse(&parse);
+            Tcl_DStringFree(&ds);
+            FreeTemplate(templatePtr);
+            return TCL_ERROR;
         }
+        opPtr->start = Tcl_DStringLength(&ds);
+        opPtr->length = nameLength;
+        opPtr->nameObj = Tcl_NewStringObj(name, nameLength);
+        Tcl_IncrRefCount(opPtr->nameObj);
+        Tcl_DStringAppend(&ds, name, nameLength);
+        templatePtr->numVars++;
+
+        p += parse.tokenPtr[0].size;
+        length -= parse.tokenPtr[0].size;
+        string = p;
+        Tcl_FreeParse(&parse);
     }
 
     /*
-     * Add any remaining trailing text, and make sure we found at
-     * least one variable.
+     * Add any remaining trailing text. Headers and footers may be
+     * all text.
      */
 
     if (p != string) {
-        NewTextToken(parsePtr, string, (int)(p-string));
+        opPtr = NewOp(templatePtr, &opsAvailable);
+        opPtr->varType = VARTYPE_TEXT;
+        opPtr->start = Tcl_DStringLength(&ds);
+        opPtr->length = (TCL_SIZE_T)(p - string);
+        Tcl_DStringAppend(&ds, string, opPtr->length);
+        templatePtr->textLength += opPtr->length;
     }
 
-    if (numVarTokens == 0) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("template contains no variables", -1));
-        FreeTemplate(templatePtr);
-        return TCL_ERROR;
-    }
+    templatePtr->text = ns_malloc((size_t)Tcl_DStringLength(&ds) + 1u);
+    memcpy(templatePtr->text, Tcl_DStringValue(&ds), (size_t)Tcl_DStringLength(&ds) + 1u);
+    Tcl_DStringFree(&ds);
 
-    MapVariablesToColumns(handle, templatePtr);
+    if (handle != NULL) {
+        MapVariablesToColumns(handle, templatePtr);
+    }
 
     Ns_TclSetOtherValuePtr(templateObj, &templateType, templatePtr);
     *templatePtrPtr = templatePtr;
@@ -647,18 +2556,229 @@ GetTemplateFromObj(Tcl_Interp *interp, Dbi_Handle *handle, Tcl_Obj *templateObj,
     return TCL_OK;
 }
 
-
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DbiTemplateVariables --
+ *
+ *      Append the name and value of each Tcl variable a template may
+ *      substitute to a fragment cache key. Which names are columns is
+ *      only known once the query has run, so every variable of the
+ *      template which is set is included. Unset variables are left
+ *      out, which tells them apart from empty ones.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      The template object is converted to dbi:template type.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+DbiTemplateVariables(Tcl_Interp *interp, Tcl_Obj *templateObj, Tcl_DString *dsPtr)
+{
+    Template   *templatePtr;
+    const Op   *opPtr;
+    Tcl_Obj    *valueObj;
+    int         opIdx;
+
+    if (GetTemplateFromObj(interp, NULL, templateObj, &templatePtr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    for (opIdx = 0; opIdx < templatePtr->numOps; opIdx++) {
+        opPtr = &templatePtr->ops[opIdx];
+        if (opPtr->nameObj == NULL) {
+            continue;
+        }
+        valueObj = Tcl_ObjGetVar2(interp, opPtr->nameObj, NULL, 0);
+        if (valueObj != NULL) {
+            Tcl_DStringAppendElement(dsPtr, Tcl_GetString(opPtr->nameObj));
+            Tcl_DStringAppendElement(dsPtr, Tcl_GetString(valueObj));
+        }
+    }
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseQuoteSuffix --
+ *
+ *      Check for a quoting type after the last colon of a braced
+ *      variable name.
+ *
+ * Results:
+ *      The Dbi_quotingLevel, or -1 if there is none. The name length
+ *      is updated to exclude the suffix.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseQuoteSuffix(const char *name, TCL_SIZE_T *lengthPtr)
+{
+    const char *colon;
+    TCL_SIZE_T  suffixLength;
+    size_t      i;
+
+    if (*lengthPtr < 3) {
+        return -1;
+    }
+    for (colon = name + *lengthPtr - 1; colon > name && *colon != ':'; colon--) {
+        ;
+    }
+    if (colon == name || colon[-1] == ':' || colon[-1] == '?') {
+        return -1;
+    }
+    suffixLength = *lengthPtr - (TCL_SIZE_T)(colon - name) - 1;
+
+    for (i = 0; i < sizeof(quoteNames) / sizeof(quoteNames[0]); i++) {
+        if (strncmp(quoteNames[i].name, colon + 1, (size_t)suffixLength) == 0
+            && quoteNames[i].name[suffixLength] == '\0') {
+            *lengthPtr = (TCL_SIZE_T)(colon - name);
+            return (int)quoteNames[i].quote;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseModifiers --
+ *
+ *      Parse the modifiers which may follow the name of a braced
+ *      variable, once any quoting type has been removed:
+ *
+ *          name%spec       printf style numeric format
+ *          name|text       text if the value is NULL
+ *          name?:text      text if the value is NULL or empty
+ *          name?then|else  then if the value is not NULL or empty,
+ *                          else otherwise
+ *
+ *      A format may precede the other modifiers. The format spec is
+ *      the usual flags, a width and precision of up to two digits
+ *      and one of the conversions d i u o x X e E f g G.
+ *
+ * Results:
+ *      Standard Tcl result. The name length is updated to exclude the
+ *      modifiers.
+ *
+ * Side effects:
+ *      The modifier texts and the C format are appended to the
+ *      template text buffer and recorded in the instruction.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseModifiers(Tcl_Interp *interp, const char *name, TCL_SIZE_T *lengthPtr,
+               Op *opPtr, Tcl_DString *textPtr)
+{
+    const char *p, *end, *spec, *bar;
+    int         digits;
+    char        conv;
+
+    end = name + *lengthPtr;
+    for (p = name; p < end && *p != '%' && *p != '|' && *p != '?'; p++) {
+        ;
+    }
+    if (p == end) {
+        return TCL_OK;
+    }
+    *lengthPtr = (TCL_SIZE_T)(p - name);
+
+    if (*p == '%') {
+        spec = p++;
+        while (p < end && strchr("-+ #0", *p) != NULL) {
+            p++;
+        }
+        for (digits = 0; p < end && digits < 2 && *p >= '0' && *p <= '9'; digits++) {
+            p++;
+        }
+        if (p < end && *p == '.') {
+            p++;
+            for (digits = 0; p < end && digits < 2 && *p >= '0' && *p <= '9'; digits++) {
+                p++;
+            }
+        }
+        conv = p < end ? *p++ : '\0';
+        if (conv != '\0' && strchr("diuoxX", conv) != NULL) {
+            opPtr->format = FORMAT_INT;
+        } else if (conv != '\0' && strchr("eEfgG", conv) != NULL) {
+            opPtr->format = FORMAT_DOUBLE;
+        }
+        if (opPtr->format == FORMAT_NONE
+            || (p < end && *p != '|' && *p != '?')) {
+            Ns_TclPrintfResult(interp, "invalid format \"%.*s\" for template variable \"%.*s\"",
+                               (int)(end - spec), spec, (int)*lengthPtr, name);
+            return TCL_ERROR;
+        }
+
+        /*
+         * Integers are formatted as Tcl_WideInt.
+         */
+
+        opPtr->fmtStart = Tcl_DStringLength(textPtr);
+        Tcl_DStringAppend(textPtr, spec, (TCL_SIZE_T)(p - spec - 1));
+        if (opPtr->format == FORMAT_INT) {
+            Tcl_DStringAppend(textPtr, TCL_LL_MODIFIER, TCL_INDEX_NONE);
+            conv = conv == 'i' ? 'd' : conv;
+        }
+        Tcl_DStringAppend(textPtr, &conv, 1);
+        Tcl_DStringAppend(textPtr, "", 1);
+    }
+
+    if (p == end) {
+        return TCL_OK;
+    }
+    if (*p == '|') {
+        opPtr->modifier = MODIFIER_NULL;
+        p++;
+    } else if (p + 1 < end && p[1] == ':') {
+        opPtr->modifier = MODIFIER_EMPTY;
+        p += 2;
+    } else {
+        opPtr->modifier = MODIFIER_COND;
+        p++;
+        bar = memchr(p, '|', (size_t)(end - p));
+        if (bar == NULL) {
+            bar = end;
+        }
+        opPtr->thenStart = Tcl_DStringLength(textPtr);
+        opPtr->thenLength = (TCL_SIZE_T)(bar - p);
+        Tcl_DStringAppend(textPtr, p, opPtr->thenLength);
+        p = bar < end ? bar + 1 : end;
+    }
+    opPtr->elseStart = Tcl_DStringLength(textPtr);
+    opPtr->elseLength = (TCL_SIZE_T)(end - p);
+    Tcl_DStringAppend(textPtr, p, opPtr->elseLength);
+
+    return TCL_OK;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
  * MapVariablesToColumns
  *
- *      Map variable tokens (only, skip text tokens) to result
- *      column indexes.
+ *      Resolve the variable instructions to result column indexes,
+ *      once per statement. The mappings of the last TEMPLATE_MAPS
+ *      statements are kept, so returning to one of them only copies
+ *      the remembered types.
  *
- *      Variables without matching columns are marked '-1' and will
- *      be substituted as Tcl variables when the template is
- *      substitited.
+ *      Variables without matching columns are resolved to special
+ *      dbi variables or marked VARTYPE_TCL and will be substituted
+ *      as Tcl variables when the template is substituted.
  *
  * Results:
  *      None.
@@ -672,37 +2792,65 @@ GetTemplateFromObj(Tcl_Interp *interp, Dbi_Handle *handle, Tcl_Obj *templateObj,
 static void
 MapVariablesToColumns(Dbi_Handle *handle, Template *templatePtr)
 {
-    Tcl_Parse     *parsePtr = &templatePtr->parse;
-    int           *varColMap = templatePtr->varColMap;
-    Tcl_Token     *tokenPtr;
-    const char    *tokenString, *colName;
-    int            varIdx;
-    size_t         i, colIdx, numCols;
-    TCL_SIZE_T     tokIdx, tokenSize;
+    Op            *opPtr;
+    const char    *name, *colName;
+    unsigned long  serial;
+    unsigned int   colIdx, numCols;
+    size_t         i;
+    int            opIdx, varIdx, *varTypes;
+
+    serial = Dbi_StatementSerial(handle);
+    if (serial == templatePtr->serial) {
+        return;
+    }
+    templatePtr->serial = serial;
+
+    /*
+     * Reuse the mapping of a recently seen statement.
+     */
+
+    for (i = 0; i < TEMPLATE_MAPS; i++) {
+        if (templatePtr->maps[i].serial == serial) {
+            varTypes = templatePtr->maps[i].varTypes;
+            for (opIdx = 0, varIdx = 0; opIdx < templatePtr->numOps; opIdx++) {
+                if (templatePtr->ops[opIdx].nameObj != NULL) {
+                    templatePtr->ops[opIdx].varType = varTypes[varIdx++];
+                }
+            }
+            return;
+        }
+    }
+
+    /*
+     * Compute a new mapping and remember it in place of the oldest.
+     */
+
+    i = (size_t)templatePtr->nextMap;
+    templatePtr->nextMap = (templatePtr->nextMap + 1) % TEMPLATE_MAPS;
+    if (templatePtr->maps[i].varTypes == NULL) {
+        templatePtr->maps[i].varTypes = ns_malloc((size_t)templatePtr->numVars * sizeof(int));
+    }
+    templatePtr->maps[i].serial = serial;
+    varTypes = templatePtr->maps[i].varTypes;
+    varIdx = 0;
 
     numCols = Dbi_NumColumns(handle);
 
-    for (tokIdx = 0, varIdx = 0;
-         tokIdx < parsePtr->numTokens;
-         tokIdx += tokenPtr->numComponents + 1) {
+    for (opIdx = 0; opIdx < templatePtr->numOps; opIdx++) {
 
-        tokenPtr = &parsePtr->tokenPtr[tokIdx];
-        if (tokenPtr->type != TCL_TOKEN_VARIABLE) {
+        opPtr = &templatePtr->ops[opIdx];
+        if (opPtr->nameObj == NULL) {
             continue;
         }
+        name = templatePtr->text + opPtr->start;
 
-        /* Skip past leading '$' */
-        tokenString = tokenPtr->start +1;
-        tokenSize   = tokenPtr->size  -1;
-
-        varColMap[varIdx] = VARTYPE_TCL;
+        opPtr->varType = VARTYPE_TCL;
 
         for (colIdx = 0; colIdx < numCols; colIdx++) {
-
-            Dbi_ColumnName(handle, (unsigned int)colIdx, &colName);
-
-            if (strncmp(colName, tokenString, (size_t)tokenSize) == 0) {
-                varColMap[varIdx] = (int)colIdx;
+            if (Dbi_ColumnName(handle, colIdx, &colName) == NS_OK
+                && strncmp(colName, name, (size_t)opPtr->length) == 0
+                && colName[opPtr->length] == '\0') {
+                opPtr->varType = (int)colIdx;
                 break;
             }
         }
@@ -711,26 +2859,27 @@ MapVariablesToColumns(Dbi_Handle *handle, Template *templatePtr)
          * Check for special variables.
          */
 
-        if (varColMap[varIdx] == VARTYPE_TCL) {
+        if (opPtr->varType == VARTYPE_TCL) {
             for (i = 0; i < sizeof(specials) / sizeof(specials[0]); i++) {
-                if (strncmp(specials[i].varName, tokenString, (size_t)tokenSize) == 0) {
-                    varColMap[varIdx] = specials[i].type;
+                if (strncmp(specials[i].varName, name, (size_t)opPtr->length) == 0
+                    && specials[i].varName[opPtr->length] == '\0') {
+                    opPtr->varType = specials[i].type;
+                    break;
                 }
             }
         }
-
-        varIdx++;
+        varTypes[varIdx++] = opPtr->varType;
     }
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * FreeTemplateObj, FreeTemplate --
+ * FreeTemplateObj, DupTemplateObj, FreeTemplate --
  *
- *      Free the internal rep of a template object. Called by Tcl
- *      when the variable disappears.
+ *      Free or share the internal rep of a template object. Called by
+ *      Tcl when the variable disappears or the object is duplicated.
  *
  * Results:
  *      None.
@@ -747,26 +2896,50 @@ FreeTemplateObj(Tcl_Obj *objPtr)
     Template  *templatePtr;
 
     templatePtr = objPtr->internalRep.otherValuePtr;
-    FreeTemplate(templatePtr);
+    if (--templatePtr->refCount == 0) {
+        FreeTemplate(templatePtr);
+    }
+}
+
+static void
+DupTemplateObj(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr)
+{
+    Template  *templatePtr;
+
+    templatePtr = srcPtr->internalRep.otherValuePtr;
+    templatePtr->refCount++;
+    dupPtr->internalRep.otherValuePtr = templatePtr;
+    dupPtr->typePtr = &templateType;
 }
 
 static void
 FreeTemplate(Template *templatePtr)
 {
-    Tcl_FreeParse(&templatePtr->parse);
+    int opIdx, i;
+
+    for (opIdx = 0; opIdx < templatePtr->numOps; opIdx++) {
+        if (templatePtr->ops[opIdx].nameObj != NULL) {
+            Tcl_DecrRefCount(templatePtr->ops[opIdx].nameObj);
+        }
+    }
+    for (i = 0; i < TEMPLATE_MAPS; i++) {
+        ns_free(templatePtr->maps[i].varTypes);
+    }
+    ns_free(templatePtr->ops);
+    ns_free(templatePtr->text);
     ns_free(templatePtr);
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * NewTextToken --
+ * NewOp --
  *
- *      Add a run of text to the Tcl_Parse structure.
+ *      Add an instruction to the template.
  *
  * Results:
- *      None.
+ *      Pointer to the zeroed instruction.
  *
  * Side effects:
  *      Memory may be allocated.
@@ -774,36 +2947,23 @@ FreeTemplate(Template *templatePtr)
  *----------------------------------------------------------------------
  */
 
-static void
-NewTextToken(Tcl_Parse *parsePtr, char *string, int length)
+static Op *
+NewOp(Template *templatePtr, int *opsAvailablePtr)
 {
-    Tcl_Token  *tokenPtr;
-
-    if (parsePtr->numTokens == parsePtr->tokensAvailable) {
-        /*
-         * Expand the token array.
-         */
-        TCL_SIZE_T newCount = parsePtr->tokensAvailable * 2;
+    Op *opPtr;
 
-        tokenPtr = (Tcl_Token *) ckalloc((unsigned) ((size_t)newCount * sizeof(Tcl_Token)));
-        memcpy((void *) tokenPtr, (void *) parsePtr->tokenPtr,
-               ((size_t)parsePtr->tokensAvailable * sizeof(Tcl_Token)));
-        if (parsePtr->tokenPtr != parsePtr->staticTokens) {
-            ckfree((char *) parsePtr->tokenPtr);
-        }
-        parsePtr->tokenPtr = tokenPtr;
-        parsePtr->tokensAvailable = newCount;
+    if (templatePtr->numOps == *opsAvailablePtr) {
+        *opsAvailablePtr = *opsAvailablePtr > 0 ? *opsAvailablePtr * 2 : 8;
+        templatePtr->ops = ns_realloc(templatePtr->ops,
+                                      (size_t)*opsAvailablePtr * sizeof(Op));
     }
+    opPtr = &templatePtr->ops[templatePtr->numOps++];
+    memset(opPtr, 0, sizeof(Op));
 
-    tokenPtr = &parsePtr->tokenPtr[parsePtr->numTokens];
-    tokenPtr->type = TCL_TOKEN_TEXT;
-    tokenPtr->numComponents = 0;
-    tokenPtr->start = string;
-    tokenPtr->size = length;
-    parsePtr->numTokens++;
+    return opPtr;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
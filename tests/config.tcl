@@ -17,6 +17,9 @@ ns_param   home           $homedir
 ns_param   tcllibrary     $bindir/../tcl
 ns_param   logdebug       false
 
+ns_section "ns/module/nsdbi"
+ns_param   renderthreads  2               ;# fewer than -parallel in tests
+
 ns_section "ns/modules"
 ns_param   nssock         $bindir/nssock.so
 ns_param   global1        $homedir/nsdbitest.so
@@ -48,6 +51,11 @@ ns_param   db1           $homedir/nsdbitest.so
 ns_param   db2           $homedir/nsdbitest.so
 ns_param   OPENERR         $homedir/nsdbitest.so ;# nsdbitest will error on open
 ns_param   OPENERR0        $homedir/nsdbitest.so
+ns_param   OPENERR2        $homedir/nsdbitest.so ;# circuit breaker
+ns_param   slowclose       $homedir/nsdbitest.so ;# nsdbitest takes 1s to close
+ns_param   slowclose2      $homedir/nsdbitest.so ;# ...and handles age out quickly
+ns_param   nativelist      $homedir/nsdbitest.so ;# binds :name[] as an array
+ns_param   typed           $homedir/nsdbitest.so ;# returns native column values
 
 #
 # Database configuration.
@@ -69,9 +77,28 @@ ns_param   checkinterval   30          ;# Check for stale handles every 15 secon
 
 ns_section "ns/server/server1/module/db2"
 ns_param   maxhandles      1 ;# Set low for timeout test.
+ns_param   validationinterval 1s     ;# Ping handles idle for longer.
 
 ns_section "ns/server/server1/module/OPENERR"
 ns_param   maxhandles      1
 
 ns_section "ns/server/server1/module/OPENERR0"
 ns_param   maxhandles      0
+
+ns_section "ns/server/server1/module/slowclose"
+ns_param   maxhandles      1
+
+ns_section "ns/server/server1/module/slowclose2"
+ns_param   maxhandles      4
+ns_param   maxopen         1           ;# Age out every second for stress test.
+
+ns_section "ns/server/server1/module/nativelist"
+ns_param   maxhandles      1
+
+ns_section "ns/server/server1/module/typed"
+ns_param   maxhandles      1
+
+ns_section "ns/server/server1/module/OPENERR2"
+ns_param   maxhandles      1
+ns_param   breakerthreshold 2
+ns_param   breakerbackoff  1h          ;# Keep the breaker open during the tests.